@@ -8,15 +8,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <limits.h>
-#include <libelf.h>
-#include <gelf.h>
 
 #include <i8x/libi8x.h>
 
-#ifndef NT_GNU_INFINITY
-#  define NT_GNU_INFINITY 5
-#endif
-
 static void __attribute__ ((__noreturn__,  format (printf, 1, 2)))
 error (const char *fmt, ...)
 {
@@ -42,154 +36,20 @@ error_i8x (struct i8x_ctx *ctx, i8x_err_e code)
   exit (EXIT_FAILURE);
 }
 
-static void *
-xcalloc (size_t nmemb, size_t size)
-{
-  void *ptr = calloc (nmemb, size);
-
-  if (ptr == NULL)
-    error ("out of memory");
-
-  return ptr;
-}
-
-static char *
-xstrdup (const char *s)
-{
-  char *t = strdup (s);
-
-  if (t == NULL)
-    error ("out of memory");
-
-  return t;
-}
-
-struct list_entry
-{
-  struct list_entry *next;
-  void *item;
-};
-
-struct elffile
-{
-  const char *filename;
-};
-
 struct userdata
 {
   pid_t pid; /* The PID of the process we are investigating.  */
-  struct list_entry *elfs; /* List of ELFs loaded from this process.  */
 };
 
-static void
-process_notes (struct i8x_ctx *ctx,
-	       struct elffile *ef, size_t scn_offset,
-	       Elf_Data *data)
-{
-  size_t offset = 0;
-  GElf_Nhdr nhdr;
-  size_t name_offset;
-  size_t desc_offset;
-
-  if (data == NULL)
-    error ("%s: can't access note section at 0x%x", ef->filename,
-	   scn_offset);
-
-  while (offset < data->d_size
-	 && (offset = gelf_getnote (data, offset,
-				    &nhdr, &name_offset,
-				    &desc_offset)) > 0)
-    {
-      const char *name = (const char *) data->d_buf + name_offset;
-      const char *desc = (const char *) data->d_buf + desc_offset;
-      struct i8x_note *note;
-      struct i8x_func *func;
-      i8x_err_e err;
-
-      if (strncmp (name, "GNU", 4) || nhdr.n_type != NT_GNU_INFINITY)
-	continue;
-
-      /* Create the i8x_note.  */
-      err = i8x_note_new_from_buf (ctx, desc, nhdr.n_descsz,
-				   ef->filename,
-				   scn_offset + desc_offset, &note);
-      if (err != I8X_OK)
-	error_i8x (ctx, err);
-
-      /* Create a function from the note.  */
-      err = i8x_func_new_from_note (note, &func);
-      i8x_note_unref (note);
-      if (err != I8X_OK)
-	error_i8x (ctx, err);
-
-      /* Register the function.  */
-      err = i8x_ctx_register_func (ctx, func);
-      i8x_func_unref (func);
-      if (err != I8X_OK)
-	error_i8x (ctx, err);
-    }
-}
-
-static void
-process_elffile (struct i8x_ctx *ctx, const char *filename, Elf *elf)
-{
-  struct userdata *ud = (struct userdata *) i8x_ctx_get_userdata (ctx);
-  struct list_entry *le;
-  struct elffile *ef;
-  Elf_Scn *scn = NULL;
-
-  /* Skip this file if we already processed it.  */
-  for (le = ud->elfs; le != NULL; le = le->next)
-    {
-      ef = (struct elffile *) le->item;
-      if (!strcmp (ef->filename, filename))
-	return;
-    }
-
-  ef = xcalloc (1, sizeof (struct elffile));
-  ef->filename = xstrdup (filename);
-
-  /* Extract what we need.  */
-  while ((scn = elf_nextscn (elf, scn)) != NULL)
-    {
-      GElf_Shdr shdr_mem;
-      GElf_Shdr *shdr = gelf_getshdr (scn, &shdr_mem);
-
-      if (shdr == NULL)
-	continue;
-
-      switch (shdr->sh_type)
-	{
-	case SHT_NOTE:
-	  process_notes (ctx, ef, shdr->sh_offset,
-			 elf_getdata (scn, NULL));
-	  break;
-	}
-    }
-
-  /* Hook the processed file into our list.  */
-  le = xcalloc (1, sizeof (struct list_entry));
-  le->item = ef;
-  le->next = ud->elfs;
-  ud->elfs = le;
-}
-
 static void
 process_mapping (struct i8x_ctx *ctx, const char *filename)
 {
-  int fd;
-  Elf *elf;
-
-  fd = open (filename, O_RDONLY);
-  if (fd == -1)
-    error ("%s: %s", filename, strerror (errno));
-
-  elf = elf_begin (fd, ELF_C_READ_MMAP, NULL);
-  if (elf_kind (elf) == ELF_K_ELF)
-    process_elffile (ctx, filename, elf);
+  i8x_err_e err;
 
-  elf_end (elf);
-  close (fd);
+  /* Files we've already processed are skipped by libi8x.  */
+  err = i8x_ctx_load_elf (ctx, filename, NULL);
+  if (err != I8X_OK)
+    error_i8x (ctx, err);
 }
 
 static void
@@ -253,7 +113,6 @@ tlsdump_process (pid_t pid)
     error_i8x (NULL, err);
 
   ud.pid = pid;
-  ud.elfs = NULL;
   i8x_ctx_set_userdata (ctx, &ud, NULL);
 
   read_mappings (ctx);
@@ -275,12 +134,11 @@ tlsdump_process (pid_t pid)
       if (err != I8X_OK)
 	error_i8x (ctx, err);
 
-      printf ("%d! = %d\n", i, rets[0].i);
+      printf ("%d! = %ld\n", i, (long) rets[0].i);
     }
 
   i8x_funcref_unref (fr);
 
-  /* XXX free stuff in userdata e.g. the list of ELF files  */
   i8x_ctx_unref (ctx);
 }
 
@@ -292,9 +150,6 @@ main (int argc, char *argv[])
   if (argc < 2)
     error ("usage: %s PID...", argv[0]);
 
-  /* Initialize libelf.  */
-  elf_version (EV_CURRENT);
-
   for (i = 1; i < argc; i++)
     {
       char *endptr;
@@ -0,0 +1,182 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include <string.h>
+#include "libi8x-private.h"
+
+/* Memory allocators for objects.  Arenas hand out memory from large
+   blocks and release it all at once.  Slabs are arenas with a free
+   list for each size class, so memory released by one object can
+   be reused by the next object of a similar size.  Neither is
+   thread-safe: like the objects they hold, they must only be used
+   from one thread at a time.  */
+
+struct i8x_arena_block
+{
+  struct i8x_arena_block *next;
+};
+
+/* Arenas start small, because most notes have only a few chunks,
+   and double the size of each new block up to a limit.  */
+#define ARENA_MIN_BLOCK_SIZE 512
+#define ARENA_MAX_BLOCK_SIZE 65536
+
+/* Every allocation is aligned to this.  */
+#define ALIGNMENT 16
+
+#define ALIGN_UP(size) (((size) + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1))
+
+/* Space at the start of each block reserved for its header.  */
+#define BLOCK_HEADER_SIZE ALIGN_UP (sizeof (struct i8x_arena_block))
+
+void
+i8x_arena_init (struct i8x_arena *arena)
+{
+  memset (arena, 0, sizeof (*arena));
+}
+
+/* Allocate SIZE bytes of zeroed memory from ARENA.  Returns NULL if
+   out of memory.  */
+
+void *
+i8x_arena_alloc (struct i8x_arena *arena, size_t size)
+{
+  void *result;
+
+  size = ALIGN_UP (size);
+
+  if (size > (size_t) (arena->limit - arena->ptr))
+    {
+      size_t block_size = BLOCK_HEADER_SIZE + size;
+      struct i8x_arena_block *block;
+
+      if (arena->block_size == 0)
+	arena->block_size = ARENA_MIN_BLOCK_SIZE;
+      else if (arena->block_size < ARENA_MAX_BLOCK_SIZE)
+	arena->block_size *= 2;
+
+      if (block_size < arena->block_size)
+	block_size = arena->block_size;
+
+      block = calloc (1, block_size);
+      if (block == NULL)
+	return NULL;
+
+      block->next = arena->blocks;
+      arena->blocks = block;
+
+      arena->ptr = (char *) block + BLOCK_HEADER_SIZE;
+      arena->limit = (char *) block + block_size;
+    }
+
+  result = arena->ptr;
+  arena->ptr += size;
+
+  return result;
+}
+
+/* Release all memory allocated from ARENA.  */
+
+void
+i8x_arena_release (struct i8x_arena *arena)
+{
+  struct i8x_arena_block *block = arena->blocks;
+
+  while (block != NULL)
+    {
+      struct i8x_arena_block *next = block->next;
+
+      free (block);
+      block = next;
+    }
+
+  i8x_arena_init (arena);
+}
+
+/* Slabs.  Sizes are rounded up to a multiple of ALIGNMENT to give
+   the size classes.  Allocations too large for any size class go
+   straight to calloc and free.  */
+
+struct i8x_slab_free
+{
+  struct i8x_slab_free *next;
+};
+
+static size_t
+size_class (size_t size)
+{
+  return (ALIGN_UP (size) / ALIGNMENT) - 1;
+}
+
+void
+i8x_slab_init (struct i8x_slab *slab)
+{
+  memset (slab, 0, sizeof (*slab));
+  i8x_arena_init (&slab->arena);
+}
+
+/* Allocate SIZE bytes of zeroed memory from SLAB.  Returns NULL if
+   out of memory.  */
+
+void *
+i8x_slab_alloc (struct i8x_slab *slab, size_t size)
+{
+  size_t index = size_class (size);
+  struct i8x_slab_free *item;
+
+  if (index >= I8X_SLAB_NUM_CLASSES)
+    return calloc (1, size);
+
+  item = slab->freelists[index];
+  if (item == NULL)
+    return i8x_arena_alloc (&slab->arena, size);
+
+  slab->freelists[index] = item->next;
+  memset (item, 0, ALIGN_UP (size));
+
+  return item;
+}
+
+/* Return PTR, which was allocated from SLAB with size SIZE.  */
+
+void
+i8x_slab_free (struct i8x_slab *slab, void *ptr, size_t size)
+{
+  size_t index = size_class (size);
+  struct i8x_slab_free *item = ptr;
+
+  if (index >= I8X_SLAB_NUM_CLASSES)
+    {
+      free (ptr);
+      return;
+    }
+
+  item->next = slab->freelists[index];
+  slab->freelists[index] = item;
+}
+
+/* Release all memory allocated from SLAB, except for allocations
+   too large for a size class, which must be freed individually.  */
+
+void
+i8x_slab_release (struct i8x_slab *slab)
+{
+  i8x_arena_release (&slab->arena);
+  i8x_slab_init (slab);
+}
@@ -0,0 +1,219 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include <pthread.h>
+#include <unistd.h>
+#include "libi8x-private.h"
+
+/* Loading a note happens in three phases.  Creating functions from
+   notes touches the context (interning funcrefs, symrefs and types,
+   and referencing the context itself) so it happens serially on the
+   calling thread.  Compiling the bytecode only touches the function
+   being compiled, so functions are compiled in parallel.  Finally,
+   the functions are registered serially in the order they were
+   supplied, as a single update.  */
+
+struct i8x_batch
+{
+  struct i8x_func **funcs;	/* The functions to compile.  */
+  size_t num_funcs;		/* Size of the above.  */
+
+  struct i8x_error_sink *errors;  /* One per function.  */
+
+  size_t next_job;		/* Index of the next function.  */
+  bool failed;			/* True if any compilation failed.  */
+};
+
+/* Compile functions from BATCH until there are none left.  Once any
+   compilation fails the remaining functions are abandoned: they all
+   have higher indexes than every function already started, so the
+   lowest-indexed failure is always found.  */
+
+static void *
+i8x_batch_worker (void *arg)
+{
+  struct i8x_batch *batch = arg;
+
+  while (!__atomic_load_n (&batch->failed, __ATOMIC_RELAXED))
+    {
+      size_t index = __atomic_fetch_add (&batch->next_job, 1,
+					 __ATOMIC_RELAXED);
+      struct i8x_error_sink *sink, *old_sink;
+      i8x_err_e err;
+
+      if (index >= batch->num_funcs)
+	break;
+
+      sink = &batch->errors[index];
+
+      old_sink = i8x_ctx_set_error_sink (sink);
+      err = i8x_func_compile (batch->funcs[index]);
+      i8x_ctx_set_error_sink (old_sink);
+
+      sink->code = err;
+      if (err != I8X_OK)
+	__atomic_store_n (&batch->failed, true, __ATOMIC_RELAXED);
+    }
+
+  return NULL;
+}
+
+static unsigned int
+default_num_threads (void)
+{
+  long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+  return ncpus > 0 ? ncpus : 1;
+}
+
+/* Compile every function in BATCH using up to NUM_THREADS threads,
+   including the calling thread.  Returns the index of the first
+   function that failed to compile, or BATCH->num_funcs if all
+   compiled successfully.  */
+
+static size_t
+i8x_batch_compile (struct i8x_batch *batch, unsigned int num_threads)
+{
+  pthread_t *threads = NULL;
+  unsigned int num_started = 0;
+  size_t i;
+
+  if (num_threads > batch->num_funcs)
+    num_threads = batch->num_funcs;
+
+  if (num_threads > 1)
+    threads = calloc (num_threads - 1, sizeof (pthread_t));
+
+  /* If we can't allocate or start threads then the calling thread
+     simply does more of the work.  */
+  if (threads != NULL)
+    {
+      while (num_started < num_threads - 1)
+	{
+	  if (pthread_create (&threads[num_started], NULL,
+			      i8x_batch_worker, batch) != 0)
+	    break;
+
+	  num_started++;
+	}
+    }
+
+  i8x_batch_worker (batch);
+
+  for (i = 0; i < num_started; i++)
+    pthread_join (threads[i], NULL);
+
+  if (threads != NULL)
+    free (threads);
+
+  for (i = 0; i < batch->num_funcs; i++)
+    if (batch->errors[i].code != I8X_OK)
+      break;
+
+  return i;
+}
+
+/**
+ * i8x_ctx_register_notes:
+ * @ctx: i8x library context
+ * @notes: array of notes to create functions from
+ * @num_notes: number of notes in the array
+ * @num_threads: maximum number of threads to use, or 0 to
+ *               use one per online processor
+ *
+ * Create functions from a batch of notes and register them with
+ * @ctx.  Validating and compiling the functions' bytecode happens
+ * in parallel on up to @num_threads threads, one of which is the
+ * calling thread.  The context's log function may be called from
+ * any of these threads.
+ *
+ * The result is as if i8x_func_new_from_note and
+ * i8x_ctx_register_func were called on each note in turn, except
+ * that either every function is registered or none are.  If more
+ * than one note is rejected then the error returned is that of the
+ * first rejected note in @notes.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_ctx_register_notes (struct i8x_ctx *ctx, struct i8x_note **notes,
+			size_t num_notes, unsigned int num_threads)
+{
+  struct i8x_batch batch = {NULL};
+  size_t i, num_created;
+  i8x_err_e err;
+
+  if (num_notes == 0)
+    return I8X_OK;
+
+  if (num_threads == 0)
+    num_threads = default_num_threads ();
+
+  /* Start logging now, so the workers don't race to do it.  */
+  i8x_ctx_start_logging (ctx);
+
+  batch.funcs = calloc (num_notes, sizeof (struct i8x_func *));
+  batch.errors = calloc (num_notes, sizeof (struct i8x_error_sink));
+  if (batch.funcs == NULL || batch.errors == NULL)
+    {
+      err = i8x_out_of_memory (ctx);
+      goto cleanup;
+    }
+
+  /* Phase 1: create the functions.  If this fails we still compile
+     the functions before the failure, because any error they raise
+     takes precedence.  */
+  for (num_created = 0; num_created < num_notes; num_created++)
+    {
+      err = i8x_func_new_uncompiled (notes[num_created],
+				     &batch.funcs[num_created]);
+      if (err != I8X_OK)
+	break;
+    }
+
+  /* Phase 2: compile the functions.  */
+  batch.num_funcs = num_created;
+  i = i8x_batch_compile (&batch, num_threads);
+  if (i < num_created)
+    {
+      struct i8x_error_sink *error = &batch.errors[i];
+
+      err = i8x_ctx_set_error (ctx, error->code, error->note, error->ptr);
+      goto cleanup;
+    }
+  else if (err != I8X_OK)
+    goto cleanup;
+
+  /* Phase 3: register the functions.  */
+  err = i8x_ctx_register_funcs (ctx, batch.funcs, num_created);
+
+ cleanup:
+  if (batch.funcs != NULL)
+    {
+      for (i = 0; i < num_notes; i++)
+	i8x_func_unref (batch.funcs[i]);
+
+      free (batch.funcs);
+    }
+
+  if (batch.errors != NULL)
+    free (batch.errors);
+
+  return err;
+}
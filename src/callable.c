@@ -0,0 +1,376 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "libi8x-private.h"
+#include "interp-private.h"
+#include "funcref-private.h"
+#include "xctx-private.h"
+
+/* Callables bind a function reference to an execution context, and
+   remember what the reference resolved to so calls don't have to
+   look it up.  What they remember is only reread when the context's
+   resolution epoch changes.  A call registered with the execution
+   context in the epoch the function was read in keeps the function
+   from being released, exactly as it would if the call had read the
+   function itself.  */
+
+struct i8x_callable
+{
+  I8X_OBJECT_FIELDS;
+
+  struct i8x_xctx *xctx;	/* The execution context to call with.  */
+  struct i8x_funcref *ref;	/* The function reference to call.  */
+
+  int num_args;			/* Number of arguments.  */
+  int num_rets;			/* Number of returns.  */
+
+  /* The resolution epoch the fields below were read in, or 0 if
+     they have not been read.  */
+  uint64_t epoch;
+
+  /* What the reference resolved to in that epoch.  The callable
+     holds no reference to the function.  */
+  struct i8x_func *func;
+  i8x_nat_fn_t *native_impl;
+  union i8x_nat_typed_fn typed_impl;
+  struct i8x_code *code;
+};
+
+static void
+i8x_callable_unlink (struct i8x_object *ob)
+{
+  struct i8x_callable *callable = (struct i8x_callable *) ob;
+
+  callable->xctx = i8x_xctx_unref (callable->xctx);
+  callable->ref = i8x_funcref_unref (callable->ref);
+}
+
+const struct i8x_object_ops i8x_callable_ops =
+  {
+    "callable",			/* Object name.  */
+    sizeof (struct i8x_callable),	/* Object size.  */
+    i8x_callable_unlink,	/* Unlink function.  */
+    NULL,			/* Free function.  */
+  };
+
+/**
+ * i8x_callable_new:
+ * @xctx: the execution context to make calls with
+ * @ref: the function reference to call
+ * @callable: location to store the new callable
+ *
+ * Create a callable that calls @ref using @xctx.  Calls through a
+ * callable don't look up what @ref resolves to unless the context
+ * has been updated since the last call.  @ref need not be resolved
+ * until the first call.  Callables may be used on whichever thread
+ * is using @xctx.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_callable_new (struct i8x_xctx *xctx, struct i8x_funcref *ref,
+		  struct i8x_callable **callable)
+{
+  struct i8x_ctx *ctx = i8x_xctx_get_ctx (xctx);
+  struct i8x_type *type = i8x_funcref_get_type (ref);
+  struct i8x_callable *c;
+  i8x_err_e err;
+
+  err = i8x_ob_new (ctx, &i8x_callable_ops, &c);
+  if (err != I8X_OK)
+    return err;
+
+  c->xctx = i8x_xctx_ref (xctx);
+  c->ref = i8x_funcref_ref (ref);
+
+  c->num_args = i8x_list_size (i8x_type_get_ptypes (type));
+  c->num_rets = i8x_list_size (i8x_type_get_rtypes (type));
+
+  *callable = c;
+
+  return I8X_OK;
+}
+
+/* Reread what CALLABLE's reference resolves to.  EPOCH is the
+   context's resolution epoch, read after the call was registered
+   with the execution context.  */
+
+static i8x_err_e
+i8x_callable_revalidate (struct i8x_callable *callable, uint64_t epoch)
+{
+  struct i8x_func *func;
+
+  func = __atomic_load_n (&callable->ref->published, __ATOMIC_SEQ_CST);
+  if (func == NULL)
+    return i8x_ctx_set_error (i8x_callable_get_ctx (callable),
+			      I8X_EINVAL, NULL, NULL);
+
+  callable->func = func;
+  callable->native_impl = i8x_func_get_native_impl (func);
+  callable->typed_impl = i8x_func_get_typed_impl (func);
+  callable->code = i8x_func_get_interp_impl (func);
+
+  callable->epoch = epoch;
+
+  return I8X_OK;
+}
+
+/* Register a call through CALLABLE with its execution context, and
+   make sure what CALLABLE remembers is current.  The caller must
+   call i8x_xctx_end_call when the call returns, even if this
+   fails.  */
+
+static inline i8x_err_e __attribute__ ((always_inline))
+i8x_callable_begin_call (struct i8x_callable *callable)
+{
+  uint64_t epoch;
+
+  i8x_xctx_begin_call (callable->xctx);
+
+  /* This must be read after the call is registered, so that if it
+     hasn't changed the context cannot release the function.  */
+  epoch = i8x_xctx_get_ctx_epoch (callable->xctx);
+  if (__i8x_unlikely (epoch != callable->epoch))
+    return i8x_callable_revalidate (callable, epoch);
+
+  return I8X_OK;
+}
+
+/* Make a call through CALLABLE, with arguments and returns in
+   arrays.  The call must have been registered with
+   i8x_callable_begin_call.  */
+
+static inline i8x_err_e __attribute__ ((always_inline))
+i8x_callable_dispatch (struct i8x_callable *callable,
+		       struct i8x_inferior *inf,
+		       union i8x_value *args, union i8x_value *rets)
+{
+  struct i8x_xctx *xctx = callable->xctx;
+
+  if (callable->native_impl != NULL)
+    return callable->native_impl (xctx, inf, args, rets);
+  else if (__i8x_unlikely (callable->code == NULL))
+    return i8x_func_call_typed_impl (callable->func, xctx, inf,
+				     args, rets);
+  else if (__i8x_unlikely (xctx->use_debug_interpreter))
+    return i8x_xctx_run_code_dbg (xctx, callable->ref, callable->code,
+				  inf, args, rets);
+  else
+    return i8x_xctx_run_code (xctx, callable->ref, callable->code,
+			      inf, args, rets);
+}
+
+/**
+ * i8x_callable_call:
+ * @callable: the callable
+ * @inf: the inferior, or NULL
+ * @args: array of arguments
+ * @rets: array to store the returned values in
+ *
+ * Call the function @callable's reference resolves to, as
+ * i8x_xctx_call would.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_callable_call (struct i8x_callable *callable,
+		   struct i8x_inferior *inf,
+		   union i8x_value *args, union i8x_value *rets)
+{
+  i8x_err_e err;
+
+  err = i8x_callable_begin_call (callable);
+  if (err == I8X_OK)
+    err = i8x_callable_dispatch (callable, inf, args, rets);
+
+  i8x_xctx_end_call (callable->xctx);
+
+  return err;
+}
+
+/* Check CALLABLE's function takes NUM_ARGS arguments and returns
+   at most one value, for the fixed-arity calls below.  */
+
+static inline i8x_err_e __attribute__ ((always_inline))
+i8x_callable_check_arity (struct i8x_callable *callable, int num_args)
+{
+  if (__i8x_unlikely (callable->num_args != num_args
+		      || callable->num_rets > 1))
+    return i8x_ctx_set_error (i8x_callable_get_ctx (callable),
+			      I8X_EINVAL, NULL, NULL);
+
+  return I8X_OK;
+}
+
+/**
+ * i8x_callable_call_0:
+ * @callable: the callable
+ * @inf: the inferior, or NULL
+ * @ret: location to store the returned value, if any
+ *
+ * Call a function that takes no arguments and returns at most one
+ * value through @callable.  Native functions registered with
+ * i8x_ctx_register_native_func_0 are called directly.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_callable_call_0 (struct i8x_callable *callable,
+		     struct i8x_inferior *inf, union i8x_value *ret)
+{
+  i8x_err_e err = i8x_callable_check_arity (callable, 0);
+
+  if (err != I8X_OK)
+    return err;
+
+  err = i8x_callable_begin_call (callable);
+  if (err == I8X_OK)
+    {
+      /* Native functions with this arity can be called directly.  */
+      if (callable->typed_impl.fn0 != NULL)
+	err = callable->typed_impl.fn0 (callable->xctx, inf, ret);
+      else
+	err = i8x_callable_dispatch (callable, inf, NULL, ret);
+    }
+
+  i8x_xctx_end_call (callable->xctx);
+
+  return err;
+}
+
+/**
+ * i8x_callable_call_1:
+ * @callable: the callable
+ * @inf: the inferior, or NULL
+ * @arg0: the argument
+ * @ret: location to store the returned value, if any
+ *
+ * Call a function that takes one argument and returns at most one
+ * value through @callable.  Native functions registered with
+ * i8x_ctx_register_native_func_1 are called directly.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_callable_call_1 (struct i8x_callable *callable,
+		     struct i8x_inferior *inf, union i8x_value arg0,
+		     union i8x_value *ret)
+{
+  i8x_err_e err = i8x_callable_check_arity (callable, 1);
+
+  if (err != I8X_OK)
+    return err;
+
+  err = i8x_callable_begin_call (callable);
+  if (err == I8X_OK)
+    {
+      /* Native functions with this arity can be called directly.  */
+      if (callable->typed_impl.fn1 != NULL)
+	err = callable->typed_impl.fn1 (callable->xctx, inf, arg0, ret);
+      else
+	err = i8x_callable_dispatch (callable, inf, &arg0, ret);
+    }
+
+  i8x_xctx_end_call (callable->xctx);
+
+  return err;
+}
+
+/**
+ * i8x_callable_call_2:
+ * @callable: the callable
+ * @inf: the inferior, or NULL
+ * @arg0: the first argument
+ * @arg1: the second argument
+ * @ret: location to store the returned value, if any
+ *
+ * Call a function that takes two arguments and returns at most one
+ * value through @callable.  Native functions registered with
+ * i8x_ctx_register_native_func_2 are called directly.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_callable_call_2 (struct i8x_callable *callable,
+		     struct i8x_inferior *inf, union i8x_value arg0,
+		     union i8x_value arg1, union i8x_value *ret)
+{
+  union i8x_value args[2] = {arg0, arg1};
+  i8x_err_e err = i8x_callable_check_arity (callable, 2);
+
+  if (err != I8X_OK)
+    return err;
+
+  err = i8x_callable_begin_call (callable);
+  if (err == I8X_OK)
+    {
+      /* Native functions with this arity can be called directly.  */
+      if (callable->typed_impl.fn2 != NULL)
+	err = callable->typed_impl.fn2 (callable->xctx, inf, arg0, arg1, ret);
+      else
+	err = i8x_callable_dispatch (callable, inf, args, ret);
+    }
+
+  i8x_xctx_end_call (callable->xctx);
+
+  return err;
+}
+
+/**
+ * i8x_callable_call_3:
+ * @callable: the callable
+ * @inf: the inferior, or NULL
+ * @arg0: the first argument
+ * @arg1: the second argument
+ * @arg2: the third argument
+ * @ret: location to store the returned value, if any
+ *
+ * Call a function that takes three arguments and returns at most
+ * one value through @callable.  Native functions registered with
+ * i8x_ctx_register_native_func_3 are called directly.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_callable_call_3 (struct i8x_callable *callable,
+		     struct i8x_inferior *inf, union i8x_value arg0,
+		     union i8x_value arg1, union i8x_value arg2,
+		     union i8x_value *ret)
+{
+  union i8x_value args[3] = {arg0, arg1, arg2};
+  i8x_err_e err = i8x_callable_check_arity (callable, 3);
+
+  if (err != I8X_OK)
+    return err;
+
+  err = i8x_callable_begin_call (callable);
+  if (err == I8X_OK)
+    {
+      /* Native functions with this arity can be called directly.  */
+      if (callable->typed_impl.fn3 != NULL)
+	err = callable->typed_impl.fn3 (callable->xctx, inf, arg0, arg1,
+					  arg2, ret);
+      else
+	err = i8x_callable_dispatch (callable, inf, args, ret);
+    }
+
+  i8x_xctx_end_call (callable->xctx);
+
+  return err;
+}
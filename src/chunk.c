@@ -42,10 +42,10 @@ const struct i8x_object_ops i8x_chunk_ops =
   };
 
 i8x_err_e
-i8x_chunk_new_from_readbuf (struct i8x_readbuf *rb,
-			    struct i8x_chunk **chunk)
+i8x_chunk_new_from_cursor (struct i8x_rbcursor *cur,
+			   struct i8x_chunk **chunk)
 {
-  struct i8x_note *note = i8x_rb_get_note (rb);
+  struct i8x_note *note = i8x_rbc_get_note (cur);
   struct i8x_ctx *ctx = i8x_note_get_ctx (note);
   uintmax_t type_id, version;
   const char *type_id_ptr;
@@ -55,28 +55,29 @@ i8x_chunk_new_from_readbuf (struct i8x_readbuf *rb,
   struct i8x_chunk *c;
   i8x_err_e err;
 
-  type_id_ptr = i8x_rb_get_ptr (rb);
-  err = i8x_rb_read_uleb128 (rb, &type_id);
+  type_id_ptr = i8x_rbc_get_ptr (cur);
+  err = i8x_rbc_read_uleb128 (cur, &type_id);
   if (err != I8X_OK)
     return err;
 
-  version_ptr = i8x_rb_get_ptr (rb);
-  err = i8x_rb_read_uleb128 (rb, &version);
+  version_ptr = i8x_rbc_get_ptr (cur);
+  err = i8x_rbc_read_uleb128 (cur, &version);
   if (err != I8X_OK)
     return err;
 
-  err = i8x_rb_read_uleb128 (rb, &encoded_size);
+  err = i8x_rbc_read_uleb128 (cur, &encoded_size);
   if (err != I8X_OK)
     return err;
 
   dbg (ctx, "found type_id %ld, version %ld, size %ld\n",
        type_id, version, encoded_size);
 
-  err = i8x_rb_read_bytes (rb, encoded_size, &encoded);
+  err = i8x_rbc_read_bytes (cur, encoded_size, &encoded);
   if (err != I8X_OK)
     return err;
 
-  err = i8x_ob_new (note, &i8x_chunk_ops, &c);
+  err = i8x_ob_new_in_arena (note, i8x_note_get_arena (note),
+			     &i8x_chunk_ops, &c);
   if (err != I8X_OK)
     return err;
 
@@ -17,12 +17,38 @@
    License along with the Infinity Note Execution Library; if not, see
    <http://www.gnu.org/licenses/>.  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include "libi8x-private.h"
 #include "interp-private.h"
 #include "optable.c"
 
+/* The interpreters' dispatch tables.  These depend only on the
+   library, not on any context, so they are filled in once and
+   shared by every context in the process.  They are static so
+   that creating them cannot fail.  */
+
+static pthread_once_t dispatch_tables_once = PTHREAD_ONCE_INIT;
+static void *dispatch_std[MAX_OPCODE + 1];
+static void *dispatch_dbg[MAX_OPCODE + 1];
+
+static void
+i8x_make_dispatch_tables (void)
+{
+  i8x_init_dispatch_table (dispatch_std, NUM_OPCODES, false);
+  i8x_init_dispatch_table (dispatch_dbg, NUM_OPCODES, true);
+}
+
+/* Fill in the interpreters' dispatch tables if this is the first
+   call in this process.  This may be called from any thread.  */
+
+static void
+i8x_code_init_dispatch_tables (void)
+{
+  pthread_once (&dispatch_tables_once, i8x_make_dispatch_tables);
+}
+
 static struct i8x_func *
 i8x_code_get_func (struct i8x_code *code)
 {
@@ -58,7 +84,7 @@ i8x_code_unpack_info (struct i8x_code *code)
 {
   struct i8x_note *note = i8x_code_get_note (code);
   struct i8x_chunk *chunk;
-  struct i8x_readbuf *rb;
+  struct i8x_rbcursor cur;
   i8x_err_e err;
 
   // XXX maybe doesn't need to exist?
@@ -71,36 +97,27 @@ i8x_code_unpack_info (struct i8x_code *code)
   if (i8x_chunk_get_version (chunk) != 1)
     return i8x_chunk_version_error (chunk);
 
-  err = i8x_rb_new_from_chunk (chunk, &rb);
-  if (err != I8X_OK)
-    return err;
-
-  err = i8x_rb_read_byte_order_mark (rb);
-  if (err != I8X_OK)
-    goto cleanup;
-
-  code->byte_order = i8x_rb_get_byte_order (rb);
+  i8x_rbc_init_from_chunk (&cur, chunk);
 
-  err = i8x_rb_read_uleb128 (rb, &code->max_stack);
+  err = i8x_rbc_read_byte_order_mark (&cur);
   if (err != I8X_OK)
-    goto cleanup;
+    return err;
 
- cleanup:
-  rb = i8x_rb_unref (rb);
+  code->byte_order = i8x_rbc_get_byte_order (&cur);
 
-  return err;
+  return i8x_rbc_read_uleb128 (&cur, &code->max_stack);
 }
 
 static i8x_err_e
-i8x_code_read_opcode (struct i8x_readbuf *rb, i8x_opcode_t *opcode)
+i8x_code_read_opcode (struct i8x_rbcursor *cur, i8x_opcode_t *opcode)
 {
-  const char *location = i8x_rb_get_ptr (rb);
+  const char *location = i8x_rbc_get_ptr (cur);
   uintmax_t tmp;
   uint8_t byte;
   i8x_opcode_t result;
   i8x_err_e err;
 
-  err = i8x_rb_read_uint8_t (rb, &byte);
+  err = i8x_rbc_read_uint8_t (cur, &byte);
   if (err != I8X_OK)
     return err;
 
@@ -108,7 +125,7 @@ i8x_code_read_opcode (struct i8x_readbuf *rb, i8x_opcode_t *opcode)
     {
       uintmax_t wide;
 
-      err = i8x_rb_read_uleb128 (rb, &wide);
+      err = i8x_rbc_read_uleb128 (cur, &wide);
       if (err != I8X_OK)
 	return err;
 
@@ -120,7 +137,7 @@ i8x_code_read_opcode (struct i8x_readbuf *rb, i8x_opcode_t *opcode)
   /* Check for overflow.  */
   result = tmp;
   if (result != tmp)
-    return i8x_rb_error (rb, I8X_NOTE_UNHANDLED, location);
+    return i8x_rbc_error (cur, I8X_NOTE_UNHANDLED, location);
 
   *opcode = result;
 
@@ -128,11 +145,11 @@ i8x_code_read_opcode (struct i8x_readbuf *rb, i8x_opcode_t *opcode)
 }
 
 static i8x_err_e
-i8x_code_read_operand (struct i8x_readbuf *rb,
+i8x_code_read_operand (struct i8x_rbcursor *cur,
 		       i8x_operand_type_e type,
 		       union i8x_value *operand)
 {
-  const char *location = i8x_rb_get_ptr (rb);
+  const char *location = i8x_rbc_get_ptr (cur);
   intmax_t signed_result;
   uintmax_t unsigned_result;
   union i8x_value result;
@@ -150,7 +167,7 @@ i8x_code_read_operand (struct i8x_readbuf *rb,
     {								\
       TYPE tmp;							\
 								\
-      err = i8x_rb_read_ ## TYPE (rb, &tmp);			\
+      err = i8x_rbc_read_ ## TYPE (cur, &tmp);			\
       RESULT = tmp;						\
     }								\
     break
@@ -173,16 +190,16 @@ i8x_code_read_operand (struct i8x_readbuf *rb,
 
     case I8X_OPR_SLEB128:
       is_signed = true;
-      err = i8x_rb_read_sleb128 (rb, &signed_result);
+      err = i8x_rbc_read_sleb128 (cur, &signed_result);
       break;
 
     case I8X_OPR_ULEB128:
       is_signed = false;
-      err = i8x_rb_read_uleb128 (rb, &unsigned_result);
+      err = i8x_rbc_read_uleb128 (cur, &unsigned_result);
       break;
 
     default:
-      return i8x_rb_error (rb, I8X_NOTE_UNHANDLED, location);
+      return i8x_rbc_error (cur, I8X_NOTE_UNHANDLED, location);
     }
 
   if (err != I8X_OK)
@@ -193,13 +210,13 @@ i8x_code_read_operand (struct i8x_readbuf *rb,
     {
       result.i = signed_result;
       if (result.i != signed_result)
-	return i8x_rb_error (rb, I8X_NOTE_UNHANDLED, location);
+	return i8x_rbc_error (cur, I8X_NOTE_UNHANDLED, location);
     }
   else
     {
       result.u = unsigned_result;
       if (result.u != unsigned_result)
-	return i8x_rb_error (rb, I8X_NOTE_UNHANDLED, location);
+	return i8x_rbc_error (cur, I8X_NOTE_UNHANDLED, location);
     }
 
   *operand = result;
@@ -213,7 +230,7 @@ i8x_code_unpack_bytecode (struct i8x_code *code)
   struct i8x_note *note = i8x_code_get_note (code);
   struct i8x_chunk *chunk;
   size_t itable_size;
-  struct i8x_readbuf *rb;
+  struct i8x_rbcursor cur;
   struct i8x_instr *op;
   i8x_err_e err;
 
@@ -258,18 +275,15 @@ i8x_code_unpack_bytecode (struct i8x_code *code)
   if (chunk == NULL)
     return I8X_OK;
 
-  err = i8x_rb_new_from_chunk (chunk, &rb);
-  if (err != I8X_OK)
-    return err;
+  i8x_rbc_init_from_chunk (&cur, chunk);
+  i8x_rbc_set_byte_order (&cur, code->byte_order);
 
-  i8x_rb_set_byte_order (rb, code->byte_order);
-
-  while (i8x_rb_bytes_left (rb) > 0)
+  while (i8x_rbc_bytes_left (&cur) > 0)
     {
-      op = bcp_to_ip (code, i8x_rb_get_ptr (rb));
+      op = bcp_to_ip (code, i8x_rbc_get_ptr (&cur));
 
       /* Read the opcode and operands.  */
-      err = i8x_code_read_opcode (rb, &op->code);
+      err = i8x_code_read_opcode (&cur, &op->code);
       if (err != I8X_OK)
 	break;
 
@@ -284,16 +298,16 @@ i8x_code_unpack_bytecode (struct i8x_code *code)
 	  break;
 	}
 
-      err = i8x_code_read_operand (rb, op->desc->arg1, &op->arg1);
+      err = i8x_code_read_operand (&cur, op->desc->arg1, &op->arg1);
       if (err != I8X_OK)
 	break;
 
-      err = i8x_code_read_operand (rb, op->desc->arg2, &op->arg2);
+      err = i8x_code_read_operand (&cur, op->desc->arg2, &op->arg2);
       if (err != I8X_OK)
 	break;
 
       /* Set up the next instruction pointers.  */
-      op->fall_through = bcp_to_ip (code, i8x_rb_get_ptr (rb));
+      op->fall_through = bcp_to_ip (code, i8x_rbc_get_ptr (&cur));
 
       if (op->code == DW_OP_skip)
 	op->fall_through += op->arg1.i;
@@ -301,8 +315,6 @@ i8x_code_unpack_bytecode (struct i8x_code *code)
 	op->branch_next = op->fall_through + op->arg1.i;
     }
 
-  rb = i8x_rb_unref (rb);
-
   if (err == I8X_OK)
     i8x_code_dump_itable (code, __FUNCTION__);
 
@@ -399,19 +411,90 @@ i8x_code_setup_flow (struct i8x_code *code)
   return I8X_OK;
 }
 
+/* Make the next instruction pointer *NEXTP of OP, which branches
+   backwards, go through CHECK.  CHECK charges the execution budget
+   for the instructions from the branch target to OP, which is what
+   one trip round the loop costs if no other branches are taken.
+   Until the code is promoted CHECK also counts towards making the
+   code hot.  */
+
+static void
+i8x_code_add_budget_check (struct i8x_code *code, struct i8x_instr *op,
+			   struct i8x_instr **nextp,
+			   struct i8x_instr *check)
+{
+  struct i8x_instr *target = *nextp;
+  struct i8x_instr *ip;
+
+  check->code = I8X_OP_check_budget_cold;
+  check->desc = &optable[check->code];
+  check->fall_through = target;
+
+  for (ip = target; ip <= op; ip++)
+    if (ip->code != IT_EMPTY_SLOT)
+      check->arg1.u++;
+
+  *nextp = check;
+}
+
+/* Route every backward branch through an instruction that charges
+   the execution budget.  Code can only loop by branching backwards,
+   so this bounds execution without slowing straight-line code.  Skip
+   instructions have been eliminated by now, so fall throughs can
+   branch backwards as well as bra instructions.  */
+
+static i8x_err_e
+i8x_code_setup_budget_checks (struct i8x_code *code)
+{
+  struct i8x_instr *op, *check;
+  size_t count = 0;
+
+  for (op = code->itable; op < code->itable_limit; op++)
+    {
+      if (op->code == IT_EMPTY_SLOT || op->code == I8X_OP_return)
+	continue;
+
+      if (op->fall_through <= op)
+	count++;
+
+      if (op->code == DW_OP_bra && op->branch_next <= op)
+	count++;
+    }
+
+  if (count == 0)
+    return I8X_OK;
+
+  code->budget_checks = calloc (count, sizeof (struct i8x_instr));
+  if (code->budget_checks == NULL)
+    return i8x_out_of_memory (i8x_code_get_ctx (code));
+
+  code->num_budget_checks = count;
+
+  check = code->budget_checks;
+  for (op = code->itable; op < code->itable_limit; op++)
+    {
+      if (op->code == IT_EMPTY_SLOT || op->code == I8X_OP_return)
+	continue;
+
+      if (op->fall_through <= op)
+	i8x_code_add_budget_check (code, op, &op->fall_through, check++);
+
+      if (op->code == DW_OP_bra && op->branch_next <= op)
+	i8x_code_add_budget_check (code, op, &op->branch_next, check++);
+    }
+  i8x_assert (check == code->budget_checks + count);
+
+  return I8X_OK;
+}
+
 static i8x_err_e
 i8x_code_setup_dispatch (struct i8x_code *code)
 {
   struct i8x_ctx *ctx = i8x_code_get_ctx (code);
-  void **dispatch_std, **dispatch_dbg;
   void *std_unhandled;
   struct i8x_instr *op;
-  i8x_err_e err;
 
-  /* Get the dispatch tables.  */
-  err = i8x_ctx_get_dispatch_tables (ctx, &dispatch_std, &dispatch_dbg);
-  if (err != I8X_OK)
-    return err;
+  i8x_code_init_dispatch_tables ();
   std_unhandled = dispatch_std[IT_EMPTY_SLOT];
 
   for (op = code->itable; op < code->itable_limit; op++)
@@ -435,6 +518,13 @@ i8x_code_setup_dispatch (struct i8x_code *code)
 	i8x_assert (op->impl_std == std_unhandled);
     }
 
+  for (op = code->budget_checks;
+       op < code->budget_checks + code->num_budget_checks; op++)
+    {
+      op->impl_std = dispatch_std[op->code];
+      op->impl_dbg = dispatch_dbg[op->code];
+    }
+
   return I8X_OK;
 }
 
@@ -445,7 +535,6 @@ i8x_code_init (struct i8x_code *code)
   struct i8x_funcref *funcref = i8x_func_get_funcref (func);
   struct i8x_ctx *ctx = i8x_funcref_get_ctx (funcref);
   struct i8x_type *functype;
-  i8x_err_e err;
 
   funcref = i8x_func_get_funcref (func);
   if (i8x_ctx_get_log_priority (ctx) >= LOG_INFO)
@@ -464,6 +553,23 @@ i8x_code_init (struct i8x_code *code)
   code->num_args = i8x_list_size (code->ptypes);
   code->num_rets = i8x_list_size (code->rtypes);
 
+  i8x_ctx_get_tiering_thresholds (ctx, &code->calls_left,
+				  &code->backedges_left);
+
+  return I8X_OK;
+}
+
+/* Unpack, check and prepare CODE for execution.  Everything this
+   function does is local to CODE, with the exception of errors,
+   which are reported via i8x_ctx_set_error, and of the dispatch
+   tables, which must have been created by the caller.  This allows
+   i8x_ctx_register_notes to call it on several threads at once.  */
+
+i8x_err_e
+i8x_code_compile (struct i8x_code *code)
+{
+  i8x_err_e err;
+
   err = i8x_code_unpack_info (code);
   if (err != I8X_OK)
     return err;
@@ -480,6 +586,10 @@ i8x_code_init (struct i8x_code *code)
   if (err != I8X_OK)
     return err;
 
+  err = i8x_code_setup_budget_checks (code);
+  if (err != I8X_OK)
+    return err;
+
   err = i8x_code_setup_dispatch (code);
   if (err != I8X_OK)
     return err;
@@ -487,6 +597,14 @@ i8x_code_init (struct i8x_code *code)
   return I8X_OK;
 }
 
+/* Return true if CODE depends only on its arguments.  */
+
+bool
+i8x_code_is_pure (struct i8x_code *code)
+{
+  return code->is_pure;
+}
+
 static void
 i8x_code_unlink (struct i8x_object *ob)
 {
@@ -503,6 +621,12 @@ i8x_code_free (struct i8x_object *ob)
 
   if (code->itable != NULL)
     free (code->itable);
+
+  if (code->budget_checks != NULL)
+    free (code->budget_checks);
+
+  if (code->hot_itable != NULL)
+    free (code->hot_itable);
 }
 
 const struct i8x_object_ops i8x_code_ops =
@@ -536,6 +660,244 @@ i8x_code_new_from_func (struct i8x_func *func, struct i8x_code **code)
   return I8X_OK;
 }
 
+/* Tiered execution.  Code starts out running its instruction table
+   as compiled, counting calls and backward branches.  When either
+   count runs out the code is marked hot, and the next call makes an
+   optimized copy of the instruction table and publishes it for later
+   calls to use.  The instruction table is never modified once it is
+   compiled, so calls already running are unaffected, and any thread
+   can do the promotion.  */
+
+/* Called by i8x_code_tick when COUNTER, one of CODE's counters,
+   runs out.  */
+
+void
+i8x_code_mark_hot (struct i8x_code *code, unsigned int *counter)
+{
+  int tier = I8X_TIER_BASELINE;
+
+  __atomic_store_n (counter, 0, __ATOMIC_RELAXED);
+  __atomic_compare_exchange_n (&code->tier, &tier, I8X_TIER_HOT, false,
+			       __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Return the opcode of the superinstruction that does what OP and
+   NEXT do, storing its operand in ARG1, or IT_EMPTY_SLOT if there
+   is no such superinstruction.  */
+
+static i8x_opcode_t
+i8x_code_fuse_1 (struct i8x_instr *op, struct i8x_instr *next,
+		 union i8x_value *arg1)
+{
+  arg1->u = 0;
+
+  if (next->code == DW_OP_bra)
+    {
+      switch (op->code)
+	{
+	case DW_OP_eq:
+	  return I8X_OP_bra_eq;
+	case DW_OP_ge:
+	  return I8X_OP_bra_ge;
+	case DW_OP_gt:
+	  return I8X_OP_bra_gt;
+	case DW_OP_le:
+	  return I8X_OP_bra_le;
+	case DW_OP_lt:
+	  return I8X_OP_bra_lt;
+	case DW_OP_ne:
+	  return I8X_OP_bra_ne;
+	}
+    }
+
+  if (op->code >= DW_OP_lit0 && op->code <= DW_OP_lit31)
+    {
+      uint64_t lit = op->code - DW_OP_lit0;
+
+      switch (next->code)
+	{
+	case DW_OP_plus:
+	  arg1->u = lit;
+	  return I8X_OP_plus_lit;
+
+	case DW_OP_minus:
+	  arg1->u = -lit;
+	  return I8X_OP_plus_lit;
+
+	case I8X_OP_bra_eq:
+	case I8X_OP_bra_ge:
+	case I8X_OP_bra_gt:
+	case I8X_OP_bra_le:
+	case I8X_OP_bra_lt:
+	case I8X_OP_bra_ne:
+	  arg1->u = lit;
+	  return next->code - I8X_OP_bra_eq + I8X_OP_bra_eq_lit;
+	}
+    }
+
+  return IT_EMPTY_SLOT;
+}
+
+/* Fuse OP with the instructions it falls through to, for as long
+   as they form superinstructions.  NUM_PREDS counts the ways into
+   each instruction of ITABLE, which OP is in; instructions with
+   other ways in cannot be fused with OP.  */
+
+static void
+i8x_code_fuse (struct i8x_instr *itable, const uint8_t *num_preds,
+	       struct i8x_instr *op)
+{
+  while (true)
+    {
+      struct i8x_instr *next = op->fall_through;
+      union i8x_value arg1;
+      i8x_opcode_t fused;
+
+      if (next == NULL || num_preds[next - itable] != 1)
+	break;
+
+      fused = i8x_code_fuse_1 (op, next, &arg1);
+      if (fused == IT_EMPTY_SLOT)
+	break;
+
+      op->code = fused;
+      op->desc = &optable[fused];
+      op->arg1 = arg1;
+      op->branch_next = next->branch_next;
+      op->fall_through = next->fall_through;
+
+      next->code = IT_EMPTY_SLOT;
+    }
+}
+
+/* Relocate IP, which points into CODE's instruction table or budget
+   checks, into the copy of both at COPY.  */
+
+static struct i8x_instr *
+i8x_code_relocate (struct i8x_code *code, struct i8x_instr *copy,
+		   struct i8x_instr *ip)
+{
+  if (ip == NULL)
+    return NULL;
+  else if (ip >= code->itable && ip < code->itable_limit)
+    return copy + (ip - code->itable);
+  else
+    return copy + (code->itable_limit - code->itable)
+		+ (ip - code->budget_checks);
+}
+
+/* Count a way into NEXT, if it's not NULL.  Two is plenty, as the
+   fuser only cares whether there is exactly one.  */
+
+static void
+i8x_code_count_pred (struct i8x_instr *itable, uint8_t *num_preds,
+		     struct i8x_instr *next)
+{
+  if (next != NULL && num_preds[next - itable] < 2)
+    num_preds[next - itable]++;
+}
+
+/* Make an optimized copy of CODE's instruction table and budget
+   checks, in which sequences of instructions that can only be
+   entered at the start are fused into superinstructions, and budget
+   checks no longer count towards promotion.  Returns the copy's
+   entry point, or NULL if out of memory.  */
+
+static struct i8x_instr *
+i8x_code_optimize (struct i8x_code *code)
+{
+  size_t itable_size = code->itable_limit - code->itable;
+  size_t size = itable_size + code->num_budget_checks;
+  struct i8x_instr *copy, *entry_point, *op;
+  uint8_t *num_preds;
+
+  i8x_code_init_dispatch_tables ();
+
+  copy = malloc (size * sizeof (struct i8x_instr));
+  if (copy == NULL)
+    return NULL;
+
+  num_preds = calloc (size, sizeof (uint8_t));
+  if (num_preds == NULL)
+    {
+      free (copy);
+      return NULL;
+    }
+
+  memcpy (copy, code->itable, itable_size * sizeof (struct i8x_instr));
+  memcpy (copy + itable_size, code->budget_checks,
+	  code->num_budget_checks * sizeof (struct i8x_instr));
+
+  entry_point = i8x_code_relocate (code, copy, code->entry_point);
+  i8x_code_count_pred (copy, num_preds, entry_point);
+
+  for (op = copy; op < copy + size; op++)
+    {
+      op->entry_stack = NULL;
+      op->branch_next = i8x_code_relocate (code, copy, op->branch_next);
+      op->fall_through = i8x_code_relocate (code, copy, op->fall_through);
+
+      if (op->code == I8X_OP_check_budget_cold)
+	{
+	  op->code = I8X_OP_check_budget;
+	  op->desc = &optable[op->code];
+	}
+
+      if (op->code == IT_EMPTY_SLOT)
+	continue;
+
+      i8x_code_count_pred (copy, num_preds, op->branch_next);
+      i8x_code_count_pred (copy, num_preds, op->fall_through);
+    }
+
+  /* Fuse backwards, so each instruction's successors have been
+     fused by the time it's tried.  Fall throughs within the table
+     only go forwards, as backward ones go via budget checks.  */
+  for (op = copy + itable_size - 1; op >= copy; op--)
+    if (op->code != IT_EMPTY_SLOT)
+      i8x_code_fuse (copy, num_preds, op);
+
+  free (num_preds);
+
+  for (op = copy; op < copy + size; op++)
+    {
+      op->impl_std = dispatch_std[op->code];
+      op->impl_dbg = dispatch_dbg[op->code];
+    }
+
+  code->hot_itable = copy;
+
+  return entry_point;
+}
+
+/* Promote CODE, which is hot, and return where the call that found
+   it hot should start executing.  Only one thread promotes; calls
+   on other threads meanwhile run the instruction table as before.
+   If promotion fails CODE stays as it was, and is not retried.  */
+
+struct i8x_instr *
+i8x_code_promote (struct i8x_code *code)
+{
+  struct i8x_instr *entry_point;
+  int tier = I8X_TIER_HOT;
+
+  if (!__atomic_compare_exchange_n (&code->tier, &tier,
+				    I8X_TIER_PROMOTING, false,
+				    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return code->entry_point;
+
+  entry_point = i8x_code_optimize (code);
+  if (entry_point != NULL)
+    __atomic_store_n (&code->hot_entry_point, entry_point,
+		      __ATOMIC_RELEASE);
+  else
+    entry_point = code->entry_point;
+
+  __atomic_store_n (&code->tier, I8X_TIER_OPTIMIZED, __ATOMIC_RELEASE);
+
+  return entry_point;
+}
+
 /* Convert an instruction pointer to a note source offset.  */
 
 size_t
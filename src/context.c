@@ -18,10 +18,15 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include "libi8x-private.h"
 
+/* Default thresholds for promoting functions.  */
+#define DEFAULT_HOT_CALLS 1000
+#define DEFAULT_HOT_BACKEDGES 10000
+
 /**
  * SECTION:libi8x
  * @short_description: libi8x context
@@ -45,14 +50,41 @@ struct i8x_ctx
 
   bool use_debug_interpreter_default;
 
+  /* Calls and backward branches before functions are promoted.  */
+  unsigned int hot_calls;
+  unsigned int hot_backedges;
+
   struct i8x_note *error_note;	/* Note that caused the last error.  */
   const char *error_ptr;	/* Pointer into error_note.  */
 
-  struct i8x_list *funcrefs;	/* List of interned function references.  */
-  struct i8x_list *symrefs;	/* List of interned symbol references.  */
-  struct i8x_list *functypes;	/* List of interned function types.  */
+  struct i8x_hashtable *funcrefs;  /* Interned function references.  */
+  struct i8x_hashtable *symrefs;   /* Interned symbol references.  */
+  struct i8x_hashtable *functypes; /* Interned function types.  */
+
+  /* Registered functions, grouped by origin.  This holds the first
+     function of each origin's list of registered functions, and the
+     context holds a reference to every function on those lists.  */
+  struct i8x_hashtable *origins;
+  uintptr_t last_origin;	/* Last handle from i8x_ctx_new_origin.  */
+
+  int update_depth;		/* Nesting depth of i8x_ctx_begin_update.  */
+  struct i8x_funcref *changed;	/* References awaiting resolution.  */
+  struct i8x_func *pending;	/* Functions awaiting notification.  */
+
+  /* Resolution epoch.  This is incremented after every update, so
+     calls that start in a given epoch see every update published
+     before it began.  Read by i8x_xctx_call on any thread.  */
+  uint64_t epoch;
+
+  /* Functions no longer published that calls may still be using,
+     and the execution contexts whose calls to check.  */
+  struct i8x_func *retired;
+  struct i8x_list *xctxs;
+
+  struct i8x_list *elffiles;	/* List of loaded ELF files.  */
 
-  struct i8x_list *functions;	/* List of registered functions.  */
+  struct i8x_queue *queue;	/* Background compilation queue.  */
+  struct i8x_pool *pool;	/* Execution contexts to lend.  */
 
   /* User-supplied function called when a function becomes available.  */
   i8x_func_cb_t *func_avail_observer_fn;
@@ -66,11 +98,29 @@ struct i8x_ctx
   struct i8x_type *pointer_type;
   struct i8x_type *opaque_type;
 
-  /* The interpreters' dispatch tables.  */
-  void **dispatch_std;
-  void **dispatch_dbg;
+  /* Memory for objects in this context.  */
+  struct i8x_slab slab;
 };
 
+/* Errors raised on this thread are stored here instead of in the
+   context if this is not NULL.  See i8x_ctx_register_notes.  */
+static __thread struct i8x_error_sink *error_sink;
+
+void
+i8x_ctx_start_logging (struct i8x_ctx *ctx)
+{
+  if (ctx->logging_started)
+    return;
+
+  ctx->logging_started = true;
+
+  /* These messages are deferred from i8x_ctx_new to allow the
+     caller to install a custom logger and set the priority if
+     they require it.  */
+  dbg (ctx, "ctx %p created\n", ctx);
+  dbg (ctx, "log_priority=%d\n", ctx->log_priority);
+}
+
 void
 i8x_ctx_log (struct i8x_ctx *ctx,
 	     int priority, const char *file, int line, const char *fn,
@@ -78,16 +128,7 @@ i8x_ctx_log (struct i8x_ctx *ctx,
 {
   va_list args;
 
-  if (!ctx->logging_started)
-    {
-      ctx->logging_started = true;
-
-      /* These messages are deferred from i8x_ctx_new to allow the
-	 caller to install a custom logger and set the priority if
-	 they require it.  */
-      dbg (ctx, "ctx %p created\n", ctx);
-      dbg (ctx, "log_priority=%d\n", ctx->log_priority);
-    }
+  i8x_ctx_start_logging (ctx);
 
   va_start (args, format);
   ctx->log_fn (ctx, priority, file, line, fn, format, args);
@@ -142,19 +183,31 @@ i8x_ctx_init (struct i8x_ctx *ctx)
 {
   i8x_err_e err;
 
-  err = i8x_list_new (ctx, true, &ctx->functions);
+  err = i8x_hashtable_new (ctx, &ctx->origins);
+  if (err != I8X_OK)
+    return err;
+
+  err = i8x_list_new (ctx, true, &ctx->elffiles);
   if (err != I8X_OK)
     return err;
 
-  err = i8x_list_new (ctx, false, &ctx->funcrefs);
+  err = i8x_list_new (ctx, false, &ctx->xctxs);
   if (err != I8X_OK)
     return err;
 
-  err = i8x_list_new (ctx, false, &ctx->symrefs);
+  err = i8x_pool_new (ctx, &ctx->pool);
   if (err != I8X_OK)
     return err;
 
-  err = i8x_list_new (ctx, false, &ctx->functypes);
+  err = i8x_hashtable_new (ctx, &ctx->funcrefs);
+  if (err != I8X_OK)
+    return err;
+
+  err = i8x_hashtable_new (ctx, &ctx->symrefs);
+  if (err != I8X_OK)
+    return err;
+
+  err = i8x_hashtable_new (ctx, &ctx->functypes);
   if (err != I8X_OK)
     return err;
 
@@ -180,11 +233,55 @@ i8x_ctx_unlink (struct i8x_object *ob)
 
   ctx->error_note = i8x_note_unref (ctx->error_note);
 
-  ctx->functions = i8x_list_unref (ctx->functions);
+  i8x_funcref_discard_changed (ctx->changed);
+  ctx->changed = NULL;
+
+  i8x_func_discard_pending (ctx->pending);
+  ctx->pending = NULL;
 
-  ctx->funcrefs = i8x_list_unref (ctx->funcrefs);
-  ctx->symrefs = i8x_list_unref (ctx->symrefs);
-  ctx->functypes = i8x_list_unref (ctx->functypes);
+  /* Nothing can be calling functions now, so release every function
+     calls could use without waiting.  */
+  if (ctx->funcrefs != NULL)
+    {
+      struct i8x_object *ref;
+      size_t i = 0;
+
+      while ((ref = i8x_hashtable_next (ctx->funcrefs, &i)) != NULL)
+	i8x_funcref_retire_published ((struct i8x_funcref *) ref);
+    }
+  i8x_func_reclaim (&ctx->retired, UINT64_MAX);
+
+  ctx->queue = i8x_queue_unref (ctx->queue);
+  ctx->pool = i8x_pool_unref (ctx->pool);
+
+  /* Release every registered function.  The table is finished
+     with once every list is unlinked, so releasing functions cannot
+     change it while it is being iterated.  */
+  if (ctx->origins != NULL)
+    {
+      struct i8x_object *first;
+      size_t i = 0;
+
+      while ((first = i8x_hashtable_next (ctx->origins, &i)) != NULL)
+	{
+	  struct i8x_func *func = (struct i8x_func *) first;
+
+	  while (func != NULL)
+	    {
+	      struct i8x_func *next = i8x_func_unlink_registered (func);
+
+	      i8x_func_unref (func);
+	      func = next;
+	    }
+	}
+    }
+  ctx->origins = i8x_hashtable_unref (ctx->origins);
+  ctx->elffiles = i8x_list_unref (ctx->elffiles);
+  ctx->xctxs = i8x_list_unref (ctx->xctxs);
+
+  ctx->funcrefs = i8x_hashtable_unref (ctx->funcrefs);
+  ctx->symrefs = i8x_hashtable_unref (ctx->symrefs);
+  ctx->functypes = i8x_hashtable_unref (ctx->functypes);
 
   ctx->integer_type = i8x_type_unref (ctx->integer_type);
   ctx->pointer_type = i8x_type_unref (ctx->pointer_type);
@@ -196,11 +293,7 @@ i8x_ctx_free (struct i8x_object *ob)
 {
   struct i8x_ctx *ctx = (struct i8x_ctx *) ob;
 
-  if (ctx->dispatch_std != NULL)
-    free (ctx->dispatch_std);
-
-  if (ctx->dispatch_dbg != NULL)
-    free (ctx->dispatch_dbg);
+  i8x_slab_release (&ctx->slab);
 }
 
 const struct i8x_object_ops i8x_ctx_ops =
@@ -233,9 +326,17 @@ i8x_ctx_new (struct i8x_ctx **ctx)
   if (err != I8X_OK)
     return err;
 
+  i8x_slab_init (&c->slab);
+
+  /* Zero means "no call in progress" to i8x_xctx_get_call_epoch.  */
+  c->epoch = 1;
+
   c->log_fn = log_stderr;
   c->log_priority = LOG_ERR;
 
+  c->hot_calls = DEFAULT_HOT_CALLS;
+  c->hot_backedges = DEFAULT_HOT_BACKEDGES;
+
   env = secure_getenv ("I8X_LOG");
   if (env != NULL)
     i8x_ctx_set_log_priority (c, log_priority (env));
@@ -305,6 +406,80 @@ i8x_ctx_get_use_debug_interpreter_default (struct i8x_ctx *ctx)
   return ctx->use_debug_interpreter_default;
 }
 
+/**
+ * i8x_ctx_set_tiering_thresholds:
+ * @ctx: i8x library context
+ * @calls: number of calls, or 0
+ * @backedges: number of backward branches, or 0
+ *
+ * Set how hot bytecode functions must get before they are promoted
+ * to an optimized form.  Functions are promoted on the first call
+ * after either they have been called @calls times or their loops
+ * have branched backwards @backedges times.  Zero disables that
+ * trigger.  This only affects functions loaded afterwards.
+ **/
+I8X_EXPORT void
+i8x_ctx_set_tiering_thresholds (struct i8x_ctx *ctx, unsigned int calls,
+				unsigned int backedges)
+{
+  ctx->hot_calls = calls;
+  ctx->hot_backedges = backedges;
+}
+
+void
+i8x_ctx_get_tiering_thresholds (struct i8x_ctx *ctx, unsigned int *calls,
+				unsigned int *backedges)
+{
+  *calls = ctx->hot_calls;
+  *backedges = ctx->hot_backedges;
+}
+
+struct i8x_list *
+i8x_ctx_get_elffiles (struct i8x_ctx *ctx)
+{
+  return ctx->elffiles;
+}
+
+/* Return a new origin handle, for functions the library loads.
+   Handles are never reused by CTX, so once every function with a
+   given handle has been unregistered that handle matches nothing.
+   Handles are odd, so they never equal a pointer to an object the
+   user might tag functions with using i8x_func_set_origin.  */
+
+const void *
+i8x_ctx_new_origin (struct i8x_ctx *ctx)
+{
+  return (const void *) (++ctx->last_origin * 2 + 1);
+}
+
+struct i8x_slab *
+i8x_ctx_get_slab (struct i8x_ctx *ctx)
+{
+  return &ctx->slab;
+}
+
+i8x_err_e
+i8x_ctx_get_queue (struct i8x_ctx *ctx, struct i8x_queue **queue)
+{
+  if (ctx->queue == NULL)
+    {
+      i8x_err_e err = i8x_queue_new (ctx, &ctx->queue);
+
+      if (err != I8X_OK)
+	return err;
+    }
+
+  *queue = ctx->queue;
+
+  return I8X_OK;
+}
+
+struct i8x_pool *
+i8x_ctx_get_pool (struct i8x_ctx *ctx)
+{
+  return ctx->pool;
+}
+
 
 I8X_EXPORT void
 i8x_ctx_set_func_available_cb (struct i8x_ctx *ctx,
@@ -348,7 +523,13 @@ i8x_ctx_set_error (struct i8x_ctx *ctx, i8x_err_e code,
 {
   i8x_assert (code != I8X_OK);
 
-  if (ctx != NULL)
+  if (error_sink != NULL)
+    {
+      error_sink->code = code;
+      error_sink->note = cause_note;
+      error_sink->ptr = cause_ptr;
+    }
+  else if (ctx != NULL)
     {
       ctx->error_note = i8x_note_unref (ctx->error_note);
       ctx->error_note = i8x_note_ref (cause_note);
@@ -359,6 +540,21 @@ i8x_ctx_set_error (struct i8x_ctx *ctx, i8x_err_e code,
   return code;
 }
 
+/* Record errors on this thread in SINK rather than in the context,
+   or stop doing so if SINK is NULL.  Returns the previous sink,
+   which the caller must restore when it is finished, as its caller
+   may itself be recording errors in a sink.  */
+
+struct i8x_error_sink *
+i8x_ctx_set_error_sink (struct i8x_error_sink *sink)
+{
+  struct i8x_error_sink *old_sink = error_sink;
+
+  error_sink = sink;
+
+  return old_sink;
+}
+
 static const char *
 error_message_for (i8x_err_e code)
 {
@@ -373,6 +569,12 @@ error_message_for (i8x_err_e code)
     case I8X_EINVAL:
       return _("Invalid argument");
 
+    case I8X_EIO:
+      return _("Input/output error");
+
+    case I8X_EAGAIN:
+      return _("Resource temporarily unavailable");
+
     case I8X_NOTE_CORRUPT:
       return _("Corrupt note");
 
@@ -385,6 +587,15 @@ error_message_for (i8x_err_e code)
     case I8X_STACK_OVERFLOW:
       return _("Stack overflow");
 
+    case I8X_FUEL_EXHAUSTED:
+      return _("Execution budget exhausted");
+
+    case I8X_DEADLINE_EXCEEDED:
+      return _("Deadline exceeded");
+
+    case I8X_CANCELLED:
+      return _("Cancelled");
+
     default:
       return NULL;
     }
@@ -461,6 +672,63 @@ i8x_ctx_get_opaque_type (struct i8x_ctx *ctx)
   return ctx->opaque_type;
 }
 
+/* If the string at STR starts with the SIZE bytes at PREFIX then
+   return a pointer to the rest of STR, otherwise return NULL.  */
+
+static const char *
+skip_prefix (const char *str, const char *prefix, size_t size)
+{
+  if (str == NULL || strncmp (str, prefix, size) != 0)
+    return NULL;
+
+  return str + size;
+}
+
+/* Function references are interned by their full names, which are
+   "provider::name(ptypes)rtypes".  Lookups hash and compare the
+   pieces in place so no full name is built unless a new reference
+   is created.  */
+
+struct funcref_key
+{
+  const char *provider;
+  const char *name;
+  const char *ptypes;
+  const char *rtypes;
+};
+
+static i8x_hash_t
+funcref_key_hash (const struct funcref_key *key)
+{
+  i8x_hash_t hash = i8x_hash_init ();
+
+  hash = i8x_hash_string (hash, key->provider);
+  hash = i8x_hash_string (hash, "::");
+  hash = i8x_hash_string (hash, key->name);
+  hash = i8x_hash_string (hash, "(");
+  hash = i8x_hash_string (hash, key->ptypes);
+  hash = i8x_hash_string (hash, ")");
+  hash = i8x_hash_string (hash, key->rtypes);
+
+  return hash;
+}
+
+static bool
+funcref_matches_key (struct i8x_object *ob, const void *arg)
+{
+  const struct funcref_key *key = arg;
+  const char *str = i8x_funcref_get_fullname ((struct i8x_funcref *) ob);
+
+  str = skip_prefix (str, key->provider, strlen (key->provider));
+  str = skip_prefix (str, "::", 2);
+  str = skip_prefix (str, key->name, strlen (key->name));
+  str = skip_prefix (str, "(", 1);
+  str = skip_prefix (str, key->ptypes, strlen (key->ptypes));
+  str = skip_prefix (str, ")", 1);
+
+  return str != NULL && strcmp (str, key->rtypes) == 0;
+}
+
 /* Internal version of i8x_ctx_get_funcref with an extra source note
    argument for error-reporting.  If the source note is not NULL then
    rtypes and ptypes MUST be pointers into the note's buffer or any
@@ -473,12 +741,32 @@ i8x_ctx_get_funcref_with_note (struct i8x_ctx *ctx,
 			       struct i8x_note *src_note,
 			       struct i8x_funcref **refp)
 {
-  struct i8x_listitem *li;
+  struct funcref_key key = {provider, name, ptypes, rtypes};
+  i8x_hash_t hash = funcref_key_hash (&key);
   struct i8x_funcref *ref;
   struct i8x_type *functype;
   size_t fullname_size;
   char *fullname;
-  i8x_err_e err = I8X_OK;
+  i8x_err_e err;
+
+  /* If we have this reference already then return it.  */
+  ref = (struct i8x_funcref *)
+    i8x_hashtable_lookup (ctx->funcrefs, hash,
+			  funcref_matches_key, &key);
+  if (ref != NULL)
+    {
+      *refp = i8x_funcref_ref (ref);
+
+      return I8X_OK;
+    }
+
+  /* It's a new reference that needs creating.  */
+  err = i8x_ctx_get_functype (ctx,
+			      ptypes, ptypes + strlen (ptypes),
+			      rtypes, rtypes + strlen (rtypes),
+			      src_note, &functype);
+  if (err != I8X_OK)
+    return err;
 
   /* Build the full name.  */
   fullname_size = (strlen (provider)
@@ -491,51 +779,33 @@ i8x_ctx_get_funcref_with_note (struct i8x_ctx *ctx,
 		   + 1); /* '\0'  */
   fullname = malloc (fullname_size);
   if (fullname == NULL)
-    return i8x_out_of_memory (ctx);
-
-  snprintf (fullname, fullname_size,
-	    "%s::%s(%s)%s", provider, name, ptypes, rtypes);
-
-  /* If we have this reference already then return it.  */
-  i8x_list_foreach (ctx->funcrefs, li)
     {
-      ref = i8x_listitem_get_funcref (li);
-
-      if (strcmp (i8x_funcref_get_fullname (ref), fullname) == 0)
-	{
-	  *refp = i8x_funcref_ref (ref);
+      i8x_type_unref (functype);
 
-	  goto cleanup;
-	}
+      return i8x_out_of_memory (ctx);
     }
 
-  /* It's a new reference that needs creating.  */
-  err = i8x_ctx_get_functype (ctx,
-			      ptypes, ptypes + strlen (ptypes),
-			      rtypes, rtypes + strlen (rtypes),
-			      src_note, &functype);
-  if (err != I8X_OK)
-    goto cleanup;
+  snprintf (fullname, fullname_size,
+	    "%s::%s(%s)%s", provider, name, ptypes, rtypes);
 
   err = i8x_funcref_new (ctx, fullname, functype, &ref);
   i8x_type_unref (functype);
+  free (fullname);
   if (err != I8X_OK)
-    goto cleanup;
+    return err;
 
-  err = i8x_list_append_funcref (ctx->funcrefs, ref);
+  err = i8x_hashtable_insert (ctx->funcrefs, hash,
+			      (struct i8x_object *) ref);
   if (err != I8X_OK)
     {
       ref = i8x_funcref_unref (ref);
 
-      goto cleanup;
+      return err;
     }
 
   *refp = ref;
 
- cleanup:
-  free (fullname);
-
-  return err;
+  return I8X_OK;
 }
 
 I8X_EXPORT i8x_err_e
@@ -555,29 +825,37 @@ void
 i8x_ctx_forget_funcref (struct i8x_funcref *ref)
 {
   struct i8x_ctx *ctx = i8x_funcref_get_ctx (ref);
+  const char *fullname = i8x_funcref_get_fullname (ref);
 
-  i8x_list_remove_funcref (ctx->funcrefs, ref);
+  if (ctx->funcrefs != NULL && fullname != NULL)
+    i8x_hashtable_remove (ctx->funcrefs,
+			  i8x_hash_string (i8x_hash_init (), fullname),
+			  (struct i8x_object *) ref);
+}
+
+static bool
+symref_has_name (struct i8x_object *ob, const void *name)
+{
+  return strcmp (i8x_symref_get_name ((struct i8x_symref *) ob),
+		 name) == 0;
 }
 
 i8x_err_e
 i8x_ctx_get_symref (struct i8x_ctx *ctx, const char *name,
 		    struct i8x_symref **refp)
 {
-  struct i8x_listitem *li;
+  i8x_hash_t hash = i8x_hash_string (i8x_hash_init (), name);
   struct i8x_symref *ref;
   i8x_err_e err;
 
   /* If we have this reference already then return it.  */
-  i8x_list_foreach (ctx->symrefs, li)
+  ref = (struct i8x_symref *)
+    i8x_hashtable_lookup (ctx->symrefs, hash, symref_has_name, name);
+  if (ref != NULL)
     {
-      ref = i8x_listitem_get_symref (li);
-
-      if (strcmp (i8x_symref_get_name (ref), name) == 0)
-	{
-	  *refp = i8x_symref_ref (ref);
+      *refp = i8x_symref_ref (ref);
 
-	  return I8X_OK;
-	}
+      return I8X_OK;
     }
 
   /* It's a new reference that needs creating.  */
@@ -585,7 +863,8 @@ i8x_ctx_get_symref (struct i8x_ctx *ctx, const char *name,
   if (err != I8X_OK)
     return err;
 
-  err = i8x_list_append_symref (ctx->symrefs, ref);
+  err = i8x_hashtable_insert (ctx->symrefs, hash,
+			      (struct i8x_object *) ref);
   if (err != I8X_OK)
     {
       ref = i8x_symref_unref (ref);
@@ -602,8 +881,54 @@ void
 i8x_ctx_forget_symref (struct i8x_symref *ref)
 {
   struct i8x_ctx *ctx = i8x_symref_get_ctx (ref);
+  const char *name = i8x_symref_get_name (ref);
 
-  i8x_list_remove_symref (ctx->symrefs, ref);
+  if (ctx->symrefs != NULL && name != NULL)
+    i8x_hashtable_remove (ctx->symrefs,
+			  i8x_hash_string (i8x_hash_init (), name),
+			  (struct i8x_object *) ref);
+}
+
+/* Function types are interned by their encoded forms, which are
+   "Frtypes(ptypes)".  As with function references, lookups hash
+   and compare the pieces in place.  */
+
+struct functype_key
+{
+  const char *ptypes;
+  size_t ptypes_size;
+  const char *rtypes;
+  size_t rtypes_size;
+};
+
+static i8x_hash_t
+functype_key_hash (const struct functype_key *key)
+{
+  static const char function_type = I8_TYPE_FUNCTION;
+  i8x_hash_t hash = i8x_hash_init ();
+
+  hash = i8x_hash_bytes (hash, &function_type, 1);
+  hash = i8x_hash_bytes (hash, key->rtypes, key->rtypes_size);
+  hash = i8x_hash_bytes (hash, "(", 1);
+  hash = i8x_hash_bytes (hash, key->ptypes, key->ptypes_size);
+  hash = i8x_hash_bytes (hash, ")", 1);
+
+  return hash;
+}
+
+static bool
+functype_matches_key (struct i8x_object *ob, const void *arg)
+{
+  static const char function_type = I8_TYPE_FUNCTION;
+  const struct functype_key *key = arg;
+  const char *str = i8x_type_get_encoded ((struct i8x_type *) ob);
+
+  str = skip_prefix (str, &function_type, 1);
+  str = skip_prefix (str, key->rtypes, key->rtypes_size);
+  str = skip_prefix (str, "(", 1);
+  str = skip_prefix (str, key->ptypes, key->ptypes_size);
+
+  return str != NULL && strcmp (str, ")") == 0;
 }
 
 i8x_err_e
@@ -615,15 +940,28 @@ i8x_ctx_get_functype (struct i8x_ctx *ctx,
 		      struct i8x_note *src_note,
 		      struct i8x_type **typep)
 {
-  struct i8x_listitem *li;
-  struct i8x_type *type;
   size_t ptypes_size = ptypes_limit - ptypes_start;
   size_t rtypes_size = rtypes_limit - rtypes_start;
+  struct functype_key key = {ptypes_start, ptypes_size,
+			     rtypes_start, rtypes_size};
+  i8x_hash_t hash = functype_key_hash (&key);
+  struct i8x_type *type;
   size_t encoded_size;
   char *encoded, *ptr;
-  i8x_err_e err = I8X_OK;
+  i8x_err_e err;
+
+  /* If we have this type already then return it.  */
+  type = (struct i8x_type *)
+    i8x_hashtable_lookup (ctx->functypes, hash,
+			  functype_matches_key, &key);
+  if (type != NULL)
+    {
+      *typep = i8x_type_ref (type);
+
+      return I8X_OK;
+    }
 
-  /* Build the encoded form.  */
+  /* It's a new type that needs creating.  Build the encoded form.  */
   encoded_size = (1	/* I8_TYPE_FUNCTION  */
 		  + rtypes_size
 		  + 1   /* '('  */
@@ -643,130 +981,424 @@ i8x_ctx_get_functype (struct i8x_ctx *ctx,
   *(ptr++) = ')';
   *(ptr++) = '\0';
 
-  /* If we have this type already then return it.  */
-  i8x_list_foreach (ctx->functypes, li)
-    {
-      type = i8x_listitem_get_type (li);
-
-      if (strcmp (i8x_type_get_encoded (type), encoded) == 0)
-	{
-	  *typep = i8x_type_ref (type);
-
-	  goto cleanup;
-	}
-    }
-
-  /* It's a new type that needs creating.  */
   err = i8x_type_new_functype (ctx, encoded,
 			       ptypes_start, ptypes_limit,
 			       rtypes_start, rtypes_limit,
 			       src_note, &type);
+  free (encoded);
   if (err != I8X_OK)
-    goto cleanup;
+    return err;
 
-  err = i8x_list_append_type (ctx->functypes, type);
+  err = i8x_hashtable_insert (ctx->functypes, hash,
+			      (struct i8x_object *) type);
   if (err != I8X_OK)
     {
       type = i8x_type_unref (type);
 
-      goto cleanup;
+      return err;
     }
 
   *typep = type;
 
- cleanup:
-  free (encoded);
-
-  return err;
+  return I8X_OK;
 }
 
 void
 i8x_ctx_forget_functype (struct i8x_type *type)
 {
   struct i8x_ctx *ctx = i8x_type_get_ctx (type);
+  const char *encoded = i8x_type_get_encoded (type);
 
-  i8x_list_remove_type (ctx->functypes, type);
+  if (ctx->functypes != NULL && encoded != NULL)
+    i8x_hashtable_remove (ctx->functypes,
+			  i8x_hash_string (i8x_hash_init (), encoded),
+			  (struct i8x_object *) type);
 }
 
+uint64_t
+i8x_ctx_get_epoch (struct i8x_ctx *ctx)
+{
+  return __atomic_load_n (&ctx->epoch, __ATOMIC_SEQ_CST);
+}
+
+/* Return the location of CTX's resolution epoch, for execution
+   contexts to read it directly.  */
+
+const uint64_t *
+i8x_ctx_get_epoch_location (struct i8x_ctx *ctx)
+{
+  return &ctx->epoch;
+}
+
+i8x_err_e
+i8x_ctx_add_xctx (struct i8x_ctx *ctx, struct i8x_xctx *xctx)
+{
+  return i8x_list_append_xctx (ctx->xctxs, xctx);
+}
+
+static bool
+is_same_object (struct i8x_object *ob, const void *data)
+{
+  return ob == data;
+}
+
+void
+i8x_ctx_forget_xctx (struct i8x_xctx *xctx)
+{
+  struct i8x_ctx *ctx = i8x_xctx_get_ctx (xctx);
+
+  if (ctx->xctxs != NULL)
+    i8x_list_remove_matching (ctx->xctxs, is_same_object, xctx);
+}
+
+/* Retire FUNC, which a function reference has stopped publishing.
+   The caller's reference to FUNC passes to the context, which will
+   release it once no call in progress can be using it.  */
+
+void
+i8x_ctx_retire_func (struct i8x_ctx *ctx, struct i8x_func *func)
+{
+  /* Calls that start after this update is finished cannot be
+     using FUNC, and those calls will start in the next epoch.  */
+  i8x_func_retire (func, ctx->epoch + 1, &ctx->retired);
+}
+
+/* Release every retired function that no call in progress can be
+   using.  This never waits for calls to finish: functions retired
+   while calls are in progress are left for a later update.  */
+
 static void
-i8x_ctx_resolve_funcrefs (struct i8x_ctx *ctx)
+i8x_ctx_reclaim_retired (struct i8x_ctx *ctx)
 {
+  uint64_t epoch = ctx->epoch;
   struct i8x_listitem *li;
-  bool finished = false;
 
-  /* Mark all function references as resolved or not based
-     on whether they resolve to a unique registered function.
-     Dependencies are ignored at this stage.  */
-  i8x_list_foreach (ctx->funcrefs, li)
+  if (ctx->retired == NULL)
+    return;
+
+  i8x_list_foreach (ctx->xctxs, li)
     {
-      struct i8x_funcref *ref = i8x_listitem_get_funcref (li);
+      uint64_t call_epoch
+	= i8x_xctx_get_call_epoch (i8x_listitem_get_xctx (li));
 
-      i8x_funcref_reset_is_resolved (ref);
+      if (call_epoch != 0 && call_epoch < epoch)
+	epoch = call_epoch;
     }
 
-  /* Mark functions unresolved if any of their dependencies
-     are unresolved.  Repeat until nothing changes.  */
-  while (!finished)
-    {
-      finished = true;
+  i8x_func_reclaim (&ctx->retired, epoch);
+}
 
-      i8x_list_foreach (ctx->functions, li)
-	{
-	  struct i8x_func *func = i8x_listitem_get_func (li);
-	  struct i8x_funcref *ref = i8x_func_get_funcref (func);
+/* Resolve every reference in CTX's list of changed references,
+   publish the results, notify the user of any functions whose
+   availability changed, and start a new epoch.  */
+
+static void
+i8x_ctx_update_resolution (struct i8x_ctx *ctx)
+{
+  struct i8x_funcref *changed = ctx->changed;
+  struct i8x_func *pending = ctx->pending;
+
+  /* Unregistered functions are already pending, as they are no
+     longer on their references' registered lists.  The context's
+     lists are emptied first, so observers may start new updates.  */
+  ctx->changed = NULL;
+  ctx->pending = NULL;
+  i8x_funcref_update_resolution (changed, &pending);
+  i8x_func_fire_pending (pending);
+
+  __atomic_add_fetch (&ctx->epoch, 1, __ATOMIC_SEQ_CST);
+  i8x_ctx_reclaim_retired (ctx);
+}
 
-	  if (!i8x_funcref_is_resolved (ref))
-	    continue;
+/* Record that REF's registered functions have changed, and resolve
+   it unless an update is in progress.  */
 
-	  if (i8x_func_all_deps_resolved (func))
-	    continue;
+static void
+i8x_ctx_funcref_changed (struct i8x_ctx *ctx, struct i8x_funcref *ref)
+{
+  i8x_funcref_mark_changed (ref, &ctx->changed);
 
-	  i8x_funcref_mark_unresolved (ref);
+  if (ctx->update_depth == 0)
+    i8x_ctx_update_resolution (ctx);
+}
 
-	  finished = false;
-	}
-    }
+/**
+ * i8x_ctx_begin_update:
+ * @ctx: i8x library context
+ *
+ * Start a batch of registrations and unregistrations.  Until the
+ * matching call to i8x_ctx_commit_update, changes to the functions
+ * registered with @ctx are recorded but function references are not
+ * re-resolved and availability observers are not called.  Calls made
+ * during an update, on this or any other thread, use the functions
+ * that were available when the last update was committed.  Calls
+ * to this function may be nested.
+ **/
+I8X_EXPORT void
+i8x_ctx_begin_update (struct i8x_ctx *ctx)
+{
+  ctx->update_depth++;
+}
+
+/**
+ * i8x_ctx_commit_update:
+ * @ctx: i8x library context
+ *
+ * Finish a batch of registrations and unregistrations started by
+ * i8x_ctx_begin_update.  When the outermost update is committed,
+ * every function reference affected by the batch is re-resolved in
+ * one pass, and availability observers are called once for each
+ * function whose availability changed.  Calls already in progress
+ * on other threads are not waited for: they continue to use the
+ * functions they started with, and functions unregistered by the
+ * batch are not released until those calls return.
+ **/
+I8X_EXPORT void
+i8x_ctx_commit_update (struct i8x_ctx *ctx)
+{
+  i8x_assert (ctx->update_depth > 0);
+
+  if (--ctx->update_depth == 0 && ctx->changed != NULL)
+    i8x_ctx_update_resolution (ctx);
+}
+
+static i8x_hash_t
+hash_origin (const void *origin)
+{
+  return i8x_hash_bytes (i8x_hash_init (), (const char *) &origin,
+			 sizeof (origin));
+}
+
+static bool
+func_has_origin (struct i8x_object *ob, const void *origin)
+{
+  return i8x_func_get_origin ((struct i8x_func *) ob) == origin;
+}
+
+/* Return the first function on the list of functions registered
+   with CTX whose origin is ORIGIN, or NULL if there are none.  */
+
+static struct i8x_func *
+i8x_ctx_get_first_with_origin (struct i8x_ctx *ctx, const void *origin)
+{
+  return (struct i8x_func *)
+    i8x_hashtable_lookup (ctx->origins, hash_origin (origin),
+			  func_has_origin, origin);
+}
 
-  /* Notify the user of any function availability changes.  */
-  i8x_list_foreach (ctx->functions, li)
+/* Add FUNC, which is being registered, to the list of functions
+   registered with CTX with the same origin.  */
+
+static i8x_err_e
+i8x_ctx_add_registered (struct i8x_ctx *ctx, struct i8x_func *func)
+{
+  const void *origin = i8x_func_get_origin (func);
+  struct i8x_func *first;
+
+  first = i8x_ctx_get_first_with_origin (ctx, origin);
+  if (first == NULL)
     {
-      struct i8x_func *func = i8x_listitem_get_func (li);
+      i8x_err_e err;
 
-      i8x_func_fire_availability_observers (func);
+      err = i8x_hashtable_insert (ctx->origins, hash_origin (origin),
+				  (struct i8x_object *) func);
+      if (err != I8X_OK)
+	return err;
     }
+
+  i8x_func_link_registered (func, first);
+  i8x_func_ref (func);
+
+  return I8X_OK;
+}
+
+/* Undo i8x_ctx_add_registered.  */
+
+static void
+i8x_ctx_remove_registered (struct i8x_ctx *ctx, struct i8x_func *func)
+{
+  struct i8x_func *first = i8x_func_unlink_registered (func);
+
+  if (first != func)
+    {
+      i8x_hash_t hash = hash_origin (i8x_func_get_origin (func));
+
+      if (first != NULL)
+	i8x_hashtable_replace (ctx->origins, hash,
+			       (struct i8x_object *) func,
+			       (struct i8x_object *) first);
+      else
+	i8x_hashtable_remove (ctx->origins, hash,
+			      (struct i8x_object *) func);
+    }
+
+  i8x_func_unref (func);
 }
 
 I8X_EXPORT i8x_err_e
 i8x_ctx_register_func (struct i8x_ctx *ctx, struct i8x_func *func)
 {
+  struct i8x_funcref *ref = i8x_func_get_funcref (func);
   i8x_err_e err;
 
   dbg (ctx, "registering func %p\n", func);
   i8x_assert (i8x_func_get_ctx (func) == ctx);
 
-  err = i8x_list_append_func (ctx->functions, func);
+  if (i8x_func_is_registered (func))
+    return i8x_invalid_argument (ctx);
+
+  err = i8x_ctx_add_registered (ctx, func);
   if (err != I8X_OK)
     return err;
 
-  i8x_funcref_register_func (i8x_func_get_funcref (func), func);
-  i8x_ctx_resolve_funcrefs (ctx);
+  err = i8x_func_add_dependencies (func);
+  if (err != I8X_OK)
+    {
+      i8x_ctx_remove_registered (ctx, func);
+
+      return err;
+    }
+
+  err = i8x_funcref_register_func (ref, func);
+  if (err != I8X_OK)
+    {
+      i8x_func_remove_dependencies (func);
+      i8x_ctx_remove_registered (ctx, func);
+
+      return err;
+    }
+
+  i8x_ctx_funcref_changed (ctx, ref);
 
   return I8X_OK;
 }
 
-I8X_EXPORT i8x_err_e
-i8x_ctx_unregister_func (struct i8x_ctx *ctx, struct i8x_func *func)
+/* Unregister FUNC in everything but the context's lists of
+   registered functions, which the caller must remove it from.  */
+
+static void
+i8x_ctx_detach_func (struct i8x_ctx *ctx, struct i8x_func *func)
 {
+  struct i8x_funcref *ref = i8x_func_get_funcref (func);
+
   dbg (ctx, "unregistering func %p\n", func);
   i8x_assert (i8x_func_get_ctx (func) == ctx);
 
-  i8x_funcref_unregister_func (i8x_func_get_funcref (func), func);
-  i8x_ctx_resolve_funcrefs (ctx);
-  i8x_list_remove_func (ctx->functions, func);
+  i8x_funcref_unregister_func (ref, func);
+  i8x_func_remove_dependencies (func);
+  i8x_func_mark_pending (func, &ctx->pending);
+  i8x_ctx_funcref_changed (ctx, ref);
+}
+
+I8X_EXPORT i8x_err_e
+i8x_ctx_unregister_func (struct i8x_ctx *ctx, struct i8x_func *func)
+{
+  if (!i8x_func_is_registered (func))
+    return i8x_invalid_argument (ctx);
+
+  i8x_ctx_detach_func (ctx, func);
+  i8x_ctx_remove_registered (ctx, func);
 
   return I8X_OK;
 }
 
+/**
+ * i8x_ctx_unregister_origin:
+ * @ctx: i8x library context
+ * @origin: the origin handle to unregister
+ *
+ * Unregister every function registered with @ctx whose origin is
+ * @origin, as a single update.  The time taken is proportional to
+ * the number of functions with that origin, not to the number of
+ * functions registered.  If @origin is the origin of an ELF file
+ * loaded with i8x_ctx_load_elf then the file is also forgotten, so
+ * it may be loaded again.  Origin handles of ELF files are never
+ * reused, so passing the handle of a file that has already been
+ * unloaded does nothing, even if the file has been loaded again.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_ctx_unregister_origin (struct i8x_ctx *ctx, const void *origin)
+{
+  struct i8x_listitem *li;
+  struct i8x_func *func;
+
+  if (origin == NULL)
+    return i8x_invalid_argument (ctx);
+
+  func = i8x_ctx_get_first_with_origin (ctx, origin);
+  if (func != NULL)
+    {
+      i8x_hashtable_remove (ctx->origins, hash_origin (origin),
+			    (struct i8x_object *) func);
+
+      i8x_ctx_begin_update (ctx);
+
+      while (func != NULL)
+	{
+	  struct i8x_func *next = i8x_func_unlink_registered (func);
+
+	  i8x_ctx_detach_func (ctx, func);
+	  i8x_func_unref (func);
+	  func = next;
+	}
+
+      i8x_ctx_commit_update (ctx);
+    }
+
+  i8x_list_foreach (ctx->elffiles, li)
+    {
+      struct i8x_elffile *ef = i8x_listitem_get_elffile (li);
+
+      if (i8x_elffile_get_origin (ef) == origin)
+	{
+	  i8x_list_remove_elffile (ctx->elffiles, ef);
+	  break;
+	}
+    }
+
+  return I8X_OK;
+}
+
+/**
+ * i8x_ctx_register_funcs:
+ * @ctx: i8x library context
+ * @funcs: array of functions to register
+ * @num_funcs: number of functions in the array
+ *
+ * Register every function in @funcs with @ctx as a single update.
+ * Either every function is registered or none are.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_ctx_register_funcs (struct i8x_ctx *ctx, struct i8x_func **funcs,
+			size_t num_funcs)
+{
+  i8x_err_e err = I8X_OK;
+  size_t i;
+
+  i8x_ctx_begin_update (ctx);
+
+  for (i = 0; i < num_funcs; i++)
+    {
+      err = i8x_ctx_register_func (ctx, funcs[i]);
+      if (err != I8X_OK)
+	break;
+    }
+
+  if (err != I8X_OK)
+    {
+      while (i-- > 0)
+	i8x_ctx_unregister_func (ctx, funcs[i]);
+    }
+
+  i8x_ctx_commit_update (ctx);
+
+  return err;
+}
+
 /* convenience */
 
 I8X_EXPORT i8x_err_e
@@ -794,6 +1426,85 @@ i8x_ctx_register_native_func (struct i8x_ctx *ctx,
   return err;
 }
 
+/* Register a native function with a fixed-arity implementation.
+   Calls through callables of the same arity pass their arguments
+   straight to IMPL_FN, without going through arrays.  */
+
+static i8x_err_e
+i8x_ctx_register_typed_native_func (struct i8x_ctx *ctx,
+				    const char *provider,
+				    const char *name,
+				    const char *ptypes,
+				    const char *rtypes, int arity,
+				    union i8x_nat_typed_fn impl_fn)
+{
+  struct i8x_funcref *sig;
+  struct i8x_func *func;
+  i8x_err_e err;
+
+  err = i8x_ctx_get_funcref (ctx, provider, name, ptypes, rtypes, &sig);
+  if (err != I8X_OK)
+    return err;
+
+  err = i8x_func_new_typed_native (ctx, sig, arity, impl_fn, &func);
+  i8x_funcref_unref (sig);
+  if (err != I8X_OK)
+    return err;
+
+  err = i8x_ctx_register_func (ctx, func);
+  i8x_func_unref (func);
+
+  return err;
+}
+
+I8X_EXPORT i8x_err_e
+i8x_ctx_register_native_func_0 (struct i8x_ctx *ctx,
+				const char *provider, const char *name,
+				const char *ptypes, const char *rtypes,
+				i8x_nat_fn0_t *impl_fn)
+{
+  union i8x_nat_typed_fn impl = {.fn0 = impl_fn};
+
+  return i8x_ctx_register_typed_native_func (ctx, provider, name,
+					     ptypes, rtypes, 0, impl);
+}
+
+I8X_EXPORT i8x_err_e
+i8x_ctx_register_native_func_1 (struct i8x_ctx *ctx,
+				const char *provider, const char *name,
+				const char *ptypes, const char *rtypes,
+				i8x_nat_fn1_t *impl_fn)
+{
+  union i8x_nat_typed_fn impl = {.fn1 = impl_fn};
+
+  return i8x_ctx_register_typed_native_func (ctx, provider, name,
+					     ptypes, rtypes, 1, impl);
+}
+
+I8X_EXPORT i8x_err_e
+i8x_ctx_register_native_func_2 (struct i8x_ctx *ctx,
+				const char *provider, const char *name,
+				const char *ptypes, const char *rtypes,
+				i8x_nat_fn2_t *impl_fn)
+{
+  union i8x_nat_typed_fn impl = {.fn2 = impl_fn};
+
+  return i8x_ctx_register_typed_native_func (ctx, provider, name,
+					     ptypes, rtypes, 2, impl);
+}
+
+I8X_EXPORT i8x_err_e
+i8x_ctx_register_native_func_3 (struct i8x_ctx *ctx,
+				const char *provider, const char *name,
+				const char *ptypes, const char *rtypes,
+				i8x_nat_fn3_t *impl_fn)
+{
+  union i8x_nat_typed_fn impl = {.fn3 = impl_fn};
+
+  return i8x_ctx_register_typed_native_func (ctx, provider, name,
+					     ptypes, rtypes, 3, impl);
+}
+
 /* convenience */
 /* note it can stop mid-way! */
 
@@ -803,6 +1514,8 @@ i8x_ctx_register_native_funcs (struct i8x_ctx *ctx,
 {
   i8x_err_e err = I8X_OK;
 
+  i8x_ctx_begin_update (ctx);
+
   while (table->provider != NULL)
     {
       err = i8x_ctx_register_native_func (ctx,
@@ -817,55 +1530,7 @@ i8x_ctx_register_native_funcs (struct i8x_ctx *ctx,
       table++;
     }
 
-  return err;
-}
+  i8x_ctx_commit_update (ctx);
 
-static i8x_err_e
-i8x_ctx_make_dispatch_table (struct i8x_ctx *ctx, size_t table_size,
-			     bool is_debug, void ***tablep)
-{
-  void **table;
-  i8x_err_e err;
-
-  table = calloc (table_size, sizeof (void *));
-  if (table == NULL)
-    return i8x_out_of_memory (ctx);
-
-  err = i8x_ctx_init_dispatch_table (ctx, table, table_size, is_debug);
-  if (err != I8X_OK)
-    return err;
-
-  *tablep = table;
-
-  return I8X_OK;
-}
-
-i8x_err_e
-i8x_ctx_get_dispatch_tables (struct i8x_ctx *ctx,
-			     void ***dispatch_std,
-			     void ***dispatch_dbg)
-{
-  size_t table_size = i8x_ctx_get_dispatch_table_size (ctx);
-  i8x_err_e err;
-
-  if (ctx->dispatch_std == NULL)
-    {
-      err = i8x_ctx_make_dispatch_table (ctx, table_size, false,
-					 &ctx->dispatch_std);
-      if (err != I8X_OK)
-	return err;
-    }
-
-  if (ctx->dispatch_dbg == NULL)
-    {
-      err = i8x_ctx_make_dispatch_table (ctx, table_size, true,
-					 &ctx->dispatch_dbg);
-      if (err != I8X_OK)
-	return err;
-    }
-
-  *dispatch_std = ctx->dispatch_std;
-  *dispatch_dbg = ctx->dispatch_dbg;
-
-  return I8X_OK;
+  return err;
 }
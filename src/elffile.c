@@ -0,0 +1,573 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include <elf.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libi8x-private.h"
+
+#ifndef NT_GNU_INFINITY
+#  define NT_GNU_INFINITY 5
+#endif
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#  define ELFDATA_HOST ELFDATA2LSB
+#else
+#  define ELFDATA_HOST ELFDATA2MSB
+#endif
+
+/* An ELF file loaded by i8x_ctx_load_elf.  The file is mapped for
+   as long as this object exists, and notes created from it refer
+   directly into the mapping.  */
+
+struct i8x_elffile
+{
+  I8X_OBJECT_FIELDS;
+
+  char *filename;	/* The name the file was loaded with.  */
+
+  void *map;		/* The mapped file.  */
+  size_t mapsize;	/* Size of the above, in bytes.  */
+
+  dev_t st_dev;		/* Device and inode, for files */
+  ino_t st_ino;		/* without build IDs.  */
+
+  const char *build_id;	/* Pointer into the mapping, or NULL.  */
+  size_t build_id_size;	/* Size of the above, in bytes.  */
+
+  const void *origin;	/* Origin of the file's functions.  */
+};
+
+static void
+i8x_elffile_free (struct i8x_object *ob)
+{
+  struct i8x_elffile *ef = (struct i8x_elffile *) ob;
+
+  if (ef->map != NULL)
+    munmap (ef->map, ef->mapsize);
+
+  if (ef->filename != NULL)
+    free (ef->filename);
+}
+
+const struct i8x_object_ops i8x_elffile_ops =
+  {
+    "elffile",				/* Object name.  */
+    sizeof (struct i8x_elffile),	/* Object size.  */
+    NULL,				/* Unlink function.  */
+    i8x_elffile_free,			/* Free function.  */
+  };
+
+/* Callback for i8x_elffile_foreach_note.  */
+
+typedef i8x_err_e i8x_elffile_note_fn_t (struct i8x_elffile *ef,
+					 uint32_t type,
+					 const char *name,
+					 const char *desc,
+					 size_t descsz,
+					 void *data);
+
+/* The parts of a section header we care about.  */
+
+struct section
+{
+  uint32_t name;
+  uint32_t type;
+  size_t offset;
+  size_t size;
+  size_t align;
+};
+
+static void
+read_shdr (const char *shdr, bool is_64, struct section *scn)
+{
+  if (is_64)
+    {
+      const Elf64_Shdr *s = (const Elf64_Shdr *) shdr;
+
+      scn->name = s->sh_name;
+      scn->type = s->sh_type;
+      scn->offset = s->sh_offset;
+      scn->size = s->sh_size;
+      scn->align = s->sh_addralign;
+    }
+  else
+    {
+      const Elf32_Shdr *s = (const Elf32_Shdr *) shdr;
+
+      scn->name = s->sh_name;
+      scn->type = s->sh_type;
+      scn->offset = s->sh_offset;
+      scn->size = s->sh_size;
+      scn->align = s->sh_addralign;
+    }
+}
+
+/* Call FN for every note in every SHT_NOTE section of EF.  Files
+   which are not ELF have no notes as far as this function is
+   concerned.  */
+
+static i8x_err_e
+i8x_elffile_foreach_note (struct i8x_elffile *ef,
+			  i8x_elffile_note_fn_t *fn, void *data)
+{
+  const unsigned char *ident = ef->map;
+  const char *base = ef->map;
+  size_t size = ef->mapsize;
+  size_t shoff, shentsize, shnum, shstrndx;
+  struct section strtab = {0};
+  bool is_64;
+
+  if (size < EI_NIDENT || memcmp (ident, ELFMAG, SELFMAG) != 0)
+    return I8X_OK;
+
+  switch (ident[EI_CLASS])
+    {
+    case ELFCLASS32:
+      {
+	const Elf32_Ehdr *ehdr = ef->map;
+
+	if (size < sizeof (*ehdr))
+	  return I8X_OK;
+
+	shoff = ehdr->e_shoff;
+	shentsize = ehdr->e_shentsize;
+	shnum = ehdr->e_shnum;
+	shstrndx = ehdr->e_shstrndx;
+	is_64 = false;
+      }
+      break;
+
+    case ELFCLASS64:
+      {
+	const Elf64_Ehdr *ehdr = ef->map;
+
+	if (size < sizeof (*ehdr))
+	  return I8X_OK;
+
+	shoff = ehdr->e_shoff;
+	shentsize = ehdr->e_shentsize;
+	shnum = ehdr->e_shnum;
+	shstrndx = ehdr->e_shstrndx;
+	is_64 = true;
+      }
+      break;
+
+    default:
+      return I8X_OK;
+    }
+
+  if (shoff == 0 || shoff >= size
+      || shentsize < (is_64 ? sizeof (Elf64_Shdr) : sizeof (Elf32_Shdr))
+      || size - shoff < shentsize)
+    return I8X_OK;
+
+  /* Files with more than SHN_LORESERVE sections store the real
+     count and string table index in the first section header.  */
+  if (shnum == 0 || shstrndx == SHN_XINDEX)
+    {
+      const char *shdr = base + shoff;
+
+      if (shnum == 0)
+	shnum = is_64
+	  ? ((const Elf64_Shdr *) shdr)->sh_size
+	  : ((const Elf32_Shdr *) shdr)->sh_size;
+
+      if (shstrndx == SHN_XINDEX)
+	shstrndx = is_64
+	  ? ((const Elf64_Shdr *) shdr)->sh_link
+	  : ((const Elf32_Shdr *) shdr)->sh_link;
+    }
+
+  if (shnum > (size - shoff) / shentsize)
+    return I8X_OK;
+
+  if (shstrndx != SHN_UNDEF && shstrndx < shnum)
+    {
+      read_shdr (base + shoff + shstrndx * shentsize, is_64, &strtab);
+      if (strtab.offset > size || strtab.size > size - strtab.offset)
+	strtab.size = 0;
+    }
+
+  for (size_t i = 0; i < shnum; i++)
+    {
+      struct section scn;
+      size_t align;
+
+      read_shdr (base + shoff + i * shentsize, is_64, &scn);
+
+      if (scn.type != SHT_NOTE
+	  || scn.offset > size || scn.size > size - scn.offset)
+	continue;
+
+      /* NT_GNU_PROPERTY_TYPE_0 notes share their type number with
+	 NT_GNU_INFINITY, so skip the section that holds them.  */
+      if (scn.name < strtab.size
+	  && strncmp (base + strtab.offset + scn.name,
+		      ".note.gnu.property",
+		      strtab.size - scn.name) == 0)
+	continue;
+
+      /* Notes are four-byte aligned except in sections which
+	 explicitly request eight (e.g. .note.gnu.property).  */
+      align = scn.align == 8 ? 8 : 4;
+
+      for (size_t offset = 0; scn.size - offset >= sizeof (Elf32_Nhdr); )
+	{
+	  const char *note = base + scn.offset + offset;
+	  const Elf32_Nhdr *nhdr = (const Elf32_Nhdr *) note;
+	  size_t name_offset = sizeof (Elf32_Nhdr);
+	  size_t desc_offset, next;
+	  i8x_err_e err;
+
+	  desc_offset = name_offset + nhdr->n_namesz;
+	  desc_offset = (desc_offset + align - 1) & ~(align - 1);
+	  next = desc_offset + nhdr->n_descsz;
+	  next = (next + align - 1) & ~(align - 1);
+
+	  if (desc_offset < name_offset || next < desc_offset
+	      || next > scn.size - offset)
+	    break;
+
+	  /* Ignore notes whose names are not terminated.  */
+	  if (nhdr->n_namesz != 0 && note[name_offset
+					  + nhdr->n_namesz - 1] == '\0')
+	    {
+	      err = fn (ef, nhdr->n_type, note + name_offset,
+			note + desc_offset, nhdr->n_descsz, data);
+	      if (err != I8X_OK)
+		return err;
+	    }
+
+	  offset += next;
+	}
+    }
+
+  return I8X_OK;
+}
+
+static i8x_err_e
+i8x_elffile_find_build_id (struct i8x_elffile *ef, uint32_t type,
+			   const char *name, const char *desc,
+			   size_t descsz, void *data)
+{
+  if (type == NT_GNU_BUILD_ID && strcmp (name, "GNU") == 0
+      && ef->build_id == NULL && descsz != 0)
+    {
+      ef->build_id = desc;
+      ef->build_id_size = descsz;
+    }
+
+  return I8X_OK;
+}
+
+/* Returns true if A and B are the same file.  Files are matched
+   by build ID if both have one, and by device and inode if not.  */
+
+static bool
+i8x_elffile_matches (struct i8x_elffile *a, struct i8x_elffile *b)
+{
+  if (a->build_id != NULL && b->build_id != NULL)
+    return a->build_id_size == b->build_id_size
+      && memcmp (a->build_id, b->build_id, a->build_id_size) == 0;
+
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+/* State for i8x_elffile_load_note.  */
+
+struct load_state
+{
+  struct i8x_note **notes;	/* Notes found so far.  */
+  size_t num_notes;		/* Number of notes in the above.  */
+  size_t max_notes;		/* Allocated size of the above.  */
+};
+
+static i8x_err_e
+i8x_elffile_load_note (struct i8x_elffile *ef, uint32_t type,
+		       const char *name, const char *desc,
+		       size_t descsz, void *data)
+{
+  struct load_state *state = data;
+  struct i8x_ctx *ctx = i8x_elffile_get_ctx (ef);
+  i8x_err_e err;
+
+  if (type != NT_GNU_INFINITY || strcmp (name, "GNU") != 0)
+    return I8X_OK;
+
+  if (state->num_notes == state->max_notes)
+    {
+      size_t max_notes = state->max_notes ? state->max_notes * 2 : 16;
+      struct i8x_note **notes;
+
+      notes = realloc (state->notes, max_notes * sizeof (*notes));
+      if (notes == NULL)
+	return i8x_out_of_memory (ctx);
+
+      state->notes = notes;
+      state->max_notes = max_notes;
+    }
+
+  err = i8x_note_new_from_buf_owned (ctx, desc, descsz, ef->filename,
+				     desc - (const char *) ef->map,
+				     (struct i8x_object *) ef, ef->origin,
+				     &state->notes[state->num_notes]);
+  if (err != I8X_OK)
+    return err;
+
+  state->num_notes++;
+
+  return I8X_OK;
+}
+
+/* Create an ELF file object for FD and map its contents.  Device
+   nodes, pipes and other files which are not regular files cannot
+   be ELF, so NULL is stored in *ELFFILE for them.  */
+
+static i8x_err_e
+i8x_elffile_new (struct i8x_ctx *ctx, int fd, const char *filename,
+		 struct i8x_elffile **elffile)
+{
+  struct i8x_elffile *ef;
+  struct stat st;
+  i8x_err_e err;
+
+  if (fstat (fd, &st) != 0)
+    return i8x_ctx_set_error (ctx, I8X_EIO, NULL, NULL);
+
+  if (!S_ISREG (st.st_mode))
+    {
+      *elffile = NULL;
+
+      return I8X_OK;
+    }
+
+  err = i8x_ob_new (ctx, &i8x_elffile_ops, &ef);
+  if (err != I8X_OK)
+    return err;
+
+  ef->st_dev = st.st_dev;
+  ef->st_ino = st.st_ino;
+
+  if (filename != NULL)
+    {
+      ef->filename = strdup (filename);
+      if (ef->filename == NULL)
+	{
+	  err = i8x_out_of_memory (ctx);
+	  goto error;
+	}
+    }
+
+  if (st.st_size != 0)
+    {
+      ef->mapsize = st.st_size;
+      ef->map = mmap (NULL, ef->mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ef->map == MAP_FAILED)
+	{
+	  ef->map = NULL;
+	  err = i8x_ctx_set_error (ctx, I8X_EIO, NULL, NULL);
+	  goto error;
+	}
+
+      /* Notes are decoded in place, which cannot be done for files
+	 with a different byte order to this host, so such files are
+	 treated as though they had no notes.  */
+      if (ef->mapsize >= EI_NIDENT
+	  && memcmp (ef->map, ELFMAG, SELFMAG) == 0
+	  && ((const unsigned char *) ef->map)[EI_DATA] != ELFDATA_HOST)
+	{
+	  notice (ctx, "%s: byte order differs from this host\n",
+		  ef->filename != NULL ? ef->filename : "(unnamed)");
+
+	  munmap (ef->map, ef->mapsize);
+	  ef->map = NULL;
+	  ef->mapsize = 0;
+	}
+    }
+
+  *elffile = ef;
+
+  return I8X_OK;
+
+ error:
+  ef = i8x_elffile_unref (ef);
+
+  return err;
+}
+
+/* Return the origin of functions loaded from EF, or NULL if EF has
+   not been loaded.  */
+
+const void *
+i8x_elffile_get_origin (struct i8x_elffile *ef)
+{
+  return ef->origin;
+}
+
+static uint64_t
+monotonic_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * i8x_ctx_load_elf_fd:
+ * @ctx: i8x library context
+ * @fd: file descriptor of the ELF file to load
+ * @srcname: the name of the file, for error messages
+ * @stats: where to store statistics about the load, or NULL
+ *
+ * Create and register functions from every Infinity note in the
+ * specified ELF file.  The file is mapped into memory rather than
+ * read, and notes are decoded in place.  Files which have already
+ * been loaded into this context, as identified by their build ID
+ * or, failing that, by their device and inode, are skipped.  Files
+ * that are not ELF, including device nodes and other files that are
+ * not regular files, are silently ignored.  ELF files with a
+ * different byte order to this host are ignored with a notice.
+ * The file descriptor may be closed once this function returns.
+ *
+ * Functions are created and registered with i8x_ctx_register_notes,
+ * so either every note in the file is loaded or none are.  Every
+ * function loaded from the file has the origin handle stored in
+ * @stats, so the file can be unloaded with i8x_ctx_unregister_origin.
+ * Each load of a file has a new origin handle, which is never reused
+ * by this context even once the file is unloaded.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_ctx_load_elf_fd (struct i8x_ctx *ctx, int fd, const char *srcname,
+		     struct i8x_load_stats *stats)
+{
+  struct i8x_load_stats dummy_stats;
+  struct load_state state;
+  struct i8x_elffile *ef = NULL;
+  struct i8x_list *loaded;
+  struct i8x_listitem *li;
+  uint64_t start_time;
+  i8x_err_e err;
+
+  if (stats == NULL)
+    stats = &dummy_stats;
+
+  memset (stats, 0, sizeof (*stats));
+  start_time = monotonic_ns ();
+
+  err = i8x_elffile_new (ctx, fd, srcname, &ef);
+  if (err != I8X_OK || ef == NULL)
+    return err;
+
+  err = i8x_elffile_foreach_note (ef, i8x_elffile_find_build_id, NULL);
+  if (err != I8X_OK)
+    goto cleanup;
+
+  /* Skip files we've seen already.  */
+  loaded = i8x_ctx_get_elffiles (ctx);
+  i8x_list_foreach (loaded, li)
+    {
+      struct i8x_elffile *other = i8x_listitem_get_elffile (li);
+
+      if (i8x_elffile_matches (other, ef))
+	{
+	  stats->was_loaded = true;
+	  stats->origin = other->origin;
+	  goto cleanup;
+	}
+    }
+
+  ef->origin = i8x_ctx_new_origin (ctx);
+
+  memset (&state, 0, sizeof (state));
+  err = i8x_elffile_foreach_note (ef, i8x_elffile_load_note, &state);
+  stats->num_notes = state.num_notes;
+
+  if (err == I8X_OK)
+    err = i8x_list_append_elffile (loaded, ef);
+
+  if (err == I8X_OK)
+    {
+      err = i8x_ctx_register_notes (ctx, state.notes, state.num_notes, 0);
+      if (err == I8X_OK)
+	{
+	  stats->num_funcs = state.num_notes;
+	  stats->origin = ef->origin;
+	}
+      else
+	i8x_list_remove_elffile (loaded, ef);
+    }
+
+  for (size_t i = 0; i < state.num_notes; i++)
+    i8x_note_unref (state.notes[i]);
+
+  if (state.notes != NULL)
+    free (state.notes);
+
+ cleanup:
+  stats->elapsed_ns = monotonic_ns () - start_time;
+
+  info (ctx, "%s: %s%zu notes, %zu functions in %lu.%06lu ms\n",
+	ef->filename != NULL ? ef->filename : "(unnamed)",
+	stats->was_loaded ? "already loaded, " : "",
+	stats->num_notes, stats->num_funcs,
+	(unsigned long) (stats->elapsed_ns / 1000000),
+	(unsigned long) (stats->elapsed_ns % 1000000));
+
+  ef = i8x_elffile_unref (ef);
+
+  return err;
+}
+
+/**
+ * i8x_ctx_load_elf:
+ * @ctx: i8x library context
+ * @filename: the ELF file to load
+ * @stats: where to store statistics about the load, or NULL
+ *
+ * Open the specified file and load it with i8x_ctx_load_elf_fd.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_ctx_load_elf (struct i8x_ctx *ctx, const char *filename,
+		  struct i8x_load_stats *stats)
+{
+  i8x_err_e err;
+  int fd;
+
+  fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return i8x_ctx_set_error (ctx, I8X_EIO, NULL, NULL);
+
+  err = i8x_ctx_load_elf_fd (ctx, fd, filename, stats);
+  close (fd);
+
+  return err;
+}
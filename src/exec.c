@@ -0,0 +1,521 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libi8x-private.h"
+
+/* Executors make batches of calls using a pool of worker threads,
+   each with its own execution context.  The calling thread is worker
+   zero.  Each batch is split evenly between the workers, and each
+   worker's share is held in a deque.  Workers take calls from the
+   front of their own deque, and when that is empty they steal the
+   back half of another worker's.  Nothing is added to a deque once
+   a batch has started, so each deque is just a range of indexes into
+   the batch, packed into a single word so both ends can be updated
+   with one compare-and-swap.  */
+
+#define CACHELINE_SIZE 64
+
+struct i8x_worker
+{
+  /* The calls this worker has yet to make, as DEQUE (head, tail).
+     Updated by this worker and by thieves.  */
+  uint64_t deque;
+
+  struct i8x_exec *exec;	/* The executor this worker is part of.  */
+  struct i8x_xctx *xctx;	/* This worker's execution context.  */
+
+  pthread_t thread;		/* The worker's thread.  */
+  bool thread_started;		/* True if the above is valid.  */
+
+  /* Statistics for the current or most recent batch.  */
+  struct i8x_worker_stats stats;
+
+  /* The lowest-indexed call this worker made that failed, or the
+     number of calls if none failed, and where it failed.  */
+  size_t first_error;
+  struct i8x_error_sink error;
+} __attribute__ ((aligned (CACHELINE_SIZE)));
+
+#define DEQUE(head, tail) (((uint64_t) (head) << 32) | (uint32_t) (tail))
+#define DEQUE_HEAD(deque) ((uint32_t) ((deque) >> 32))
+#define DEQUE_TAIL(deque) ((uint32_t) (deque))
+
+/* The largest batch a deque can describe.  */
+#define MAX_CALLS UINT32_MAX
+
+struct i8x_exec
+{
+  I8X_OBJECT_FIELDS;
+
+  pthread_mutex_t lock;		/* Protects everything below.  */
+  pthread_cond_t batch_ready;	/* Signalled when a batch starts.  */
+  pthread_cond_t batch_done;	/* Signalled when a worker finishes.  */
+
+  unsigned long generation;	/* Incremented for every batch.  */
+  unsigned int num_running;	/* Threads working on this batch.  */
+  bool shutdown;		/* True if the threads should exit.  */
+
+  struct i8x_call *calls;	/* The current batch.  */
+  size_t num_calls;		/* Size of the above.  */
+
+  unsigned int num_workers;	/* Including the calling thread.  */
+  struct i8x_worker *workers;
+};
+
+static uint64_t
+monotonic_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Take the call at the front of WORKER's deque.  Returns false if
+   the deque is empty.  */
+
+static bool
+i8x_worker_pop (struct i8x_worker *worker, size_t *index)
+{
+  uint64_t old = __atomic_load_n (&worker->deque, __ATOMIC_ACQUIRE);
+  uint32_t head, tail;
+
+  do
+    {
+      head = DEQUE_HEAD (old);
+      tail = DEQUE_TAIL (old);
+
+      if (head >= tail)
+	return false;
+    }
+  while (!__atomic_compare_exchange_n (&worker->deque, &old,
+				       DEQUE (head + 1, tail), true,
+				       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  *index = head;
+
+  return true;
+}
+
+/* Take the back half of VICTIM's deque.  Returns the number of calls
+   taken, which start at *START.  */
+
+static size_t
+i8x_worker_steal_from (struct i8x_worker *victim, size_t *start)
+{
+  uint64_t old = __atomic_load_n (&victim->deque, __ATOMIC_ACQUIRE);
+  uint32_t head, tail, count;
+
+  do
+    {
+      head = DEQUE_HEAD (old);
+      tail = DEQUE_TAIL (old);
+
+      if (head >= tail)
+	return 0;
+
+      count = (tail - head + 1) / 2;
+    }
+  while (!__atomic_compare_exchange_n (&victim->deque, &old,
+				       DEQUE (head, tail - count), true,
+				       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  *start = tail - count;
+
+  return count;
+}
+
+/* Refill WORKER's empty deque from another worker's, and take the
+   first call stolen.  Returns false if every deque was empty.  Calls
+   being moved between deques by other thieves are not seen, but
+   those thieves will make them.  */
+
+static bool
+i8x_worker_steal (struct i8x_worker *worker, size_t *index)
+{
+  struct i8x_exec *exec = worker->exec;
+  unsigned int self = worker - exec->workers;
+  unsigned int i;
+
+  for (i = 1; i < exec->num_workers; i++)
+    {
+      struct i8x_worker *victim
+	= &exec->workers[(self + i) % exec->num_workers];
+      size_t start, count;
+
+      count = i8x_worker_steal_from (victim, &start);
+      if (count == 0)
+	continue;
+
+      __atomic_store_n (&worker->deque, DEQUE (start + 1, start + count),
+			__ATOMIC_RELEASE);
+
+      worker->stats.num_steals++;
+      worker->stats.num_stolen += count;
+
+      *index = start;
+
+      return true;
+    }
+
+  return false;
+}
+
+/* Make calls from the current batch until there are none left.  */
+
+static void
+i8x_worker_run (struct i8x_worker *worker)
+{
+  struct i8x_exec *exec = worker->exec;
+  uint64_t start_time = monotonic_ns ();
+  struct i8x_error_sink sink, *old_sink;
+  size_t index;
+
+  /* Worker zero is the calling thread, which may be inside a native
+     function called by another executor's worker.  */
+  old_sink = i8x_ctx_set_error_sink (&sink);
+
+  while (i8x_worker_pop (worker, &index)
+	 || i8x_worker_steal (worker, &index))
+    {
+      struct i8x_call *call = &exec->calls[index];
+
+      memset (&sink, 0, sizeof (sink));
+      call->result = i8x_xctx_call (worker->xctx, call->ref, call->inf,
+				    call->args, call->rets);
+
+      if (call->result != I8X_OK && index < worker->first_error)
+	{
+	  worker->first_error = index;
+	  worker->error = sink;
+	  worker->error.code = call->result;
+	}
+
+      worker->stats.num_calls++;
+    }
+
+  i8x_ctx_set_error_sink (old_sink);
+
+  worker->stats.busy_ns = monotonic_ns () - start_time;
+}
+
+static void *
+i8x_worker_thread (void *arg)
+{
+  struct i8x_worker *worker = arg;
+  struct i8x_exec *exec = worker->exec;
+  unsigned long generation = 0;
+
+  pthread_mutex_lock (&exec->lock);
+
+  while (true)
+    {
+      while (!exec->shutdown && exec->generation == generation)
+	pthread_cond_wait (&exec->batch_ready, &exec->lock);
+
+      if (exec->shutdown)
+	break;
+
+      generation = exec->generation;
+
+      pthread_mutex_unlock (&exec->lock);
+      i8x_worker_run (worker);
+      pthread_mutex_lock (&exec->lock);
+
+      if (--exec->num_running == 0)
+	pthread_cond_signal (&exec->batch_done);
+    }
+
+  pthread_mutex_unlock (&exec->lock);
+
+  return NULL;
+}
+
+static void
+i8x_exec_unlink (struct i8x_object *ob)
+{
+  struct i8x_exec *exec = (struct i8x_exec *) ob;
+  unsigned int i;
+
+  if (exec->workers == NULL)
+    return;
+
+  pthread_mutex_lock (&exec->lock);
+  exec->shutdown = true;
+  pthread_cond_broadcast (&exec->batch_ready);
+  pthread_mutex_unlock (&exec->lock);
+
+  for (i = 0; i < exec->num_workers; i++)
+    {
+      struct i8x_worker *worker = &exec->workers[i];
+
+      if (worker->thread_started)
+	{
+	  pthread_join (worker->thread, NULL);
+	  worker->thread_started = false;
+	}
+
+      worker->xctx = i8x_xctx_unref (worker->xctx);
+    }
+}
+
+static void
+i8x_exec_free (struct i8x_object *ob)
+{
+  struct i8x_exec *exec = (struct i8x_exec *) ob;
+
+  if (exec->workers != NULL)
+    free (exec->workers);
+
+  pthread_cond_destroy (&exec->batch_done);
+  pthread_cond_destroy (&exec->batch_ready);
+  pthread_mutex_destroy (&exec->lock);
+}
+
+const struct i8x_object_ops i8x_exec_ops =
+  {
+    "exec",			/* Object name.  */
+    sizeof (struct i8x_exec),	/* Object size.  */
+    i8x_exec_unlink,		/* Unlink function.  */
+    i8x_exec_free,		/* Free function.  */
+  };
+
+static i8x_err_e
+i8x_exec_init (struct i8x_exec *exec, unsigned int num_workers,
+	       size_t stack_slots)
+{
+  struct i8x_ctx *ctx = i8x_exec_get_ctx (exec);
+  unsigned int i;
+  void *workers;
+  i8x_err_e err;
+
+  if (num_workers == 0)
+    {
+      long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+      num_workers = ncpus > 0 ? ncpus : 1;
+    }
+
+  if (posix_memalign (&workers, CACHELINE_SIZE,
+		      num_workers * sizeof (struct i8x_worker)) != 0)
+    return i8x_out_of_memory (ctx);
+
+  memset (workers, 0, num_workers * sizeof (struct i8x_worker));
+  exec->workers = workers;
+
+  for (i = 0; i < num_workers; i++)
+    {
+      struct i8x_worker *worker = &exec->workers[i];
+
+      worker->exec = exec;
+
+      err = i8x_xctx_new (ctx, stack_slots, &worker->xctx);
+      if (err != I8X_OK)
+	return err;
+
+      exec->num_workers++;
+    }
+
+  /* Worker zero is the calling thread.  If we can't start the other
+     threads then we simply have fewer workers.  */
+  for (i = 1; i < exec->num_workers; i++)
+    {
+      struct i8x_worker *worker = &exec->workers[i];
+
+      if (pthread_create (&worker->thread, NULL,
+			  i8x_worker_thread, worker) != 0)
+	break;
+
+      worker->thread_started = true;
+    }
+
+  for (; i < exec->num_workers; i++)
+    exec->workers[i].xctx = i8x_xctx_unref (exec->workers[i].xctx);
+
+  while (exec->num_workers > 1
+	 && !exec->workers[exec->num_workers - 1].thread_started)
+    exec->num_workers--;
+
+  return I8X_OK;
+}
+
+/**
+ * i8x_exec_new:
+ * @ctx: i8x library context
+ * @num_workers: number of workers, or 0 to use one per online
+ *               processor
+ * @stack_slots: size of each worker's stack, as for i8x_xctx_new
+ * @exec: location to store the new executor
+ *
+ * Create an executor, which makes batches of calls in parallel
+ * with i8x_exec_run.  One of the workers is the thread that calls
+ * i8x_exec_run, and each of the others runs on its own thread for
+ * the lifetime of the executor.  Each worker has its own execution
+ * context.  Fewer workers are used if threads cannot be started.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_exec_new (struct i8x_ctx *ctx, unsigned int num_workers,
+	      size_t stack_slots, struct i8x_exec **exec)
+{
+  struct i8x_exec *e;
+  i8x_err_e err;
+
+  /* Start logging now, so the workers don't race to do it.  */
+  i8x_ctx_start_logging (ctx);
+
+  err = i8x_ob_new (ctx, &i8x_exec_ops, &e);
+  if (err != I8X_OK)
+    return err;
+
+  pthread_mutex_init (&e->lock, NULL);
+  pthread_cond_init (&e->batch_ready, NULL);
+  pthread_cond_init (&e->batch_done, NULL);
+
+  err = i8x_exec_init (e, num_workers, stack_slots);
+  if (err != I8X_OK)
+    {
+      e = i8x_exec_unref (e);
+
+      return err;
+    }
+
+  dbg (ctx, "num_workers=%u\n", e->num_workers);
+
+  *exec = e;
+
+  return I8X_OK;
+}
+
+/**
+ * i8x_exec_get_num_workers:
+ * @exec: the executor
+ *
+ * Returns: the number of workers in @exec, including the calling
+ * thread.
+ **/
+I8X_EXPORT unsigned int
+i8x_exec_get_num_workers (struct i8x_exec *exec)
+{
+  return exec->num_workers;
+}
+
+/**
+ * i8x_exec_run:
+ * @exec: the executor
+ * @calls: array of calls to make
+ * @num_calls: number of calls in the array
+ *
+ * Make every call in @calls, in parallel, and wait for them all to
+ * finish.  Each call is made as if by i8x_xctx_call, with its return
+ * values stored in its rets and its result in its result field, so
+ * results are in the same order as @calls whichever worker made
+ * them.  Calls are made in no particular order, and native functions
+ * may be called on any of the executor's threads concurrently.  The
+ * context's log function may also be called from any of them.
+ *
+ * Returns: I8X_OK if every call succeeded, or the result of the
+ * first call in @calls that failed.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_exec_run (struct i8x_exec *exec, struct i8x_call *calls,
+	      size_t num_calls)
+{
+  struct i8x_ctx *ctx = i8x_exec_get_ctx (exec);
+  struct i8x_worker *failed = NULL;
+  unsigned int i;
+
+  if (num_calls > MAX_CALLS || (calls == NULL && num_calls != 0))
+    return i8x_invalid_argument (ctx);
+
+  exec->calls = calls;
+  exec->num_calls = num_calls;
+
+  for (i = 0; i < exec->num_workers; i++)
+    {
+      struct i8x_worker *worker = &exec->workers[i];
+      size_t head = num_calls * i / exec->num_workers;
+      size_t tail = num_calls * (i + 1) / exec->num_workers;
+
+      memset (&worker->stats, 0, sizeof (worker->stats));
+      worker->first_error = num_calls;
+      worker->deque = DEQUE (head, tail);
+    }
+
+  /* Starting the batch under the lock publishes the above.  */
+  pthread_mutex_lock (&exec->lock);
+  exec->generation++;
+  exec->num_running = exec->num_workers - 1;
+  pthread_cond_broadcast (&exec->batch_ready);
+  pthread_mutex_unlock (&exec->lock);
+
+  i8x_worker_run (&exec->workers[0]);
+
+  pthread_mutex_lock (&exec->lock);
+  while (exec->num_running > 0)
+    pthread_cond_wait (&exec->batch_done, &exec->lock);
+  pthread_mutex_unlock (&exec->lock);
+
+  exec->calls = NULL;
+  exec->num_calls = 0;
+
+  for (i = 0; i < exec->num_workers; i++)
+    {
+      struct i8x_worker *worker = &exec->workers[i];
+
+      if (worker->first_error < num_calls
+	  && (failed == NULL || worker->first_error < failed->first_error))
+	failed = worker;
+    }
+
+  if (failed == NULL)
+    return I8X_OK;
+
+  return i8x_ctx_set_error (ctx, failed->error.code,
+			    failed->error.note, failed->error.ptr);
+}
+
+/**
+ * i8x_exec_get_worker_stats:
+ * @exec: the executor
+ * @worker: the index of the worker, where 0 is the calling thread
+ * @stats: location to store the statistics
+ *
+ * Get statistics for one of @exec's workers for the most recent
+ * call to i8x_exec_run.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_exec_get_worker_stats (struct i8x_exec *exec, unsigned int worker,
+			   struct i8x_worker_stats *stats)
+{
+  if (worker >= exec->num_workers)
+    return i8x_invalid_argument (i8x_exec_get_ctx (exec));
+
+  *stats = exec->workers[worker].stats;
+
+  return I8X_OK;
+}
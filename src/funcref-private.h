@@ -35,6 +35,14 @@ struct i8x_funcref
   int regcount;		/* Number of functions registered in this
 			   context with this signature.  */
 
+  /* Functions registered in this context with this signature,
+     and registered functions with this reference in their
+     externals tables.  Neither list holds references: functions
+     remove themselves when they are unregistered.  Both lists are
+     created when first needed.  */
+  struct i8x_list *registered;
+  struct i8x_list *dependents;
+
   /* Pointer to the exactly one function registered in the
      context with this signature, or NULL if there is not
      exactly one function registered with this signature.  */
@@ -48,11 +56,25 @@ struct i8x_funcref
      must also be resolved.  */
   struct i8x_func *resolved;
 
-  /* Interpreted and native implementations of the function
-     this reference resolves to, or NULL if this reference
-     is not resolved.  */
-  struct i8x_code *interp_impl;
-  i8x_nat_fn_t *native_impl;
+  /* The function calls through this reference should use.  This
+     is resolved as of the end of the last update to the context.
+     Calls may read it on any thread, so it is only ever replaced
+     atomically, and the function it pointed to is retired with
+     i8x_ctx_retire_func rather than released.  The reference holds
+     a reference to this function.  */
+  struct i8x_func *published;
+
+  /* Results of recent calls through this reference to a pure
+     function, or NULL if they are not remembered.  */
+  struct i8x_memo *memo;
+
+  /* Intrusive lists used by i8x_funcref_update_resolution.  */
+  struct i8x_funcref *next_changed;
+  struct i8x_funcref *next_affected;
+  struct i8x_funcref *next_queued;
+  bool is_changed;
+  bool is_affected;
+  bool is_queued;
 };
 
 #endif /* _FUNCREF_PRIVATE_H_ */
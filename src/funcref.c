@@ -43,6 +43,8 @@ i8x_funcref_unlink (struct i8x_object *ob)
   struct i8x_funcref *ref = (struct i8x_funcref *) ob;
 
   ref->type = i8x_type_unref (ref->type);
+  ref->registered = i8x_list_unref (ref->registered);
+  ref->dependents = i8x_list_unref (ref->dependents);
 
   i8x_ctx_forget_funcref (ref);
 }
@@ -54,6 +56,9 @@ i8x_funcref_free (struct i8x_object *ob)
 
   if (ref->fullname != NULL)
     free (ref->fullname);
+
+  if (ref->memo != NULL)
+    i8x_memo_free (ref->memo);
 }
 
 const struct i8x_object_ops i8x_funcref_ops =
@@ -108,65 +113,347 @@ i8x_funcref_is_private (struct i8x_funcref *ref)
   return ref->is_private;
 }
 
-void
+/**
+ * i8x_funcref_set_memo_size:
+ * @ref: the function reference
+ * @num_entries: number of results to remember, or 0
+ *
+ * Remember the results of up to @num_entries recent calls through
+ * @ref, so that calls with the same arguments can return them
+ * without executing the function.  Only the results of functions
+ * that i8x_func_is_pure says are pure are remembered.  Everything
+ * is forgotten when the context is updated.  Passing 0 stops
+ * results being remembered.  This function must not be called
+ * while calls through @ref are in progress.  If this fails, any
+ * results already remembered are kept.
+ *
+ * Returns: I8X_OK on success, I8X_EINVAL if @num_entries is too
+ * large, or another error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_funcref_set_memo_size (struct i8x_funcref *ref, size_t num_entries)
+{
+  struct i8x_memo *memo = NULL;
+
+  if (num_entries != 0)
+    {
+      i8x_err_e err;
+
+      err = i8x_memo_new (i8x_funcref_get_ctx (ref), num_entries,
+			  i8x_list_size (i8x_type_get_ptypes (ref->type)),
+			  i8x_list_size (i8x_type_get_rtypes (ref->type)),
+			  &memo);
+      if (err != I8X_OK)
+	return err;
+    }
+
+  if (ref->memo != NULL)
+    i8x_memo_free (ref->memo);
+
+  ref->memo = memo;
+
+  return I8X_OK;
+}
+
+/* Append FUNC to *LISTP, creating the list if necessary.  */
+
+static i8x_err_e
+i8x_funcref_list_append (struct i8x_funcref *ref,
+			 struct i8x_list **listp,
+			 struct i8x_func *func)
+{
+  if (*listp == NULL)
+    {
+      i8x_err_e err;
+
+      err = i8x_list_new (i8x_funcref_get_ctx (ref), false, listp);
+      if (err != I8X_OK)
+	return err;
+    }
+
+  return i8x_list_append_func (*listp, func);
+}
+
+i8x_err_e
 i8x_funcref_register_func (struct i8x_funcref *ref,
 			   struct i8x_func *func)
 {
+  i8x_err_e err;
+
+  err = i8x_funcref_list_append (ref, &ref->registered, func);
+  if (err != I8X_OK)
+    return err;
+
   ref->regcount++;
 
   if (ref->regcount != 1)
     func = NULL;
 
   ref->unique = func;
+
+  return I8X_OK;
 }
 
 void
 i8x_funcref_unregister_func (struct i8x_funcref *ref,
 			     struct i8x_func *func)
 {
+  i8x_list_remove_func (ref->registered, func);
   ref->regcount--;
 
+  /* Don't leave this reference pointing at a function that may be
+     released before the reference is next resolved.  */
+  if (ref->resolved == func)
+    i8x_funcref_mark_unresolved (ref);
+
   if (ref->regcount == 1)
-    i8x_not_implemented ();
+    func = i8x_listitem_get_func (i8x_list_get_first (ref->registered));
   else
     func = NULL;
 
   ref->unique = func;
 }
 
+/* Record that FUNC, which is being registered, has REF in its
+   externals table.  */
+
+i8x_err_e
+i8x_funcref_add_dependent (struct i8x_funcref *ref,
+			   struct i8x_func *func)
+{
+  return i8x_funcref_list_append (ref, &ref->dependents, func);
+}
+
+/* Undo i8x_funcref_add_dependent.  */
+
+void
+i8x_funcref_remove_dependent (struct i8x_funcref *ref,
+			      struct i8x_func *func)
+{
+  i8x_list_remove_func (ref->dependents, func);
+}
+
 void
 i8x_funcref_reset_is_resolved (struct i8x_funcref *ref)
 {
   struct i8x_func *resolved = ref->unique;
-  struct i8x_code *interp_impl = NULL;
-  i8x_nat_fn_t *native_impl = NULL;
 
   if (resolved != NULL)
-    {
-      interp_impl = i8x_func_get_interp_impl (resolved);
-      native_impl = i8x_func_get_native_impl (resolved);
-
-      i8x_assert ((interp_impl != NULL) ^ (native_impl != NULL));
-    }
+    i8x_assert ((i8x_func_get_interp_impl (resolved) != NULL)
+		^ i8x_func_is_native (resolved));
 
   ref->resolved = resolved;
-  ref->interp_impl = interp_impl;
-  ref->native_impl = native_impl;
-
 }
 
 void
 i8x_funcref_mark_unresolved (struct i8x_funcref *ref)
 {
   ref->resolved = NULL;
-  ref->interp_impl = NULL;
-  ref->native_impl = NULL;
 }
 
+/* Make REF's resolved function the one calls through REF use.  */
+
+static void
+i8x_funcref_publish (struct i8x_funcref *ref)
+{
+  struct i8x_func *old;
+
+  if (ref->published == ref->resolved)
+    return;
+
+  old = __atomic_exchange_n (&ref->published,
+			     i8x_func_ref (ref->resolved),
+			     __ATOMIC_SEQ_CST);
+  if (old != NULL)
+    i8x_ctx_retire_func (i8x_funcref_get_ctx (ref), old);
+}
+
+/* Stop calls through REF using any function.  */
+
+void
+i8x_funcref_retire_published (struct i8x_funcref *ref)
+{
+  struct i8x_func *old;
+
+  old = __atomic_exchange_n (&ref->published, NULL, __ATOMIC_SEQ_CST);
+  if (old != NULL)
+    i8x_ctx_retire_func (i8x_funcref_get_ctx (ref), old);
+}
+
+/**
+ * i8x_funcref_is_resolved:
+ * @ref: the function reference
+ *
+ * This function may be called from any thread, concurrently with
+ * updates to the context.
+ *
+ * Returns: true if calls through @ref would use a function as of
+ * the end of the last update to the context.
+ **/
 I8X_EXPORT bool
 i8x_funcref_is_resolved (struct i8x_funcref *ref)
 {
-  return ref->resolved != NULL;
+  return __atomic_load_n (&ref->published, __ATOMIC_ACQUIRE) != NULL;
+}
+
+struct i8x_func *
+i8x_funcref_get_resolved (struct i8x_funcref *ref)
+{
+  return ref->resolved;
+}
+
+static void
+i8x_funcref_mark_affected (struct i8x_funcref *ref,
+			   struct i8x_funcref **affected,
+			   struct i8x_funcref **queue)
+{
+  if (ref->is_affected)
+    return;
+
+  ref->is_affected = true;
+  ref->next_affected = *affected;
+  *affected = ref;
+
+  ref->is_queued = true;
+  ref->next_queued = *queue;
+  *queue = ref;
+}
+
+static struct i8x_funcref *
+i8x_funcref_pop_queued (struct i8x_funcref **queue)
+{
+  struct i8x_funcref *ref = *queue;
+
+  if (ref != NULL)
+    {
+      *queue = ref->next_queued;
+      ref->is_queued = false;
+    }
+
+  return ref;
+}
+
+/* Add REF, whose registered functions have changed, to the list
+   of changed references at *CHANGED.  The list holds a reference to
+   each of its elements until it is passed to either
+   i8x_funcref_update_resolution or i8x_funcref_discard_changed.  */
+
+void
+i8x_funcref_mark_changed (struct i8x_funcref *ref,
+			  struct i8x_funcref **changed)
+{
+  if (ref->is_changed)
+    return;
+
+  ref->is_changed = true;
+  ref->next_changed = *changed;
+  *changed = i8x_funcref_ref (ref);
+}
+
+/* Release a list of changed references without resolving them.  */
+
+void
+i8x_funcref_discard_changed (struct i8x_funcref *changed)
+{
+  while (changed != NULL)
+    {
+      struct i8x_funcref *ref = changed;
+
+      changed = ref->next_changed;
+      ref->next_changed = NULL;
+      ref->is_changed = false;
+
+      i8x_funcref_unref (ref);
+    }
+}
+
+/* Update the resolved state of every reference in the list of
+   changed references CHANGED, and of every reference whose
+   resolution depends on them, then release the list.  Only
+   references reachable from CHANGED through their dependents lists
+   are visited, so the cost is proportional to the part of the graph
+   that could have changed.  Every registered function whose
+   availability may have changed is added to the list of pending
+   functions at *PENDING, for the caller to notify the user with
+   i8x_func_fire_pending once every resolution has been published
+   for calls to use.  */
+
+void
+i8x_funcref_update_resolution (struct i8x_funcref *changed,
+			       struct i8x_func **pending)
+{
+  struct i8x_funcref *affected = NULL;
+  struct i8x_funcref *queue = NULL;
+  struct i8x_listitem *li;
+  struct i8x_funcref *r;
+
+  /* Collect the changed references and everything that
+     transitively depends on them.  */
+  for (r = changed; r != NULL; r = r->next_changed)
+    i8x_funcref_mark_affected (r, &affected, &queue);
+
+  while ((r = i8x_funcref_pop_queued (&queue)) != NULL)
+    {
+      i8x_list_foreach (r->dependents, li)
+	i8x_funcref_mark_affected (
+	  i8x_func_get_funcref (i8x_listitem_get_func (li)),
+	  &affected, &queue);
+    }
+
+  /* Mark the affected references as resolved or not based on
+     whether they resolve to a unique registered function, then
+     mark references unresolved if any of their dependencies are
+     unresolved until nothing changes.  References that were not
+     affected keep their existing state, which cannot depend on
+     anything that was.  */
+  for (r = affected; r != NULL; r = r->next_affected)
+    {
+      i8x_funcref_reset_is_resolved (r);
+
+      r->is_queued = true;
+      r->next_queued = queue;
+      queue = r;
+    }
+
+  while ((r = i8x_funcref_pop_queued (&queue)) != NULL)
+    {
+      if (r->resolved == NULL || i8x_func_all_deps_resolved (r->resolved))
+	continue;
+
+      i8x_funcref_mark_unresolved (r);
+
+      i8x_list_foreach (r->dependents, li)
+	{
+	  struct i8x_funcref *d
+	    = i8x_func_get_funcref (i8x_listitem_get_func (li));
+
+	  if (d->is_affected && d->resolved != NULL && !d->is_queued)
+	    {
+	      d->is_queued = true;
+	      d->next_queued = queue;
+	      queue = d;
+	    }
+	}
+    }
+
+  /* Publish the new resolutions, so calls see every change this
+     update made before any observer is called.  */
+  for (r = affected; r != NULL; r = r->next_affected)
+    i8x_funcref_publish (r);
+
+  /* Collect the functions whose availability may have changed.
+     Their observers are called by the caller once this update is
+     finished, as observers may register and unregister functions,
+     which would change the lists being iterated here.  */
+  for (r = affected; r != NULL; r = r->next_affected)
+    {
+      r->is_affected = false;
+
+      i8x_list_foreach (r->registered, li)
+	i8x_func_mark_pending (i8x_listitem_get_func (li), pending);
+    }
+
+  i8x_funcref_discard_changed (changed);
 }
 
 struct i8x_type *
@@ -25,13 +25,38 @@ struct i8x_func
 
   struct i8x_funcref *ref;	/* The function's signature.  */
 
-  i8x_nat_fn_t *native_impl;	/* Implementation, or NULL if bytecode.  */
+  /* Native implementation, or NULL if bytecode.  Native functions
+     registered with fixed arities have typed_impl instead.  */
+  i8x_nat_fn_t *native_impl;
+  union i8x_nat_typed_fn typed_impl;
+  int typed_arity;
 
   struct i8x_note *note;	/* The note, or NULL if native.  */
   struct i8x_list *externals;	/* List of external references.  */
   struct i8x_code *code;	/* Compiled bytecode.  */
 
+  const void *origin;		/* Where the function came from.  */
+
+  /* List of functions registered with the context that have the
+     same origin as this one.  The first function on each list has
+     no previous function, and is the one the context's table of
+     origins holds.  */
+  struct i8x_func *prev_registered;
+  struct i8x_func *next_registered;
+  bool is_registered;
+
   bool observed_available;	/* The last observer we called.  */
+
+  /* List of functions waiting to be released by i8x_func_reclaim,
+     and the epoch they were last retired in.  */
+  struct i8x_func *next_retired;
+  uint64_t retired_epoch;
+  bool is_retired;
+
+  /* List of functions whose availability may have changed and
+     whose observers have not yet been checked.  */
+  struct i8x_func *next_pending;
+  bool is_pending;
 };
 
 I8X_EXPORT bool
@@ -40,6 +65,22 @@ i8x_func_is_native (struct i8x_func *func)
   return func->note == NULL;
 }
 
+/**
+ * i8x_func_is_pure:
+ * @func: the function
+ *
+ * Check whether @func's results depend only on its arguments.
+ * Native functions are never considered pure, and neither are
+ * bytecode functions that have not yet been compiled.
+ *
+ * Returns: true if @func is pure.
+ **/
+I8X_EXPORT bool
+i8x_func_is_pure (struct i8x_func *func)
+{
+  return func->code != NULL && i8x_code_is_pure (func->code);
+}
+
 struct i8x_code *
 i8x_func_get_interp_impl (struct i8x_func *func)
 {
@@ -51,11 +92,49 @@ i8x_nat_fn_t *i8x_func_get_native_impl (struct i8x_func *func)
   return func->native_impl;
 }
 
+union i8x_nat_typed_fn
+i8x_func_get_typed_impl (struct i8x_func *func)
+{
+  return func->typed_impl;
+}
+
+/* Call FUNC's fixed-arity native implementation with arguments and
+   returns in arrays, as i8x_nat_fn_t functions are called.  */
+
+i8x_err_e
+i8x_func_call_typed_impl (struct i8x_func *func, struct i8x_xctx *xctx,
+			  struct i8x_inferior *inf, union i8x_value *args,
+			  union i8x_value *rets)
+{
+  union i8x_nat_typed_fn impl = func->typed_impl;
+
+  switch (func->typed_arity)
+    {
+    case 0:
+      return impl.fn0 (xctx, inf, rets);
+
+    case 1:
+      return impl.fn1 (xctx, inf, args[0], rets);
+
+    case 2:
+      return impl.fn2 (xctx, inf, args[0], args[1], rets);
+
+    case 3:
+      return impl.fn3 (xctx, inf, args[0], args[1], args[2], rets);
+
+    default:
+      /* i8x_func_new_typed_native only accepts arities we handle.  */
+      i8x_internal_error (__FILE__, __LINE__, __FUNCTION__,
+			  _("Bad native function arity %d."),
+			  func->typed_arity);
+    }
+}
+
 static i8x_err_e
 i8x_bcf_unpack_signature (struct i8x_func *func)
 {
   struct i8x_note *note = func->note;
-  struct i8x_readbuf *rb;
+  struct i8x_rbcursor cur;
   struct i8x_chunk *chunk;
   i8x_err_e err;
 
@@ -67,14 +146,9 @@ i8x_bcf_unpack_signature (struct i8x_func *func)
   if (i8x_chunk_get_version (chunk) != 2)
     return i8x_chunk_version_error (chunk);
 
-  err = i8x_rb_new_from_chunk (chunk, &rb);
-  if (err != I8X_OK)
-    return err;
-
-  err = i8x_rb_read_funcref (rb, &func->ref);
-
-  rb = i8x_rb_unref (rb);
+  i8x_rbc_init_from_chunk (&cur, chunk);
 
+  err = i8x_rbc_read_funcref (&cur, &func->ref);
   if (err == I8X_OK)
     dbg (i8x_func_get_ctx (func),
 	 "func %p is %s\n", func,
@@ -87,30 +161,30 @@ i8x_bcf_unpack_signature (struct i8x_func *func)
 #define I8_EXT_SYMBOL 's'
 
 static i8x_err_e
-i8x_bcf_unpack_one_external (struct i8x_readbuf *rb,
+i8x_bcf_unpack_one_external (struct i8x_rbcursor *cur,
 			     struct i8x_object **ext)
 {
-  struct i8x_note *note = i8x_rb_get_note (rb);
+  struct i8x_note *note = i8x_rbc_get_note (cur);
   struct i8x_object *e;
   const char *error_ptr;
   uint8_t type_id;
   const char *name;
   i8x_err_e err;
 
-  error_ptr = i8x_rb_get_ptr (rb);
+  error_ptr = i8x_rbc_get_ptr (cur);
 
-  err = i8x_rb_read_uint8_t (rb, &type_id);
+  err = i8x_rbc_read_uint8_t (cur, &type_id);
   if (err != I8X_OK)
     return err;
 
   switch (type_id)
     {
     case I8_EXT_FUNCTION:
-      err = i8x_rb_read_funcref (rb, (struct i8x_funcref **) &e);
+      err = i8x_rbc_read_funcref (cur, (struct i8x_funcref **) &e);
       break;
 
     case I8_EXT_SYMBOL:
-      err = i8x_rb_read_offset_string (rb, &name);
+      err = i8x_rbc_read_offset_string (cur, &name);
       if (err != I8X_OK)
 	break;
 
@@ -132,7 +206,7 @@ static i8x_err_e
 i8x_bcf_unpack_externals (struct i8x_func *func)
 {
   struct i8x_chunk *chunk;
-  struct i8x_readbuf *rb;
+  struct i8x_rbcursor cur;
   i8x_err_e err;
 
   err = i8x_note_get_unique_chunk (i8x_func_get_note (func),
@@ -148,15 +222,13 @@ i8x_bcf_unpack_externals (struct i8x_func *func)
   if (err != I8X_OK)
     return err;
 
-  err = i8x_rb_new_from_chunk (chunk, &rb);
-  if (err != I8X_OK)
-    return err;
+  i8x_rbc_init_from_chunk (&cur, chunk);
 
-  while (i8x_rb_bytes_left (rb) > 0)
+  while (i8x_rbc_bytes_left (&cur) > 0)
     {
       struct i8x_object *ref;
 
-      err = i8x_bcf_unpack_one_external (rb, &ref);
+      err = i8x_bcf_unpack_one_external (&cur, &ref);
       if (err != I8X_OK)
 	break;
 
@@ -166,8 +238,6 @@ i8x_bcf_unpack_externals (struct i8x_func *func)
 	break;
     }
 
-  rb = i8x_rb_unref (rb);
-
   return err;
 }
 
@@ -213,8 +283,12 @@ const struct i8x_object_ops i8x_func_ops =
     NULL,			/* Free function.  */
   };
 
-I8X_EXPORT i8x_err_e
-i8x_func_new_from_note (struct i8x_note *note, struct i8x_func **func)
+/* Create a function from NOTE, but do not compile its bytecode.
+   The resulting function must be compiled with i8x_func_compile
+   before it is registered.  */
+
+i8x_err_e
+i8x_func_new_uncompiled (struct i8x_note *note, struct i8x_func **func)
 {
   struct i8x_ctx *ctx = i8x_note_get_ctx (note);
   struct i8x_func *f;
@@ -225,6 +299,7 @@ i8x_func_new_from_note (struct i8x_note *note, struct i8x_func **func)
     return err;
 
   f->note = i8x_note_ref (note);
+  f->origin = i8x_note_get_origin (note);
 
   err = i8x_bcf_init (f);
   if (err != I8X_OK)
@@ -239,6 +314,35 @@ i8x_func_new_from_note (struct i8x_note *note, struct i8x_func **func)
   return I8X_OK;
 }
 
+i8x_err_e
+i8x_func_compile (struct i8x_func *func)
+{
+  return i8x_code_compile (func->code);
+}
+
+I8X_EXPORT i8x_err_e
+i8x_func_new_from_note (struct i8x_note *note, struct i8x_func **func)
+{
+  struct i8x_func *f;
+  i8x_err_e err;
+
+  err = i8x_func_new_uncompiled (note, &f);
+  if (err != I8X_OK)
+    return err;
+
+  err = i8x_func_compile (f);
+  if (err != I8X_OK)
+    {
+      f = i8x_func_unref (f);
+
+      return err;
+    }
+
+  *func = f;
+
+  return I8X_OK;
+}
+
 I8X_EXPORT i8x_err_e
 i8x_func_new_native (struct i8x_ctx *ctx, struct i8x_funcref *sig,
 		     i8x_nat_fn_t *impl_fn, struct i8x_func **func)
@@ -263,6 +367,40 @@ i8x_func_new_native (struct i8x_ctx *ctx, struct i8x_funcref *sig,
   return I8X_OK;
 }
 
+/* Create a native function with a fixed-arity implementation.  SIG
+   must have ARITY parameters and return at most one value.  */
+
+i8x_err_e
+i8x_func_new_typed_native (struct i8x_ctx *ctx, struct i8x_funcref *sig,
+			   int arity, union i8x_nat_typed_fn impl_fn,
+			   struct i8x_func **func)
+{
+  struct i8x_type *type = i8x_funcref_get_type (sig);
+  struct i8x_func *f;
+  i8x_err_e err;
+
+  i8x_assert (arity >= 0 && arity <= 3);
+
+  if (impl_fn.fn0 == NULL
+      || i8x_list_size (i8x_type_get_ptypes (type)) != arity
+      || i8x_list_size (i8x_type_get_rtypes (type)) > 1)
+    return i8x_invalid_argument (ctx);
+
+  err = i8x_ob_new (ctx, &i8x_func_ops, &f);
+  if (err != I8X_OK)
+    return err;
+
+  dbg (ctx, "func %p is %s\n", f, i8x_funcref_get_fullname (sig));
+
+  f->ref = i8x_funcref_ref (sig);
+  f->typed_impl = impl_fn;
+  f->typed_arity = arity;
+
+  *func = f;
+
+  return I8X_OK;
+}
+
 I8X_EXPORT struct i8x_funcref *
 i8x_func_get_funcref (struct i8x_func *func)
 {
@@ -275,6 +413,151 @@ i8x_func_get_note (struct i8x_func *func)
   return func->note;
 }
 
+/**
+ * i8x_func_get_origin:
+ * @func: the function
+ *
+ * Returns: the origin handle of @func.  Functions loaded by
+ * i8x_ctx_load_elf have the origin returned in its statistics.
+ * Other functions have no origin unless one is set with
+ * i8x_func_set_origin.
+ **/
+I8X_EXPORT const void *
+i8x_func_get_origin (struct i8x_func *func)
+{
+  return func->origin;
+}
+
+/**
+ * i8x_func_set_origin:
+ * @func: the function
+ * @origin: an opaque handle identifying where @func came from
+ *
+ * Tag @func with an origin handle, so that it can be unregistered
+ * with every other function from the same origin by a single call
+ * to i8x_ctx_unregister_origin.  Any pointer to an object aligned
+ * to two or more bytes, such as a handle returned by dlopen, may be
+ * used as an origin: such pointers never equal the handles the
+ * library creates.  This function must not be called while @func
+ * is registered.
+ **/
+I8X_EXPORT void
+i8x_func_set_origin (struct i8x_func *func, const void *origin)
+{
+  i8x_assert (!func->is_registered);
+
+  func->origin = origin;
+}
+
+/* Add FUNC, which is being registered, to the list of registered
+   functions whose first function is FIRST.  If FIRST is NULL then
+   FUNC starts a new list.  */
+
+void
+i8x_func_link_registered (struct i8x_func *func, struct i8x_func *first)
+{
+  i8x_assert (!func->is_registered);
+
+  func->is_registered = true;
+
+  if (first == NULL)
+    return;
+
+  func->prev_registered = first;
+  func->next_registered = first->next_registered;
+  if (func->next_registered != NULL)
+    func->next_registered->prev_registered = func;
+  first->next_registered = func;
+}
+
+/* Remove FUNC, which is being unregistered, from its list of
+   registered functions.  If FUNC was the first function on its
+   list then return the function that is now first, which may be
+   NULL.  Otherwise return FUNC.  */
+
+struct i8x_func *
+i8x_func_unlink_registered (struct i8x_func *func)
+{
+  struct i8x_func *prev = func->prev_registered;
+  struct i8x_func *next = func->next_registered;
+
+  i8x_assert (func->is_registered);
+
+  if (next != NULL)
+    next->prev_registered = prev;
+  if (prev != NULL)
+    prev->next_registered = next;
+
+  func->prev_registered = NULL;
+  func->next_registered = NULL;
+  func->is_registered = false;
+
+  return prev == NULL ? next : func;
+}
+
+bool
+i8x_func_is_registered (struct i8x_func *func)
+{
+  return func->is_registered;
+}
+
+/* Add FUNC, which is being registered, to the dependents lists of
+   the functions it references.  */
+
+i8x_err_e
+i8x_func_add_dependencies (struct i8x_func *func)
+{
+  struct i8x_listitem *li;
+
+  i8x_list_foreach (func->externals, li)
+    {
+      struct i8x_funcref *ref
+	= i8x_object_as_funcref (i8x_listitem_get_object (li));
+      i8x_err_e err;
+
+      if (ref == NULL)
+	continue;
+
+      err = i8x_funcref_add_dependent (ref, func);
+      if (err != I8X_OK)
+	{
+	  struct i8x_listitem *lj;
+
+	  /* Undo the ones we already added.  */
+	  i8x_list_foreach (func->externals, lj)
+	    {
+	      if (lj == li)
+		break;
+
+	      ref = i8x_object_as_funcref (i8x_listitem_get_object (lj));
+	      if (ref != NULL)
+		i8x_funcref_remove_dependent (ref, func);
+	    }
+
+	  return err;
+	}
+    }
+
+  return I8X_OK;
+}
+
+/* Undo i8x_func_add_dependencies.  */
+
+void
+i8x_func_remove_dependencies (struct i8x_func *func)
+{
+  struct i8x_listitem *li;
+
+  i8x_list_foreach (func->externals, li)
+    {
+      struct i8x_funcref *ref
+	= i8x_object_as_funcref (i8x_listitem_get_object (li));
+
+      if (ref != NULL)
+	i8x_funcref_remove_dependent (ref, func);
+    }
+}
+
 bool
 i8x_func_all_deps_resolved (struct i8x_func *func)
 {
@@ -285,7 +568,7 @@ i8x_func_all_deps_resolved (struct i8x_func *func)
       struct i8x_funcref *ref
 	= i8x_object_as_funcref (i8x_listitem_get_object (li));
 
-      if (ref != NULL && !i8x_funcref_is_resolved (ref))
+      if (ref != NULL && i8x_funcref_get_resolved (ref) == NULL)
 	return false;
     }
 
@@ -295,12 +578,145 @@ i8x_func_all_deps_resolved (struct i8x_func *func)
 void
 i8x_func_fire_availability_observers (struct i8x_func *func)
 {
-  bool is_available = i8x_funcref_is_resolved (func->ref);
+  bool is_available = i8x_funcref_get_resolved (func->ref) == func;
 
   if (is_available == func->observed_available)
     return;
 
+  /* Record the change first, so that changes the observer makes
+     are compared against it.  */
+  func->observed_available = is_available;
+
   i8x_ctx_fire_availability_observer (func, is_available);
+}
 
-  func->observed_available = is_available;
+/* Add FUNC, whose availability may have changed, to the list of
+   pending functions at *PENDING.  The list holds a reference to
+   each of its elements until it is passed to either
+   i8x_func_fire_pending or i8x_func_discard_pending.  */
+
+void
+i8x_func_mark_pending (struct i8x_func *func, struct i8x_func **pending)
+{
+  if (func->is_pending)
+    return;
+
+  func->is_pending = true;
+  func->next_pending = *pending;
+  *pending = i8x_func_ref (func);
+}
+
+/* Remove the first function from the list of pending functions at
+   *PENDING, returning it and the list's reference to it, or NULL
+   if the list is empty.  */
+
+static struct i8x_func *
+i8x_func_pop_pending (struct i8x_func **pending)
+{
+  struct i8x_func *func = *pending;
+
+  if (func != NULL)
+    {
+      *pending = func->next_pending;
+      func->next_pending = NULL;
+      func->is_pending = false;
+    }
+
+  return func;
+}
+
+/* Release a list of pending functions without calling their
+   observers.  */
+
+void
+i8x_func_discard_pending (struct i8x_func *pending)
+{
+  struct i8x_func *func;
+
+  while ((func = i8x_func_pop_pending (&pending)) != NULL)
+    i8x_func_unref (func);
+}
+
+/* Call the availability observers of every function in the list
+   of pending functions PENDING whose availability has changed,
+   then release the list.  Functions that were unregistered and
+   registered again before the list was processed are only notified
+   if they did not end up available again.  Each function is removed
+   from the list before its observer is called, so observers may
+   register and unregister functions, including ones on the list;
+   any function whose availability they change is added to a new
+   list and notified by the update that makes the change.  */
+
+void
+i8x_func_fire_pending (struct i8x_func *pending)
+{
+  struct i8x_func *func;
+
+  while ((func = i8x_func_pop_pending (&pending)) != NULL)
+    {
+      i8x_func_fire_availability_observers (func);
+      i8x_func_unref (func);
+    }
+}
+
+/* Add FUNC, which calls may still be using, to the list of retired
+   functions at *RETIRED.  The caller's reference to FUNC passes to
+   the list.  FUNC will be released by i8x_func_reclaim once every
+   call that could be using it has finished, which is once every call
+   in progress started in EPOCH or later.  */
+
+void
+i8x_func_retire (struct i8x_func *func, uint64_t epoch,
+		 struct i8x_func **retired)
+{
+  func->retired_epoch = epoch;
+
+  if (func->is_retired)
+    {
+      i8x_func_unref (func);
+      return;
+    }
+
+  func->is_retired = true;
+  func->next_retired = *retired;
+  *retired = func;
+}
+
+/* Release every function in the list of retired functions at
+   *RETIRED that was retired in EPOCH or earlier.  */
+
+void
+i8x_func_reclaim (struct i8x_func **retired, uint64_t epoch)
+{
+  struct i8x_func *reclaimed = NULL;
+  struct i8x_func **funcp = retired;
+
+  while (*funcp != NULL)
+    {
+      struct i8x_func *func = *funcp;
+
+      if (func->retired_epoch > epoch)
+	{
+	  funcp = &func->next_retired;
+	  continue;
+	}
+
+      *funcp = func->next_retired;
+      func->is_retired = false;
+
+      func->next_retired = reclaimed;
+      reclaimed = func;
+    }
+
+  /* Releasing a function can release other objects, so the list is
+     finished with before anything is released.  */
+  while (reclaimed != NULL)
+    {
+      struct i8x_func *func = reclaimed;
+
+      reclaimed = func->next_retired;
+      func->next_retired = NULL;
+
+      i8x_func_unref (func);
+    }
 }
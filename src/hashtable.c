@@ -0,0 +1,296 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "libi8x-private.h"
+
+/* Open-addressing hash tables of objects, used by the context to
+   intern funcrefs, symrefs and function types.  Tables do not hold
+   references to their objects: objects remove themselves from their
+   table when they are unlinked.  Slots are probed linearly.  Removed
+   slots become tombstones, which are reclaimed when the table is
+   next resized.  */
+
+struct i8x_hash_slot
+{
+  i8x_hash_t hash;		/* The object's hash.  */
+  struct i8x_object *ob;	/* The object, NULL, or TOMBSTONE.  */
+};
+
+#define TOMBSTONE ((struct i8x_object *) &tombstone)
+static const char tombstone;
+
+#define INITIAL_SIZE 64
+
+struct i8x_hashtable
+{
+  I8X_OBJECT_FIELDS;
+
+  struct i8x_hash_slot *slots;	/* The table.  */
+  size_t size;			/* Number of slots, a power of two.  */
+  size_t num_used;		/* Slots holding objects.  */
+  size_t num_tombstones;	/* Slots holding tombstones.  */
+};
+
+static void
+i8x_hashtable_free (struct i8x_object *ob)
+{
+  struct i8x_hashtable *table = (struct i8x_hashtable *) ob;
+
+  if (table->slots != NULL)
+    free (table->slots);
+}
+
+const struct i8x_object_ops i8x_hashtable_ops =
+  {
+    "hashtable",			/* Object name.  */
+    sizeof (struct i8x_hashtable),	/* Object size.  */
+    NULL,				/* Unlink function.  */
+    i8x_hashtable_free,			/* Free function.  */
+  };
+
+static i8x_err_e
+i8x_hashtable_resize (struct i8x_hashtable *table, size_t size)
+{
+  struct i8x_hash_slot *old_slots = table->slots;
+  size_t old_size = table->size;
+  size_t i;
+
+  table->slots = calloc (size, sizeof (struct i8x_hash_slot));
+  if (table->slots == NULL)
+    {
+      table->slots = old_slots;
+
+      return i8x_out_of_memory (i8x_hashtable_get_ctx (table));
+    }
+
+  table->size = size;
+  table->num_tombstones = 0;
+
+  for (i = 0; i < old_size; i++)
+    {
+      struct i8x_hash_slot *old = &old_slots[i];
+      size_t j;
+
+      if (old->ob == NULL || old->ob == TOMBSTONE)
+	continue;
+
+      for (j = old->hash & (size - 1);
+	   table->slots[j].ob != NULL;
+	   j = (j + 1) & (size - 1))
+	;
+
+      table->slots[j] = *old;
+    }
+
+  if (old_slots != NULL)
+    free (old_slots);
+
+  return I8X_OK;
+}
+
+i8x_err_e
+i8x_hashtable_new (struct i8x_ctx *ctx, struct i8x_hashtable **table)
+{
+  struct i8x_hashtable *t;
+  i8x_err_e err;
+
+  err = i8x_ob_new (ctx, &i8x_hashtable_ops, &t);
+  if (err != I8X_OK)
+    return err;
+
+  err = i8x_hashtable_resize (t, INITIAL_SIZE);
+  if (err != I8X_OK)
+    {
+      t = i8x_hashtable_unref (t);
+
+      return err;
+    }
+
+  *table = t;
+
+  return I8X_OK;
+}
+
+/* Return the object in TABLE with hash HASH for which MATCH_FN
+   returns true when passed KEY, or NULL if there is none.  */
+
+struct i8x_object *
+i8x_hashtable_lookup (struct i8x_hashtable *table, i8x_hash_t hash,
+		      i8x_hash_match_fn_t *match_fn, const void *key)
+{
+  size_t mask = table->size - 1;
+  size_t i;
+
+  for (i = hash & mask; table->slots[i].ob != NULL; i = (i + 1) & mask)
+    {
+      struct i8x_hash_slot *slot = &table->slots[i];
+
+      if (slot->hash == hash
+	  && slot->ob != TOMBSTONE
+	  && match_fn (slot->ob, key))
+	return slot->ob;
+    }
+
+  return NULL;
+}
+
+/* Add OB to TABLE with hash HASH.  OB must not already be in the
+   table.  */
+
+i8x_err_e
+i8x_hashtable_insert (struct i8x_hashtable *table, i8x_hash_t hash,
+		      struct i8x_object *ob)
+{
+  size_t mask;
+  size_t i;
+
+  /* Keep the load factor, including tombstones, below 3/4.  If
+     most of the load is tombstones then rehashing at the current
+     size is enough to clear them.  */
+  if ((table->num_used + table->num_tombstones + 1) * 4 > table->size * 3)
+    {
+      size_t size = table->size;
+      i8x_err_e err;
+
+      if ((table->num_used + 1) * 2 > size)
+	size *= 2;
+
+      err = i8x_hashtable_resize (table, size);
+      if (err != I8X_OK)
+	return err;
+    }
+
+  mask = table->size - 1;
+  for (i = hash & mask; ; i = (i + 1) & mask)
+    {
+      struct i8x_hash_slot *slot = &table->slots[i];
+
+      if (slot->ob == TOMBSTONE)
+	table->num_tombstones--;
+      else if (slot->ob != NULL)
+	continue;
+
+      slot->hash = hash;
+      slot->ob = ob;
+      table->num_used++;
+
+      return I8X_OK;
+    }
+}
+
+/* Remove OB, which has hash HASH, from TABLE.  Does nothing if OB
+   is not in the table.  */
+
+void
+i8x_hashtable_remove (struct i8x_hashtable *table, i8x_hash_t hash,
+		      struct i8x_object *ob)
+{
+  size_t mask = table->size - 1;
+  size_t i;
+
+  for (i = hash & mask; table->slots[i].ob != NULL; i = (i + 1) & mask)
+    {
+      struct i8x_hash_slot *slot = &table->slots[i];
+
+      if (slot->ob != ob)
+	continue;
+
+      slot->ob = TOMBSTONE;
+      table->num_used--;
+      table->num_tombstones++;
+
+      return;
+    }
+}
+
+/* Replace OB, which has hash HASH, with NEW_OB, which must have the
+   same hash, in TABLE.  OB must be in the table.  This never needs
+   to allocate, so it cannot fail.  */
+
+void
+i8x_hashtable_replace (struct i8x_hashtable *table, i8x_hash_t hash,
+		       struct i8x_object *ob, struct i8x_object *new_ob)
+{
+  size_t mask = table->size - 1;
+  size_t i;
+
+  for (i = hash & mask; table->slots[i].ob != ob; i = (i + 1) & mask)
+    i8x_assert (table->slots[i].ob != NULL);
+
+  table->slots[i].ob = new_ob;
+}
+
+/* Iterate over the objects in TABLE.  *INDEX should be zero for the
+   first call.  Returns NULL when there are no more objects.  The
+   table must not be modified during iteration.  */
+
+struct i8x_object *
+i8x_hashtable_next (struct i8x_hashtable *table, size_t *index)
+{
+  while (*index < table->size)
+    {
+      struct i8x_object *ob = table->slots[(*index)++].ob;
+
+      if (ob != NULL && ob != TOMBSTONE)
+	return ob;
+    }
+
+  return NULL;
+}
+
+/* Hash functions.  These are FNV-1a, which hashes incrementally so
+   keys can be hashed piece by piece without being assembled.  */
+
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+
+i8x_hash_t
+i8x_hash_init (void)
+{
+  return FNV_OFFSET_BASIS;
+}
+
+i8x_hash_t
+i8x_hash_bytes (i8x_hash_t hash, const char *ptr, size_t size)
+{
+  const unsigned char *p = (const unsigned char *) ptr;
+  const unsigned char *limit = p + size;
+
+  while (p < limit)
+    {
+      hash ^= *(p++);
+      hash *= FNV_PRIME;
+    }
+
+  return hash;
+}
+
+i8x_hash_t
+i8x_hash_string (i8x_hash_t hash, const char *str)
+{
+  const unsigned char *p = (const unsigned char *) str;
+
+  while (*p != '\0')
+    {
+      hash ^= *(p++);
+      hash *= FNV_PRIME;
+    }
+
+  return hash;
+}
@@ -24,6 +24,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
 /* Error codes.  */
 
@@ -35,6 +36,8 @@ typedef enum
   /* Errors analogous to errno values.  */
   I8X_ENOMEM = -99,
   I8X_EINVAL,
+  I8X_EIO,
+  I8X_EAGAIN,
 
   /* Note rejection reasons.  */
   I8X_NOTE_CORRUPT = -199,
@@ -43,6 +46,9 @@ typedef enum
 
   /* Runtime errors.  */
   I8X_STACK_OVERFLOW = -299,
+  I8X_FUEL_EXHAUSTED,
+  I8X_DEADLINE_EXCEEDED,
+  I8X_CANCELLED,
 }
 i8x_err_e;
 
@@ -68,8 +74,10 @@ i8x_byte_order_e;
 
 /* Forward declarations.  */
 
+struct i8x_callable;
 struct i8x_chunk;
 struct i8x_ctx;
+struct i8x_exec;
 struct i8x_func;
 struct i8x_funcref;
 struct i8x_inferior;
@@ -97,6 +105,28 @@ typedef i8x_err_e i8x_nat_fn_t (struct i8x_xctx *xctx,
 				union i8x_value *args,
 				union i8x_value *rets);
 
+/* Native functions with fixed arities, which take their arguments
+   by value and return at most one value.  */
+
+typedef i8x_err_e i8x_nat_fn0_t (struct i8x_xctx *xctx,
+				 struct i8x_inferior *inf,
+				 union i8x_value *ret);
+typedef i8x_err_e i8x_nat_fn1_t (struct i8x_xctx *xctx,
+				 struct i8x_inferior *inf,
+				 union i8x_value arg0,
+				 union i8x_value *ret);
+typedef i8x_err_e i8x_nat_fn2_t (struct i8x_xctx *xctx,
+				 struct i8x_inferior *inf,
+				 union i8x_value arg0,
+				 union i8x_value arg1,
+				 union i8x_value *ret);
+typedef i8x_err_e i8x_nat_fn3_t (struct i8x_xctx *xctx,
+				 struct i8x_inferior *inf,
+				 union i8x_value arg0,
+				 union i8x_value arg1,
+				 union i8x_value arg2,
+				 union i8x_value *ret);
+
 /* Tables of native functions, for i8x_ctx_register_native_funcs.  */
 
 struct i8x_native_fn
@@ -111,6 +141,68 @@ struct i8x_native_fn
 
 #define I8X_END_TABLE {NULL}
 
+/* Statistics returned by i8x_ctx_load_elf.  */
+
+struct i8x_load_stats
+{
+  size_t num_notes;		/* Infinity notes found in the file.  */
+  size_t num_funcs;		/* Functions registered from the file.  */
+  bool was_loaded;		/* True if the file was already loaded.  */
+  uint64_t elapsed_ns;		/* Wall-clock time taken, in ns.  */
+  const void *origin;		/* Origin of the file's functions.  */
+};
+
+/* Calls made by i8x_exec_run.  */
+
+struct i8x_call
+{
+  struct i8x_funcref *ref;	/* The function to call.  */
+  struct i8x_inferior *inf;	/* The inferior to call it with.  */
+  union i8x_value *args;	/* The arguments.  */
+  union i8x_value *rets;	/* Where to store the return values.  */
+  i8x_err_e result;		/* The result of the call.  */
+};
+
+/* Statistics returned by i8x_exec_get_worker_stats.  */
+
+struct i8x_worker_stats
+{
+  size_t num_calls;		/* Calls made by the worker.  */
+  size_t num_steals;		/* Times it stole from other workers.  */
+  size_t num_stolen;		/* Calls it stole.  */
+  uint64_t busy_ns;		/* Wall-clock time it ran for, in ns.  */
+};
+
+/*
+ * Threads
+ *
+ * A context and the objects created from it must only be used by
+ * one thread at a time.  If the library was configured with
+ * --enable-atomic-refcounts then the following objects may also be
+ * shared with other threads, which may use them and take and drop
+ * references to them without locking:
+ *
+ *  - notes and their chunks, which are immutable once created;
+ *  - functions, which are immutable once registered, provided
+ *    their origins are not changed while they are shared.
+ *
+ * Function references may also be passed to i8x_xctx_call and
+ * i8x_funcref_is_resolved on any thread, whether or not the library
+ * was configured with --enable-atomic-refcounts, while the context
+ * is being updated.  Each thread making calls must use its own
+ * execution context, which it may borrow from the context's pool
+ * with i8x_ctx_acquire_xctx or i8x_ctx_get_thread_xctx.  Callables
+ * may be used on whichever thread is using their execution context.
+ *
+ * Everything else, including contexts, lists, inferiors, execution
+ * contexts and read buffers, is mutable and must not be shared.
+ * Userdata must be set before an object is shared.
+ *
+ * The thread that uses the context must keep a reference to every
+ * shared object for as long as any other thread uses it, so that
+ * objects are only ever released by that thread.
+ */
+
 /*
  * i8x_object
  *
@@ -186,6 +278,39 @@ struct i8x_object *i8x_listitem_get_object (struct i8x_listitem *item);
 #define I8X_LISTABLE_OBJECT_FUNCTIONS(TYPE) \
   I8X_LISTABLE_OBJECT_FUNCTIONS_PREFIX (TYPE, TYPE)
 
+/*
+ * i8x_callable
+ *
+ * access to callables of i8x
+ */
+I8X_COMMON_OBJECT_FUNCTIONS (callable);
+
+i8x_err_e i8x_callable_new (struct i8x_xctx *xctx,
+			    struct i8x_funcref *ref,
+			    struct i8x_callable **callable);
+i8x_err_e i8x_callable_call (struct i8x_callable *callable,
+			     struct i8x_inferior *inf,
+			     union i8x_value *args,
+			     union i8x_value *rets);
+i8x_err_e i8x_callable_call_0 (struct i8x_callable *callable,
+			       struct i8x_inferior *inf,
+			       union i8x_value *ret);
+i8x_err_e i8x_callable_call_1 (struct i8x_callable *callable,
+			       struct i8x_inferior *inf,
+			       union i8x_value arg0,
+			       union i8x_value *ret);
+i8x_err_e i8x_callable_call_2 (struct i8x_callable *callable,
+			       struct i8x_inferior *inf,
+			       union i8x_value arg0,
+			       union i8x_value arg1,
+			       union i8x_value *ret);
+i8x_err_e i8x_callable_call_3 (struct i8x_callable *callable,
+			       struct i8x_inferior *inf,
+			       union i8x_value arg0,
+			       union i8x_value arg1,
+			       union i8x_value arg2,
+			       union i8x_value *ret);
+
 /*
  * i8x_chunk
  *
@@ -222,6 +347,9 @@ const char *i8x_ctx_strerror_r (struct i8x_ctx *ctx, i8x_err_e code,
 void i8x_ctx_set_log_fn (struct i8x_ctx *ctx, i8x_log_fn_t *log_fn);
 int i8x_ctx_get_log_priority (struct i8x_ctx *ctx);
 void i8x_ctx_set_log_priority (struct i8x_ctx *ctx, int priority);
+void i8x_ctx_set_tiering_thresholds (struct i8x_ctx *ctx,
+				     unsigned int calls,
+				     unsigned int backedges);
 void i8x_ctx_set_func_available_cb (struct i8x_ctx *ctx,
 				    i8x_func_cb_t *func_avail_cb_fn);
 void i8x_ctx_set_func_unavailable_cb (struct i8x_ctx *ctx,
@@ -244,6 +372,73 @@ i8x_err_e i8x_ctx_register_native_func (struct i8x_ctx *ctx,
 					i8x_nat_fn_t *impl_fn);
 i8x_err_e i8x_ctx_register_native_funcs (struct i8x_ctx *ctx,
 					 const struct i8x_native_fn *table);
+i8x_err_e i8x_ctx_register_native_func_0 (struct i8x_ctx *ctx,
+					  const char *provider,
+					  const char *name,
+					  const char *encoded_ptypes,
+					  const char *encoded_rtypes,
+					  i8x_nat_fn0_t *impl_fn);
+i8x_err_e i8x_ctx_register_native_func_1 (struct i8x_ctx *ctx,
+					  const char *provider,
+					  const char *name,
+					  const char *encoded_ptypes,
+					  const char *encoded_rtypes,
+					  i8x_nat_fn1_t *impl_fn);
+i8x_err_e i8x_ctx_register_native_func_2 (struct i8x_ctx *ctx,
+					  const char *provider,
+					  const char *name,
+					  const char *encoded_ptypes,
+					  const char *encoded_rtypes,
+					  i8x_nat_fn2_t *impl_fn);
+i8x_err_e i8x_ctx_register_native_func_3 (struct i8x_ctx *ctx,
+					  const char *provider,
+					  const char *name,
+					  const char *encoded_ptypes,
+					  const char *encoded_rtypes,
+					  i8x_nat_fn3_t *impl_fn);
+i8x_err_e i8x_ctx_register_funcs (struct i8x_ctx *ctx,
+				  struct i8x_func **funcs,
+				  size_t num_funcs);
+i8x_err_e i8x_ctx_unregister_origin (struct i8x_ctx *ctx,
+				     const void *origin);
+void i8x_ctx_begin_update (struct i8x_ctx *ctx);
+void i8x_ctx_commit_update (struct i8x_ctx *ctx);
+i8x_err_e i8x_ctx_register_notes (struct i8x_ctx *ctx,
+				  struct i8x_note **notes,
+				  size_t num_notes,
+				  unsigned int num_threads);
+i8x_err_e i8x_ctx_enqueue_note (struct i8x_ctx *ctx,
+				struct i8x_note *note);
+i8x_err_e i8x_ctx_process_queue (struct i8x_ctx *ctx, bool wait);
+int i8x_ctx_get_queue_fd (struct i8x_ctx *ctx);
+i8x_err_e i8x_ctx_load_elf (struct i8x_ctx *ctx, const char *filename,
+			    struct i8x_load_stats *stats);
+i8x_err_e i8x_ctx_load_elf_fd (struct i8x_ctx *ctx, int fd,
+			       const char *srcname,
+			       struct i8x_load_stats *stats);
+i8x_err_e i8x_ctx_fill_xctx_pool (struct i8x_ctx *ctx, size_t num_xctxs,
+				  size_t stack_slots);
+i8x_err_e i8x_ctx_acquire_xctx (struct i8x_ctx *ctx,
+				struct i8x_xctx **xctx);
+void i8x_ctx_release_xctx (struct i8x_ctx *ctx, struct i8x_xctx *xctx);
+i8x_err_e i8x_ctx_get_thread_xctx (struct i8x_ctx *ctx,
+				   struct i8x_xctx **xctx);
+
+/*
+ * i8x_exec
+ *
+ * access to executors of i8x
+ */
+I8X_COMMON_OBJECT_FUNCTIONS (exec);
+
+i8x_err_e i8x_exec_new (struct i8x_ctx *ctx, unsigned int num_workers,
+			size_t stack_slots, struct i8x_exec **exec);
+unsigned int i8x_exec_get_num_workers (struct i8x_exec *exec);
+i8x_err_e i8x_exec_run (struct i8x_exec *exec, struct i8x_call *calls,
+			size_t num_calls);
+i8x_err_e i8x_exec_get_worker_stats (struct i8x_exec *exec,
+				     unsigned int worker,
+				     struct i8x_worker_stats *stats);
 
 /*
  * i8x_func
@@ -259,8 +454,11 @@ i8x_err_e i8x_func_new_native (struct i8x_ctx *ctx,
 			       i8x_nat_fn_t *impl_fn,
 			       struct i8x_func **func);
 bool i8x_func_is_native (struct i8x_func *func);
+bool i8x_func_is_pure (struct i8x_func *func);
 struct i8x_funcref *i8x_func_get_funcref (struct i8x_func *func);
 struct i8x_note *i8x_func_get_note (struct i8x_func *func);
+const void *i8x_func_get_origin (struct i8x_func *func);
+void i8x_func_set_origin (struct i8x_func *func, const void *origin);
 
 #define i8x_func_get_fullname(func) \
   i8x_funcref_get_fullname (i8x_func_get_funcref (func))
@@ -278,6 +476,8 @@ I8X_COMMON_OBJECT_FUNCTIONS (funcref);
 const char *i8x_funcref_get_fullname (struct i8x_funcref *ref);
 bool i8x_funcref_is_private (struct i8x_funcref *ref);
 bool i8x_funcref_is_resolved (struct i8x_funcref *ref);
+i8x_err_e i8x_funcref_set_memo_size (struct i8x_funcref *ref,
+				     size_t num_entries);
 
 /*
  * i8x_list
@@ -360,6 +560,17 @@ i8x_err_e i8x_xctx_new (struct i8x_ctx *ctx, size_t stack_slots,
 bool i8x_xctx_get_use_debug_interpreter (struct i8x_xctx *xctx);
 void i8x_xctx_set_use_debug_interpreter (struct i8x_xctx *xctx,
 					 bool use_debug_interpreter);
+
+/* Execution budgets.  */
+
+#define I8X_FUEL_UNLIMITED UINT64_MAX
+
+uint64_t i8x_xctx_get_fuel (struct i8x_xctx *xctx);
+void i8x_xctx_set_fuel (struct i8x_xctx *xctx, uint64_t fuel);
+void i8x_xctx_set_deadline (struct i8x_xctx *xctx,
+			    const struct timespec *deadline);
+void i8x_xctx_cancel (struct i8x_xctx *xctx);
+void i8x_xctx_clear_cancel (struct i8x_xctx *xctx);
 i8x_err_e i8x_xctx_call (struct i8x_xctx *xctx,
 			 struct i8x_funcref *ref,
 			 struct i8x_inferior *inf,
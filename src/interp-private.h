@@ -83,6 +83,17 @@ struct i8x_instr
   void *impl_std, *impl_dbg;
 };
 
+/* Execution tiers.  See i8x_code_promote.  */
+
+typedef enum
+{
+  I8X_TIER_BASELINE = 0,	/* Running the instruction table.  */
+  I8X_TIER_HOT,			/* Hot, and awaiting promotion.  */
+  I8X_TIER_PROMOTING,		/* Being promoted.  */
+  I8X_TIER_OPTIMIZED,		/* Promoted, or promotion failed.  */
+}
+i8x_tier_e;
+
 /* Unpacked bytecode of one note.  */
 
 struct i8x_code
@@ -97,10 +108,31 @@ struct i8x_code
   struct i8x_instr *itable_limit;	/* The end of the above.  */
   struct i8x_instr *entry_point;	/* Function entry point.  */
 
+  /* Instructions that backward branches go through to charge the
+     execution budget.  These are not in the instruction table.  */
+  struct i8x_instr *budget_checks;
+  size_t num_budget_checks;
+
+  /* Calls and backward branches left before this code is hot, or
+     zero if they don't count.  These are updated by every thread
+     running this code without synchronization, so they are only
+     approximate.  */
+  unsigned int calls_left;
+  unsigned int backedges_left;
+
+  /* Execution tier, as an i8x_tier_e.  */
+  int tier;
+
+  /* Optimized copy of the instruction table and budget checks, and
+     its entry point, or NULL if this code has not been promoted.  */
+  struct i8x_instr *hot_itable;
+  struct i8x_instr *hot_entry_point;
+
   struct i8x_list *ptypes;	/* List of parameter types.  */
   struct i8x_list *rtypes;	/* List of return types.  */
 
   size_t max_stack;		/* Maximum stack this function uses.  */
+  bool is_pure;			/* Set by the validator.  */
   int num_args;			/* Number of arguments.  */
   int num_rets;			/* Number of returns.  */
   /* Note that num_args and num_rets are int and not size_t so
@@ -119,11 +151,25 @@ size_t ip_to_so (struct i8x_code *code, struct i8x_instr *ip);
 void i8x_code_dump_itable (struct i8x_code *code, const char *where);
 void i8x_code_reset_is_visited (struct i8x_code *code);
 i8x_err_e i8x_code_validate (struct i8x_code *code);
+void i8x_code_mark_hot (struct i8x_code *code, unsigned int *counter);
+struct i8x_instr *i8x_code_promote (struct i8x_code *code);
 i8x_err_e i8x_xctx_call_dbg (struct i8x_xctx *xctx,
 			     struct i8x_funcref *ref,
 			     struct i8x_inferior *inf,
 			     union i8x_value *args,
 			     union i8x_value *rets);
+i8x_err_e i8x_xctx_run_code (struct i8x_xctx *xctx,
+			     struct i8x_funcref *ref,
+			     struct i8x_code *code,
+			     struct i8x_inferior *inf,
+			     union i8x_value *args,
+			     union i8x_value *rets);
+i8x_err_e i8x_xctx_run_code_dbg (struct i8x_xctx *xctx,
+				 struct i8x_funcref *ref,
+				 struct i8x_code *code,
+				 struct i8x_inferior *inf,
+				 union i8x_value *args,
+				 union i8x_value *rets);
 
 /* Convert a bytecode pointer to an instruction pointer.  */
 
@@ -140,9 +186,60 @@ bcp_to_ip (struct i8x_code *code, const char *bcp)
 static inline const char * __attribute__ ((always_inline))
 ip_to_bcp (struct i8x_code *code, struct i8x_instr *ip)
 {
-  size_t bci = ip - code->itable;
+  size_t itable_size = code->itable_limit - code->itable;
+  struct i8x_instr *hot_itable = code->hot_itable;
+
+  /* Budget checks have no bytecode of their own, so they map to
+     the instruction they lead to.  The optimized copy has its
+     budget checks after its instruction table.  */
+  if ((ip >= code->budget_checks
+       && ip < code->budget_checks + code->num_budget_checks)
+      || (hot_itable != NULL
+	  && ip >= hot_itable + itable_size
+	  && ip < hot_itable + itable_size + code->num_budget_checks))
+    ip = ip->fall_through;
+
+  if (ip >= code->itable && ip < code->itable_limit)
+    return code->code_start + (ip - code->itable);
+
+  /* Instructions in the optimized copy map to the same bytecode.  */
+  i8x_assert (hot_itable != NULL
+	      && ip >= hot_itable && ip < hot_itable + itable_size);
+
+  return code->code_start + (ip - hot_itable);
+}
+
+/* Count down one of CODE's tiering counters.  */
+
+static inline void __attribute__ ((always_inline))
+i8x_code_tick (struct i8x_code *code, unsigned int *counter)
+{
+  unsigned int left = __atomic_load_n (counter, __ATOMIC_RELAXED);
+
+  if (__i8x_likely (left > 1))
+    __atomic_store_n (counter, left - 1, __ATOMIC_RELAXED);
+  else if (left == 1)
+    i8x_code_mark_hot (code, counter);
+}
+
+/* Return where a call to CODE should start executing.  */
+
+static inline struct i8x_instr * __attribute__ ((always_inline))
+i8x_code_get_entry_point (struct i8x_code *code)
+{
+  struct i8x_instr *entry_point;
+
+  entry_point = __atomic_load_n (&code->hot_entry_point,
+				 __ATOMIC_ACQUIRE);
+  if (entry_point != NULL)
+    return entry_point;
+
+  i8x_code_tick (code, &code->calls_left);
+  if (__i8x_unlikely (__atomic_load_n (&code->tier, __ATOMIC_RELAXED)
+		      == I8X_TIER_HOT))
+    return i8x_code_promote (code);
 
-  return code->code_start + bci;
+  return code->entry_point;
 }
 
 #ifdef __cplusplus
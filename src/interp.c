@@ -25,10 +25,12 @@
 
 #ifdef DEBUG_INTERPRETER
 # define INTERPRETER i8x_xctx_call_dbg
+# define RUN_CODE i8x_xctx_run_code_dbg
 # define DEBUG_ONLY(expr) expr
 # define NOT_DEBUG(expr)
 #else
 # define INTERPRETER i8x_xctx_call
+# define RUN_CODE i8x_xctx_run_code
 # define DEBUG_ONLY(expr)
 # define NOT_DEBUG(expr) expr
 # undef i8x_assert
@@ -144,30 +146,50 @@
     DTABLE_ADD (DW_OP_lit30);	\
     DTABLE_ADD (DW_OP_lit31);	\
     DTABLE_ADD (I8X_OP_return);	\
+    DTABLE_ADD (I8X_OP_check_budget);	\
+    DTABLE_ADD (I8X_OP_check_budget_cold);	\
+    DTABLE_ADD (I8X_OP_plus_lit);	\
+    DTABLE_ADD (I8X_OP_bra_eq);	\
+    DTABLE_ADD (I8X_OP_bra_ge);	\
+    DTABLE_ADD (I8X_OP_bra_gt);	\
+    DTABLE_ADD (I8X_OP_bra_le);	\
+    DTABLE_ADD (I8X_OP_bra_lt);	\
+    DTABLE_ADD (I8X_OP_bra_ne);	\
+    DTABLE_ADD (I8X_OP_bra_eq_lit);	\
+    DTABLE_ADD (I8X_OP_bra_ge_lit);	\
+    DTABLE_ADD (I8X_OP_bra_gt_lit);	\
+    DTABLE_ADD (I8X_OP_bra_le_lit);	\
+    DTABLE_ADD (I8X_OP_bra_lt_lit);	\
+    DTABLE_ADD (I8X_OP_bra_ne_lit);	\
   } while (0)
 
 /* Call into the interpreter with the magic sequence to make
-   it emit its dispatch table.  */
+   it emit its dispatch table.  The interpreter only checks for
+   the magic when the stack check fails, so that calls don't pay
+   for it.  */
 
 #ifdef DEBUG_INTERPRETER
-i8x_err_e
-i8x_ctx_init_dispatch_table (struct i8x_ctx *ctx, void **table,
-			     size_t table_size, bool is_debug)
+void
+i8x_init_dispatch_table (void **table, size_t table_size,
+			 bool is_debug)
 {
-  struct i8x_funcref r;
+  union i8x_value slot;
+  struct i8x_code c;
   struct i8x_xctx x;
 
-  dbg (ctx, "populating %s dispatch table\n",
-       is_debug == false ? "standard" : "debug");
-
-  memset (&r, 0, sizeof (r));
+  memset (&c, 0, sizeof (c));
   memset (&x, 0, sizeof (x));
 
-  x.use_debug_interpreter = is_debug;
+  c.max_stack = 1;
+  x.stack_base = x.stack_limit = x.vsp = x.csp = &slot;
+
   x.dispatch_table_to_init = table;
   x.dispatch_table_size = table_size;
 
-  return i8x_xctx_call (&x, &r, NULL, NULL, NULL);
+  if (is_debug)
+    i8x_xctx_run_code_dbg (&x, NULL, &c, NULL, NULL, NULL);
+  else
+    i8x_xctx_run_code (&x, NULL, &c, NULL, NULL, NULL);
 }
 #endif /* DEBUG_INTERPRETER */
 
@@ -183,39 +205,61 @@ INTERPRETER (struct i8x_xctx *xctx, struct i8x_funcref *ref,
 	     struct i8x_inferior *inf, union i8x_value *args,
 	     union i8x_value *rets)
 {
-  struct i8x_code *code;
-  union i8x_value *vsp, *saved_vsp;
-  union i8x_value *csp, *saved_csp;
-  struct i8x_instr *op;
-  union i8x_value tmp;
-  i8x_err_e err = I8X_OK;
-
-  /* If this function is native then we're in the wrong place.  */
-  if (ref->native_impl != NULL)
-    return ref->native_impl (xctx, inf, args, rets);
+  struct i8x_func *func;
+  i8x_nat_fn_t *native_impl;
+  i8x_err_e err;
 
-  /* Likewise if we should be in the debug interpreter but aren't.  */
+  /* If we should be in the debug interpreter but aren't then we're
+     in the wrong place.  */
 #ifndef DEBUG_INTERPRETER
   if (__i8x_unlikely (xctx->use_debug_interpreter))
     return i8x_xctx_call_dbg (xctx, ref, inf, args, rets);
 #endif
 
-  /* Are we being asked to emit our dispatch table?  */
-  if (__i8x_unlikely (xctx->dispatch_table_to_init != NULL))
+  /* Get the function.  The context may be updated by another thread
+     while this call is in progress, so the function is read from the
+     reference once, here, and the call is registered with the xctx
+     so that the function is not released until the call returns.  */
+  i8x_xctx_begin_call (xctx);
+  func = __atomic_load_n (&ref->published, __ATOMIC_SEQ_CST);
+  i8x_assert (func != NULL);
+
+  /* If this function is native then we're in the wrong place.  */
+  native_impl = i8x_func_get_native_impl (func);
+  if (native_impl != NULL)
+    err = native_impl (xctx, inf, args, rets);
+  else
     {
-      void **dtable = xctx->dispatch_table_to_init;
-      size_t dtable_size = xctx->dispatch_table_size;
+      struct i8x_code *code = i8x_func_get_interp_impl (func);
+
+      if (__i8x_unlikely (code == NULL))
+	err = i8x_func_call_typed_impl (func, xctx, inf, args, rets);
+      else
+	err = RUN_CODE (xctx, ref, code, inf, args, rets);
+    }
 
-      for (size_t i = 0; i < dtable_size; i++)
-	dtable[i] = &&unhandled_operation;
+  i8x_xctx_end_call (xctx);
 
-      DTABLE_ADD_OPS ();
+  return err;
+}
 
-      return I8X_OK;
-    }
+/* Execute CODE, the bytecode of the function REF resolves to.  The
+   caller must have registered the call with i8x_xctx_begin_call.  */
+
+i8x_err_e
+RUN_CODE (struct i8x_xctx *xctx, struct i8x_funcref *ref,
+	  struct i8x_code *code, struct i8x_inferior *inf,
+	  union i8x_value *args, union i8x_value *rets)
+{
+  union i8x_value *vsp, *saved_vsp;
+  union i8x_value *csp, *saved_csp;
+  struct i8x_instr *op;
+  union i8x_value tmp;
+  bool pushed_stack = false;
+  struct i8x_memo *memo = NULL;
+  uint64_t memo_epoch = 0;
+  i8x_err_e err = I8X_OK;
 
-  /* Get the code.  */
-  code = ref->interp_impl;
   i8x_assert (code != NULL);
 
   /* Pull the stack pointers into local variables.  */
@@ -225,13 +269,53 @@ INTERPRETER (struct i8x_xctx *xctx, struct i8x_funcref *ref,
   i8x_assert (vsp <= csp);
   i8x_assert (csp <= xctx->stack_limit);
 
+  /* Don't start if we've been cancelled.  */
+  if (__i8x_unlikely (i8x_xctx_is_cancelled (xctx)))
+    {
+      err = i8x_code_error (code, I8X_CANCELLED, code->entry_point);
+      goto unwind_and_return;
+    }
+
   /* XXX push the dummy frame  */
 
-  /* Check we have enough stack for this function.  */
+  /* Check we have enough stack for this function, and switch to a
+     new stack segment if not.  */
   if (__i8x_unlikely (vsp + code->max_stack > csp))
     {
-      err = i8x_code_error (code, I8X_STACK_OVERFLOW, code->entry_point);
-      goto unwind_and_return;
+      /* Are we being asked to emit our dispatch table?  */
+      if (__i8x_unlikely (xctx->dispatch_table_to_init != NULL))
+	goto emit_dispatch_table;
+
+      if (!i8x_xctx_push_stack (xctx, code->max_stack))
+	{
+	  err = i8x_code_error (code, I8X_STACK_OVERFLOW,
+				code->entry_point);
+	  goto unwind_and_return;
+	}
+      pushed_stack = true;
+
+      vsp = saved_vsp = xctx->vsp;
+      csp = saved_csp = xctx->csp;
+    }
+
+  /* Pure functions called with the same arguments since the last
+     update return what they returned before.  The results are
+     tagged with the epoch the outermost call started in, which is
+     no newer than the function we're executing.  */
+  if (__i8x_unlikely (ref->memo != NULL) && code->is_pure)
+    {
+      memo = ref->memo;
+      memo_epoch = __atomic_load_n (&xctx->call_epoch, __ATOMIC_RELAXED);
+
+      /* Look up into the stack, which has room for the returns,
+	 in case the caller passed the same array for args and rets
+	 and the lookup fails after overwriting some of them.  */
+      if (i8x_memo_lookup (memo, memo_epoch, args, saved_vsp))
+	{
+	  memcpy (rets, saved_vsp,
+		  sizeof (union i8x_value) * code->num_rets);
+	  goto unwind_and_return;
+	}
     }
 
   /* Copy the arguments into the value stack.  */
@@ -241,7 +325,7 @@ INTERPRETER (struct i8x_xctx *xctx, struct i8x_funcref *ref,
   memcpy (saved_vsp, args, sizeof (union i8x_value) * code->num_args);
 
   /* Start executing.  */
-  DISPATCH (code->entry_point);
+  DISPATCH (i8x_code_get_entry_point (code));
 
   OPERATION (DW_OP_dup):
     ENSURE_DEPTH (1);
@@ -358,12 +442,67 @@ INTERPRETER (struct i8x_xctx *xctx, struct i8x_funcref *ref,
     ENSURE_DEPTH (code->num_rets);
     goto unwind_and_return_values;
 
+  OPERATION (I8X_OP_check_budget_cold):
+    i8x_code_tick (code, &code->backedges_left);
+    /* Fall through.  */
+
+  OPERATION (I8X_OP_check_budget):
+    xctx->fuel -= op->arg1.i;
+    if (__i8x_unlikely (xctx->fuel < 0 || i8x_xctx_is_cancelled (xctx)))
+      {
+	err = i8x_xctx_refuel (xctx);
+	if (err != I8X_OK)
+	  {
+	    err = i8x_code_error (code, err, op->fall_through);
+	    goto unwind_and_return;
+	  }
+      }
+    CONTINUE;
+
+  /* Superinstructions.  */
+
+  OPERATION (I8X_OP_plus_lit):
+    ENSURE_DEPTH (1);
+    STACK(0).u += op->arg1.u;
+    CONTINUE;
+
+#define OPERATION_I8X_bra_cmp_op(name, operator)	\
+  OPERATION (I8X_OP_bra_ ## name):			\
+    ENSURE_DEPTH (2);					\
+    tmp.i = STACK(1).i operator STACK(0).i;		\
+    ADJUST_STACK (-2);					\
+    if (tmp.i != 0)					\
+      DISPATCH (op->branch_next);			\
+    CONTINUE;						\
+							\
+  OPERATION (I8X_OP_bra_ ## name ## _lit):		\
+    ENSURE_DEPTH (1);					\
+    tmp.i = STACK(0).i operator op->arg1.i;		\
+    ADJUST_STACK (-1);					\
+    if (tmp.i != 0)					\
+      DISPATCH (op->branch_next);			\
+    CONTINUE
+
+  OPERATION_I8X_bra_cmp_op (eq, ==);
+  OPERATION_I8X_bra_cmp_op (ge, >=);
+  OPERATION_I8X_bra_cmp_op (gt, >);
+  OPERATION_I8X_bra_cmp_op (le, <=);
+  OPERATION_I8X_bra_cmp_op (lt, <);
+  OPERATION_I8X_bra_cmp_op (ne, !=);
+
+#undef OPERATION_I8X_bra_cmp_op
+
  unhandled_operation:
   i8x_internal_error (__FILE__, __LINE__, __FUNCTION__,
 		      _("%s: Not implemented."),
 		      op->desc->name);
 
  unwind_and_return_values:
+  /* This must happen before the returns are copied out, in case
+     the caller passed the same array for args and rets.  */
+  if (__i8x_unlikely (memo != NULL))
+    i8x_memo_store (memo, memo_epoch, args, vsp);
+
   for (int i = 0; i < code->num_rets; i++)
     rets[i] = STACK(i);
 
@@ -371,5 +510,21 @@ INTERPRETER (struct i8x_xctx *xctx, struct i8x_funcref *ref,
   xctx->vsp = saved_vsp;
   xctx->csp = saved_csp;
 
+  if (__i8x_unlikely (pushed_stack))
+    i8x_xctx_pop_stack (xctx);
+
   return err;
+
+ emit_dispatch_table:
+  {
+    void **dtable = xctx->dispatch_table_to_init;
+    size_t dtable_size = xctx->dispatch_table_size;
+
+    for (size_t i = 0; i < dtable_size; i++)
+      dtable[i] = &&unhandled_operation;
+
+    DTABLE_ADD_OPS ();
+
+    return I8X_OK;
+  }
 }
@@ -32,6 +32,11 @@
 
 /* Forward declarations.  */
 
+struct i8x_elffile;
+struct i8x_hashtable;
+struct i8x_pool;
+struct i8x_queue;
+struct i8x_rbcursor;
 struct i8x_symref;
 struct i8x_type;
 
@@ -49,8 +54,30 @@ extern "C" {
 
 i8x_err_e i8x_note_error (struct i8x_note *note, i8x_err_e code,
 			  const char *cause_ptr);
-i8x_err_e i8x_rb_error (struct i8x_readbuf *rb, i8x_err_e code,
-			const char *cause_ptr);
+i8x_err_e i8x_rbc_error (struct i8x_rbcursor *cur, i8x_err_e code,
+			 const char *cause_ptr);
+
+/* Where errors are recorded while i8x_ctx_set_error_sink is in
+   effect.  The note is not referenced: the caller must ensure it
+   outlives the sink.  */
+
+struct i8x_error_sink
+{
+  i8x_err_e code;
+  struct i8x_note *note;
+  const char *ptr;
+};
+
+/* Native functions with fixed arities.  Which member is valid
+   is given by the number of parameters the function has.  */
+
+union i8x_nat_typed_fn
+{
+  i8x_nat_fn0_t *fn0;
+  i8x_nat_fn1_t *fn1;
+  i8x_nat_fn2_t *fn2;
+  i8x_nat_fn3_t *fn3;
+};
 
 /* Assertions.  */
 
@@ -131,6 +158,50 @@ void i8x_ctx_log (struct i8x_ctx *ctx,
 # define __i8x_likely(cond)	(cond)
 #endif
 
+/* Memory allocators.  */
+
+struct i8x_arena_block;
+
+struct i8x_arena
+{
+  struct i8x_arena_block *blocks;  /* Blocks allocated so far.  */
+  char *ptr;			/* Next free byte in current block.  */
+  char *limit;			/* End of current block.  */
+  size_t block_size;		/* Size of the last block allocated.  */
+};
+
+void i8x_arena_init (struct i8x_arena *arena);
+void *i8x_arena_alloc (struct i8x_arena *arena, size_t size);
+void i8x_arena_release (struct i8x_arena *arena);
+
+#define I8X_SLAB_NUM_CLASSES 16
+
+struct i8x_slab
+{
+  struct i8x_arena arena;	/* Where new memory comes from.  */
+  struct i8x_slab_free *freelists[I8X_SLAB_NUM_CLASSES];
+};
+
+void i8x_slab_init (struct i8x_slab *slab);
+void *i8x_slab_alloc (struct i8x_slab *slab, size_t size);
+void i8x_slab_free (struct i8x_slab *slab, void *ptr, size_t size);
+void i8x_slab_release (struct i8x_slab *slab);
+
+/* Memo caches.  */
+
+struct i8x_memo;
+
+i8x_err_e i8x_memo_new (struct i8x_ctx *ctx, size_t num_entries,
+			int num_args, int num_rets,
+			struct i8x_memo **memo);
+void i8x_memo_free (struct i8x_memo *memo);
+bool i8x_memo_lookup (struct i8x_memo *memo, uint64_t epoch,
+		      const union i8x_value *args,
+		      union i8x_value *rets);
+void i8x_memo_store (struct i8x_memo *memo, uint64_t epoch,
+		     const union i8x_value *args,
+		     const union i8x_value *vsp);
+
 /* Object system.  */
 
 struct i8x_object_ops
@@ -145,15 +216,23 @@ struct i8x_object
 {
   const struct i8x_object_ops *ops;
   struct i8x_object *parent;
-  int refcount[2];
-  bool is_moribund;
+  struct i8x_ctx *ctx;		/* The root of the parent chain.  */
   void *userdata;
   i8x_userdata_cleanup_fn *userdata_cleanup;
+
+  /* Reference counts and flags, packed into one word so that the
+     header stays six words.  See object.c for the layout.  */
+  uint64_t state;
 };
 
 #define I8X_OBJECT_FIELDS struct i8x_object _ob
 
-/* Linked lists.  */
+/* Lists.  Lists are arrays, so appending to a list may move its
+   items and removing an item shifts the items after it: either
+   invalidates every struct i8x_listitem of the list, including the
+   one being iterated by i8x_list_foreach.  Code that iterates a
+   list must not change it, nor call anything that might, such as
+   user callbacks.  */
 
 i8x_err_e i8x_list_append (struct i8x_list *list, struct i8x_object *ob);
 void i8x_list_remove (struct i8x_list *list, struct i8x_object *ob);
@@ -185,6 +264,71 @@ I8X_COMMON_OBJECT_FUNCTIONS (code);
 
 i8x_err_e i8x_code_new_from_func (struct i8x_func *func,
 				  struct i8x_code **code);
+i8x_err_e i8x_code_compile (struct i8x_code *code);
+bool i8x_code_is_pure (struct i8x_code *code);
+
+/*
+ * i8x_elffile
+ *
+ * access to elffiles of i8x
+ */
+I8X_COMMON_OBJECT_FUNCTIONS (elffile);
+I8X_LIST_FUNCTIONS (elffile);
+I8X_LISTABLE_OBJECT_FUNCTIONS (elffile);
+
+const void *i8x_elffile_get_origin (struct i8x_elffile *ef);
+
+/*
+ * i8x_hashtable
+ *
+ * access to hashtables of i8x
+ */
+I8X_COMMON_OBJECT_FUNCTIONS (hashtable);
+
+typedef uint32_t i8x_hash_t;
+typedef bool i8x_hash_match_fn_t (struct i8x_object *ob, const void *key);
+
+i8x_err_e i8x_hashtable_new (struct i8x_ctx *ctx,
+			     struct i8x_hashtable **table);
+struct i8x_object *i8x_hashtable_lookup (struct i8x_hashtable *table,
+					 i8x_hash_t hash,
+					 i8x_hash_match_fn_t *match_fn,
+					 const void *key);
+i8x_err_e i8x_hashtable_insert (struct i8x_hashtable *table,
+				i8x_hash_t hash, struct i8x_object *ob);
+void i8x_hashtable_remove (struct i8x_hashtable *table,
+			   i8x_hash_t hash, struct i8x_object *ob);
+void i8x_hashtable_replace (struct i8x_hashtable *table,
+			    i8x_hash_t hash, struct i8x_object *ob,
+			    struct i8x_object *new_ob);
+struct i8x_object *i8x_hashtable_next (struct i8x_hashtable *table,
+				       size_t *index);
+i8x_hash_t i8x_hash_init (void);
+i8x_hash_t i8x_hash_bytes (i8x_hash_t hash, const char *ptr, size_t size);
+i8x_hash_t i8x_hash_string (i8x_hash_t hash, const char *str);
+
+#define i8x_hashtable_foreach(table, index, ob)			\
+  for (index = 0, ob = i8x_hashtable_next (table, &index);	\
+       ob != NULL;						\
+       ob = i8x_hashtable_next (table, &index))
+
+/*
+ * i8x_pool
+ *
+ * access to pools of i8x
+ */
+I8X_COMMON_OBJECT_FUNCTIONS (pool);
+
+i8x_err_e i8x_pool_new (struct i8x_ctx *ctx, struct i8x_pool **pool);
+
+/*
+ * i8x_queue
+ *
+ * access to queues of i8x
+ */
+I8X_COMMON_OBJECT_FUNCTIONS (queue);
+
+i8x_err_e i8x_queue_new (struct i8x_ctx *ctx, struct i8x_queue **queue);
 
 /*
  * i8x_symref
@@ -228,8 +372,8 @@ struct i8x_list *i8x_type_get_rtypes (struct i8x_type *type);
 
 I8X_LIST_FUNCTIONS (chunk);
 
-i8x_err_e i8x_chunk_new_from_readbuf (struct i8x_readbuf *rb,
-				      struct i8x_chunk **chunk);
+i8x_err_e i8x_chunk_new_from_cursor (struct i8x_rbcursor *cur,
+				    struct i8x_chunk **chunk);
 i8x_err_e i8x_chunk_unhandled_error (struct i8x_chunk *chunk);
 i8x_err_e i8x_chunk_version_error (struct i8x_chunk *chunk);
 
@@ -239,9 +383,19 @@ struct i8x_type *i8x_ctx_get_integer_type (struct i8x_ctx *ctx);
 struct i8x_type *i8x_ctx_get_pointer_type (struct i8x_ctx *ctx);
 struct i8x_type *i8x_ctx_get_opaque_type (struct i8x_ctx *ctx);
 bool i8x_ctx_get_use_debug_interpreter_default (struct i8x_ctx *ctx);
+void i8x_ctx_get_tiering_thresholds (struct i8x_ctx *ctx,
+				     unsigned int *calls,
+				     unsigned int *backedges);
+struct i8x_list *i8x_ctx_get_elffiles (struct i8x_ctx *ctx);
+const void *i8x_ctx_new_origin (struct i8x_ctx *ctx);
+struct i8x_slab *i8x_ctx_get_slab (struct i8x_ctx *ctx);
+i8x_err_e i8x_ctx_get_queue (struct i8x_ctx *ctx, struct i8x_queue **queue);
+struct i8x_pool *i8x_ctx_get_pool (struct i8x_ctx *ctx);
 i8x_err_e i8x_ctx_set_error (struct i8x_ctx *ctx, i8x_err_e code,
 			     struct i8x_note *cause_note,
 			     const char *cause_ptr);
+struct i8x_error_sink *i8x_ctx_set_error_sink (struct i8x_error_sink *sink);
+void i8x_ctx_start_logging (struct i8x_ctx *ctx);
 i8x_err_e i8x_ctx_get_funcref_with_note (struct i8x_ctx *ctx,
 					 const char *provider,
 					 const char *name,
@@ -264,23 +418,50 @@ i8x_err_e i8x_ctx_get_functype (struct i8x_ctx *ctx,
 void i8x_ctx_forget_functype (struct i8x_type *type);
 void i8x_ctx_fire_availability_observer (struct i8x_func *func,
 					 bool is_available);
-size_t i8x_ctx_get_dispatch_table_size (struct i8x_ctx *ctx);
-i8x_err_e i8x_ctx_get_dispatch_tables (struct i8x_ctx *ctx,
-				       void ***dispatch_std,
-				       void ***dispatch_dbg);
-i8x_err_e i8x_ctx_init_dispatch_table (struct i8x_ctx *ctx,
-				       void **table, size_t table_size,
-				       bool is_debug);
+uint64_t i8x_ctx_get_epoch (struct i8x_ctx *ctx);
+const uint64_t *i8x_ctx_get_epoch_location (struct i8x_ctx *ctx);
+void i8x_ctx_retire_func (struct i8x_ctx *ctx, struct i8x_func *func);
+i8x_err_e i8x_ctx_add_xctx (struct i8x_ctx *ctx, struct i8x_xctx *xctx);
+void i8x_ctx_forget_xctx (struct i8x_xctx *xctx);
+void i8x_init_dispatch_table (void **table, size_t table_size,
+			      bool is_debug);
 
 /* i8x_func private functions.  */
 
 I8X_LIST_FUNCTIONS (func);
 I8X_LISTABLE_OBJECT_FUNCTIONS (func);
 
+i8x_err_e i8x_func_new_uncompiled (struct i8x_note *note,
+				   struct i8x_func **func);
+i8x_err_e i8x_func_compile (struct i8x_func *func);
+i8x_err_e i8x_func_add_dependencies (struct i8x_func *func);
+void i8x_func_remove_dependencies (struct i8x_func *func);
 bool i8x_func_all_deps_resolved (struct i8x_func *func);
 void i8x_func_fire_availability_observers (struct i8x_func *func);
 struct i8x_code *i8x_func_get_interp_impl (struct i8x_func *func);
 i8x_nat_fn_t *i8x_func_get_native_impl (struct i8x_func *func);
+i8x_err_e i8x_func_new_typed_native (struct i8x_ctx *ctx,
+				     struct i8x_funcref *sig,
+				     int arity,
+				     union i8x_nat_typed_fn impl_fn,
+				     struct i8x_func **func);
+union i8x_nat_typed_fn i8x_func_get_typed_impl (struct i8x_func *func);
+i8x_err_e i8x_func_call_typed_impl (struct i8x_func *func,
+				    struct i8x_xctx *xctx,
+				    struct i8x_inferior *inf,
+				    union i8x_value *args,
+				    union i8x_value *rets);
+void i8x_func_link_registered (struct i8x_func *func,
+			       struct i8x_func *first);
+struct i8x_func *i8x_func_unlink_registered (struct i8x_func *func);
+bool i8x_func_is_registered (struct i8x_func *func);
+void i8x_func_mark_pending (struct i8x_func *func,
+			    struct i8x_func **pending);
+void i8x_func_discard_pending (struct i8x_func *pending);
+void i8x_func_fire_pending (struct i8x_func *pending);
+void i8x_func_retire (struct i8x_func *func, uint64_t epoch,
+		      struct i8x_func **retired);
+void i8x_func_reclaim (struct i8x_func **retired, uint64_t epoch);
 
 /* i8x_funcref private functions.  */
 
@@ -291,33 +472,147 @@ i8x_err_e i8x_funcref_new (struct i8x_ctx *ctx, const char *fullname,
 			   struct i8x_type *functype,
 			   struct i8x_funcref **ref);
 struct i8x_funcref *i8x_object_as_funcref (struct i8x_object *ob);
-void i8x_funcref_register_func (struct i8x_funcref *ref,
-				struct i8x_func *func);
+i8x_err_e i8x_funcref_register_func (struct i8x_funcref *ref,
+				     struct i8x_func *func);
 void i8x_funcref_unregister_func (struct i8x_funcref *ref,
 				  struct i8x_func *func);
+i8x_err_e i8x_funcref_add_dependent (struct i8x_funcref *ref,
+				     struct i8x_func *func);
+void i8x_funcref_remove_dependent (struct i8x_funcref *ref,
+				   struct i8x_func *func);
 void i8x_funcref_reset_is_resolved (struct i8x_funcref *ref);
 void i8x_funcref_mark_unresolved (struct i8x_funcref *ref);
+struct i8x_func *i8x_funcref_get_resolved (struct i8x_funcref *ref);
+void i8x_funcref_mark_changed (struct i8x_funcref *ref,
+			       struct i8x_funcref **changed);
+void i8x_funcref_discard_changed (struct i8x_funcref *changed);
+void i8x_funcref_update_resolution (struct i8x_funcref *changed,
+				    struct i8x_func **pending);
+void i8x_funcref_retire_published (struct i8x_funcref *ref);
 struct i8x_type *i8x_funcref_get_type (struct i8x_funcref *ref);
 
 /* i8x_list private functions.  */
 
+typedef bool i8x_list_match_fn_t (struct i8x_object *ob,
+				  const void *data);
+
 i8x_err_e i8x_list_new (struct i8x_ctx *ctx,
 			bool manage_references,
 			struct i8x_list **list);
+void i8x_list_remove_matching (struct i8x_list *list,
+			       i8x_list_match_fn_t *match_fn,
+			       const void *data);
+
+/* i8x_note private functions.  */
+
+i8x_err_e i8x_note_new_from_buf_owned (struct i8x_ctx *ctx,
+				       const char *buf, size_t bufsiz,
+				       const char *srcname,
+				       ssize_t srcoffset,
+				       struct i8x_object *owner,
+				       const void *origin,
+				       struct i8x_note **note);
+const void *i8x_note_get_origin (struct i8x_note *note);
+struct i8x_arena *i8x_note_get_arena (struct i8x_note *note);
 
 /* i8x_object private functions.  */
 
 i8x_err_e i8x_ob_new (void *parent, const struct i8x_object_ops *ops,
 		      void *ob);
+i8x_err_e i8x_ob_new_in_arena (void *parent, struct i8x_arena *arena,
+			       const struct i8x_object_ops *ops,
+			       void *ob);
 struct i8x_object *i8x_ob_get_parent (struct i8x_object *ob);
 struct i8x_object *i8x_ob_cast (struct i8x_object *ob,
 				const struct i8x_object_ops *ops);
 
 /* i8x_readbuf private functions.  */
 
-const char *i8x_rb_get_ptr (struct i8x_readbuf *rb);
-i8x_err_e i8x_rb_read_funcref (struct i8x_readbuf *rb,
-			       struct i8x_funcref **ref);
+i8x_err_e i8x_rbc_read_offset_string (struct i8x_rbcursor *cur,
+				      const char **result);
+
+/* i8x_xctx private functions.  */
+
+I8X_LIST_FUNCTIONS (xctx);
+I8X_LISTABLE_OBJECT_FUNCTIONS (xctx);
+
+uint64_t i8x_xctx_get_call_epoch (struct i8x_xctx *xctx);
+
+/* Read cursors.  These are the library-internal equivalent of
+   i8x_readbuf, without the object header.  Cursors are intended
+   to live on the stack, and do not hold a reference to their note:
+   the caller must ensure the note outlives the cursor.  */
+
+struct i8x_rbcursor
+{
+  struct i8x_note *note;	/* The note being read.  */
+
+  i8x_byte_order_e byte_order;	/* Byte order for multibyte values.  */
+
+  const char *start;	/* Pointer to first byte of buffer.  */
+  const char *limit;	/* Pointer to byte after last byte of buffer.  */
+  const char *ptr;	/* Pointer to next byte to be read.  */
+};
+
+void i8x_rbc_init_from_note (struct i8x_rbcursor *cur,
+			     struct i8x_note *note);
+void i8x_rbc_init_from_chunk (struct i8x_rbcursor *cur,
+			      struct i8x_chunk *chunk);
+i8x_err_e i8x_rbc_read_byte_order_mark (struct i8x_rbcursor *cur);
+i8x_err_e i8x_rbc_read_int8_t (struct i8x_rbcursor *cur, int8_t *result);
+i8x_err_e i8x_rbc_read_uint8_t (struct i8x_rbcursor *cur,
+				uint8_t *result);
+i8x_err_e i8x_rbc_read_int16_t (struct i8x_rbcursor *cur,
+				int16_t *result);
+i8x_err_e i8x_rbc_read_uint16_t (struct i8x_rbcursor *cur,
+				 uint16_t *result);
+i8x_err_e i8x_rbc_read_int32_t (struct i8x_rbcursor *cur,
+				int32_t *result);
+i8x_err_e i8x_rbc_read_uint32_t (struct i8x_rbcursor *cur,
+				 uint32_t *result);
+i8x_err_e i8x_rbc_read_int64_t (struct i8x_rbcursor *cur,
+				int64_t *result);
+i8x_err_e i8x_rbc_read_uint64_t (struct i8x_rbcursor *cur,
+				 uint64_t *result);
+i8x_err_e i8x_rbc_read_sleb128 (struct i8x_rbcursor *cur,
+				intmax_t *result);
+i8x_err_e i8x_rbc_read_uleb128 (struct i8x_rbcursor *cur,
+				uintmax_t *result);
+i8x_err_e i8x_rbc_read_bytes (struct i8x_rbcursor *cur, size_t nbytes,
+			      const char **result);
+i8x_err_e i8x_rbc_read_funcref (struct i8x_rbcursor *cur,
+				struct i8x_funcref **ref);
+
+static inline struct i8x_note * __attribute__ ((always_inline))
+i8x_rbc_get_note (struct i8x_rbcursor *cur)
+{
+  return cur->note;
+}
+
+static inline const char * __attribute__ ((always_inline))
+i8x_rbc_get_ptr (struct i8x_rbcursor *cur)
+{
+  return cur->ptr;
+}
+
+static inline size_t __attribute__ ((always_inline))
+i8x_rbc_bytes_left (struct i8x_rbcursor *cur)
+{
+  return cur->limit - cur->ptr;
+}
+
+static inline i8x_byte_order_e __attribute__ ((always_inline))
+i8x_rbc_get_byte_order (struct i8x_rbcursor *cur)
+{
+  return cur->byte_order;
+}
+
+static inline void __attribute__ ((always_inline))
+i8x_rbc_set_byte_order (struct i8x_rbcursor *cur,
+			i8x_byte_order_e order)
+{
+  cur->byte_order = order;
+}
 
 #ifdef __cplusplus
 } /* extern "C" */
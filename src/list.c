@@ -17,57 +17,58 @@
    License along with the Infinity Note Execution Library; if not, see
    <http://www.gnu.org/licenses/>.  */
 
+#include <string.h>
 #include "libi8x-private.h"
 
-struct i8x_list
-{
-  I8X_OBJECT_FIELDS;
+/* Lists are growable arrays.  Iterators (struct i8x_listitem
+   pointers) point directly into the array, so they are invalidated
+   by any change to the list: i8x_list_append moves the array
+   whenever the list grows, and removing an item shifts every item
+   after it.  Most lists in the library hold only one or two objects, so
+   the first few items are stored inline.  */
 
-  /* The head of the list.  */
-  struct i8x_listitem *head;
-
-  /* True if listitems should own references to their objects.  */
-  bool manage_references;
-};
+#define NUM_INLINE_ITEMS 2
 
 struct i8x_listitem
 {
-  I8X_OBJECT_FIELDS;
-
-  struct i8x_listitem *next, *prev;
-
   struct i8x_object *ob;
 };
 
-I8X_COMMON_OBJECT_FUNCTIONS (listitem);
-
-static struct i8x_list *
-i8x_listitem_get_list (struct i8x_listitem *li)
+struct i8x_list
 {
-  return (struct i8x_list *)
-    i8x_ob_get_parent ((struct i8x_object *) li);
+  I8X_OBJECT_FIELDS;
 
-}
+  struct i8x_listitem *items;	/* The items.  */
+  size_t size;			/* Number of items in the list.  */
+  size_t capacity;		/* Number of items allocated.  */
+
+  /* True if the list should own references to its objects.  */
+  bool manage_references;
+
+  /* Initial storage for ITEMS.  */
+  struct i8x_listitem inline_items[NUM_INLINE_ITEMS];
+};
 
 static void
 i8x_list_unlink (struct i8x_object *ob)
 {
   struct i8x_list *list = (struct i8x_list *) ob;
+  size_t i, size = list->size;
 
-  list->head = i8x_listitem_unref (list->head);
+  list->size = 0;
+
+  if (list->manage_references)
+    for (i = 0; i < size; i++)
+      list->items[i].ob = i8x_ob_unref (list->items[i].ob);
 }
 
 static void
-i8x_listitem_unlink (struct i8x_object *ob)
+i8x_list_free (struct i8x_object *ob)
 {
-  struct i8x_listitem *li = (struct i8x_listitem *) ob;
-  struct i8x_list *list = i8x_listitem_get_list (li);
-
-  if (list->manage_references)
-    li->ob = i8x_ob_unref (li->ob);
+  struct i8x_list *list = (struct i8x_list *) ob;
 
-  if (li->next != list->head)
-    li->next = i8x_listitem_unref (li->next);
+  if (list->items != list->inline_items)
+    free (list->items);
 }
 
 const struct i8x_object_ops i8x_list_ops =
@@ -75,39 +76,9 @@ const struct i8x_object_ops i8x_list_ops =
     "list",				/* Object name.  */
     sizeof (struct i8x_list),		/* Object size.  */
     i8x_list_unlink,			/* Unlink function.  */
-    NULL,				/* Free function.  */
-  };
-
-const struct i8x_object_ops i8x_listitem_ops =
-  {
-    "listitem",				/* Object name.  */
-    sizeof (struct i8x_listitem),	/* Object size.  */
-    i8x_listitem_unlink,		/* Unlink function.  */
-    NULL,				/* Free function.  */
+    i8x_list_free,			/* Free function.  */
   };
 
-static i8x_err_e
-i8x_listitem_new (struct i8x_list *list,
-		  struct i8x_object *ob,
-		  struct i8x_listitem **li)
-{
-  struct i8x_listitem *l;
-  i8x_err_e err;
-
-  err = i8x_ob_new (list, &i8x_listitem_ops, &l);
-  if (err != I8X_OK)
-    return err;
-
-  if (list->manage_references)
-    ob = i8x_ob_ref (ob);
-
-  l->ob = ob;
-
-  *li = l;
-
-  return I8X_OK;
-}
-
 i8x_err_e
 i8x_list_new (struct i8x_ctx *ctx, bool manage_references,
 	      struct i8x_list **list)
@@ -120,95 +91,128 @@ i8x_list_new (struct i8x_ctx *ctx, bool manage_references,
     return err;
 
   l->manage_references = manage_references;
+  l->items = l->inline_items;
+  l->capacity = NUM_INLINE_ITEMS;
 
-  err = i8x_listitem_new (l, NULL, &l->head);
-  if (err != I8X_OK)
-    {
-      l = i8x_list_unref (l);
+  *list = l;
 
-      return err;
+  return I8X_OK;
+}
+
+static i8x_err_e
+i8x_list_grow (struct i8x_list *list)
+{
+  size_t capacity = list->capacity * 2;
+  struct i8x_listitem *items;
+
+  if (list->items == list->inline_items)
+    {
+      items = malloc (capacity * sizeof (struct i8x_listitem));
+      if (items != NULL)
+	memcpy (items, list->items,
+		list->size * sizeof (struct i8x_listitem));
     }
+  else
+    items = realloc (list->items, capacity * sizeof (struct i8x_listitem));
 
-  l->head->next = l->head->prev = l->head;
+  if (items == NULL)
+    return i8x_out_of_memory (i8x_list_get_ctx (list));
 
-  *list = l;
+  list->items = items;
+  list->capacity = capacity;
 
   return I8X_OK;
 }
 
+/* Append OB to LIST.  This invalidates every iterator of LIST.  */
+
 i8x_err_e
 i8x_list_append (struct i8x_list *list, struct i8x_object *ob)
 {
-  struct i8x_listitem *head = list->head;
-  struct i8x_listitem *last = head->prev;
-  struct i8x_listitem *item;
-  i8x_err_e err;
+  if (list->size == list->capacity)
+    {
+      i8x_err_e err = i8x_list_grow (list);
 
-  err = i8x_listitem_new (list, ob, &item);
-  if (err != I8X_OK)
-    return err;
+      if (err != I8X_OK)
+	return err;
+    }
 
-  item->prev = last;
-  item->next = list->head;
-  last->next = item;
-  head->prev = item;
+  if (list->manage_references)
+    ob = i8x_ob_ref (ob);
+
+  list->items[list->size++].ob = ob;
 
   return I8X_OK;
 }
 
-static struct i8x_listitem *
-i8x_list_get_listitem (struct i8x_list *list, struct i8x_object *ob)
+/* Remove the first occurrence of OB from LIST, which must contain
+   it.  The order of the remaining items is preserved.  This takes
+   time proportional to the size of the list, and invalidates every
+   iterator of LIST.  */
+
+void
+i8x_list_remove (struct i8x_list *list, struct i8x_object *ob)
 {
-  struct i8x_listitem *li;
+  size_t i;
+
+  for (i = 0; i < list->size; i++)
+    if (list->items[i].ob == ob)
+      break;
 
-  i8x_list_foreach (list, li)
-    if (li->ob == ob)
-      return li;
+  i8x_assert (i < list->size);
 
-  return NULL;
+  list->size--;
+  memmove (&list->items[i], &list->items[i + 1],
+	   (list->size - i) * sizeof (struct i8x_listitem));
+
+  if (list->manage_references)
+    i8x_ob_unref (ob);
 }
 
+/* Remove every object in LIST for which MATCH_FN returns true when
+   passed DATA, in a single pass.  The order of the remaining items
+   is preserved.  */
+
 void
-i8x_list_remove (struct i8x_list *list, struct i8x_object *ob)
+i8x_list_remove_matching (struct i8x_list *list,
+			  i8x_list_match_fn_t *match_fn,
+			  const void *data)
 {
-  struct i8x_listitem *item = i8x_list_get_listitem (list, ob);
+  size_t i, j, size = list->size;
 
-  item->prev->next = item->next;
-  item->next->prev = item->prev;
+  for (i = j = 0; i < size; i++)
+    {
+      struct i8x_object *ob = list->items[i].ob;
+
+      if (!match_fn (ob, data))
+	list->items[j++].ob = ob;
+      else if (list->manage_references)
+	i8x_ob_unref (ob);
+    }
 
-  item->next = NULL;
-  item = i8x_listitem_unref (item);
+  list->size = j;
 }
 
 I8X_EXPORT int
 i8x_list_size (struct i8x_list *list)
 {
-  struct i8x_listitem *li;
-  int count = 0;
-
-  i8x_list_foreach (list, li)
-    {
-      count++;
-      i8x_assert (count > 0);
-    }
-
-  return count;
+  return list->size;
 }
 
 I8X_EXPORT struct i8x_listitem *
 i8x_list_get_first (struct i8x_list *list)
 {
-  if (list == NULL)
+  if (list == NULL || list->size == 0)
     return NULL;
 
-  return i8x_list_get_next (list, list->head);
+  return list->items;
 }
 
 I8X_EXPORT struct i8x_listitem *
 i8x_list_get_next (struct i8x_list *list, struct i8x_listitem *li)
 {
-  li = li->next;
-  if (li == list->head)
+  li++;
+  if (li == list->items + list->size)
     return NULL;
 
   return li;
@@ -0,0 +1,168 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "libi8x-private.h"
+
+/* Memo caches remember the results of calls to pure functions.
+   Each set of arguments hashes to exactly one entry, which a call
+   with different arguments that hashes the same simply overwrites.
+   Calls on any thread may read and write entries at once, so every
+   entry has a sequence number that is odd while the entry is being
+   written: readers check it is even and unchanged after copying
+   the entry out, and writers that find it odd give up.  Every word
+   is accessed atomically, so no access is ever a data race.
+
+   Entries are tagged with the resolution epoch the results were
+   computed in, and only match calls made in that epoch, so updating
+   the context empties every cache without touching them.  */
+
+struct i8x_memo
+{
+  size_t mask;		/* Number of entries, minus one.  */
+  int num_args;		/* Number of arguments.  */
+  int num_rets;		/* Number of returns.  */
+  size_t stride;	/* Words per entry.  */
+
+  /* The entries.  Each is a sequence number, an epoch (zero if the
+     entry is empty), the arguments, and the returns.  */
+  uint64_t words[];
+};
+
+/* Caches must be smaller than this many entries.  */
+#define MAX_MEMO_ENTRIES (1 << 20)
+
+/* Create a memo cache with room for at least NUM_ENTRIES results
+   of a function with NUM_ARGS arguments and NUM_RETS returns.  */
+
+i8x_err_e
+i8x_memo_new (struct i8x_ctx *ctx, size_t num_entries, int num_args,
+	      int num_rets, struct i8x_memo **memo)
+{
+  size_t stride = 2 + num_args + num_rets;
+  struct i8x_memo *m;
+  size_t size = 1;
+
+  if (num_entries >= MAX_MEMO_ENTRIES)
+    return i8x_invalid_argument (ctx);
+
+  while (size < num_entries)
+    size <<= 1;
+
+  m = calloc (1, sizeof (struct i8x_memo)
+		 + size * stride * sizeof (uint64_t));
+  if (m == NULL)
+    return i8x_out_of_memory (ctx);
+
+  m->mask = size - 1;
+  m->num_args = num_args;
+  m->num_rets = num_rets;
+  m->stride = stride;
+
+  *memo = m;
+
+  return I8X_OK;
+}
+
+void
+i8x_memo_free (struct i8x_memo *memo)
+{
+  free (memo);
+}
+
+/* Return the entry in MEMO for ARGS.  */
+
+static uint64_t *
+i8x_memo_get_entry (struct i8x_memo *memo, const union i8x_value *args)
+{
+  uint64_t hash = 0;
+
+  for (int i = 0; i < memo->num_args; i++)
+    {
+      hash = (hash ^ args[i].u) * UINT64_C (0x9e3779b97f4a7c15);
+      hash ^= hash >> 32;
+    }
+
+  return memo->words + (hash & memo->mask) * memo->stride;
+}
+
+/* Look up the results of a call with ARGS made in EPOCH.  Returns
+   true and stores them in RETS if MEMO has them, otherwise returns
+   false, possibly having overwritten RETS.  */
+
+bool
+i8x_memo_lookup (struct i8x_memo *memo, uint64_t epoch,
+		 const union i8x_value *args, union i8x_value *rets)
+{
+  uint64_t *entry = i8x_memo_get_entry (memo, args);
+  uint64_t *entry_args = entry + 2;
+  uint64_t *entry_rets = entry_args + memo->num_args;
+  uint64_t seq;
+
+  seq = __atomic_load_n (&entry[0], __ATOMIC_ACQUIRE);
+  if (seq & 1)
+    return false;
+
+  if (__atomic_load_n (&entry[1], __ATOMIC_RELAXED) != epoch)
+    return false;
+
+  for (int i = 0; i < memo->num_args; i++)
+    if (__atomic_load_n (&entry_args[i], __ATOMIC_RELAXED) != args[i].u)
+      return false;
+
+  for (int i = 0; i < memo->num_rets; i++)
+    rets[i].u = __atomic_load_n (&entry_rets[i], __ATOMIC_RELAXED);
+
+  /* Check nobody started writing the entry while we read it.  */
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+  return __atomic_load_n (&entry[0], __ATOMIC_RELAXED) == seq;
+}
+
+/* Remember that a call with ARGS made in EPOCH returned the values
+   on top of the value stack whose top is at VSP, the first return
+   value being in the top slot, as the interpreter leaves them.  */
+
+void
+i8x_memo_store (struct i8x_memo *memo, uint64_t epoch,
+		const union i8x_value *args, const union i8x_value *vsp)
+{
+  uint64_t *entry = i8x_memo_get_entry (memo, args);
+  uint64_t *entry_args = entry + 2;
+  uint64_t *entry_rets = entry_args + memo->num_args;
+  uint64_t seq;
+
+  /* Don't wait for other writers.  */
+  seq = __atomic_load_n (&entry[0], __ATOMIC_RELAXED);
+  if ((seq & 1)
+      || !__atomic_compare_exchange_n (&entry[0], &seq, seq + 1, false,
+				       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  __atomic_store_n (&entry[1], epoch, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < memo->num_args; i++)
+    __atomic_store_n (&entry_args[i], args[i].u, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < memo->num_rets; i++)
+    __atomic_store_n (&entry_rets[i], vsp[-1 - i].u, __ATOMIC_RELAXED);
+
+  __atomic_store_n (&entry[0], seq + 2, __ATOMIC_RELEASE);
+}
@@ -28,9 +28,17 @@ struct i8x_note
   ssize_t srcoffset;	/* Offset in the file this note came from.  */
 
   size_t encoded_size;	/* Size of encoded data, in bytes.  */
-  char *encoded;	/* Encoded data.  */
+  const char *encoded;	/* Encoded data.  */
+
+  /* The object owning the encoded data, or NULL if the note
+     owns a private copy.  */
+  struct i8x_object *owner;
+  bool is_copy;		/* True if we must free encoded.  */
+
+  const void *origin;	/* Origin of functions created from this.  */
 
   struct i8x_list *chunks;  /* Linked list of chunks.  */
+  struct i8x_arena arena;   /* Memory for the chunks.  */
 
   size_t strings_size;	/* Size of string table, in bytes.  */
   const char *strings;	/* String table.  */
@@ -39,22 +47,20 @@ struct i8x_note
 static i8x_err_e
 i8x_note_locate_chunks (struct i8x_note *note)
 {
-  struct i8x_readbuf *rb;
+  struct i8x_rbcursor cur;
   i8x_err_e err;
 
   err = i8x_list_new (i8x_note_get_ctx (note), true, &note->chunks);
   if (err != I8X_OK)
     return err;
 
-  err = i8x_rb_new_from_note (note, &rb);
-  if (err != I8X_OK)
-    return err;
+  i8x_rbc_init_from_note (&cur, note);
 
-  while (i8x_rb_bytes_left (rb) > 0)
+  while (i8x_rbc_bytes_left (&cur) > 0)
     {
       struct i8x_chunk *chunk;
 
-      err = i8x_chunk_new_from_readbuf (rb, &chunk);
+      err = i8x_chunk_new_from_cursor (&cur, &chunk);
       if (err != I8X_OK)
 	break;
 
@@ -72,14 +78,13 @@ i8x_note_locate_chunks (struct i8x_note *note)
 	break;
     }
 
-  rb = i8x_rb_unref (rb);
-
   return err;
 }
 
 static i8x_err_e
 i8x_note_init (struct i8x_note *note, const char *buf, size_t bufsiz,
-	       const char *srcname, ssize_t srcoffset)
+	       const char *srcname, ssize_t srcoffset,
+	       struct i8x_object *owner)
 {
   i8x_err_e err;
 
@@ -94,11 +99,23 @@ i8x_note_init (struct i8x_note *note, const char *buf, size_t bufsiz,
   note->srcoffset = srcoffset;
 
   note->encoded_size = bufsiz;
-  note->encoded = malloc (bufsiz);
-  if (note->encoded == NULL)
-    return i8x_out_of_memory (i8x_note_get_ctx (note));
 
-  memcpy (note->encoded, buf, bufsiz);
+  if (owner != NULL)
+    {
+      note->owner = i8x_ob_ref (owner);
+      note->encoded = buf;
+    }
+  else
+    {
+      char *encoded = malloc (bufsiz);
+
+      if (encoded == NULL)
+	return i8x_out_of_memory (i8x_note_get_ctx (note));
+
+      memcpy (encoded, buf, bufsiz);
+      note->encoded = encoded;
+      note->is_copy = true;
+    }
 
   err = i8x_note_locate_chunks (note);
   if (err != I8X_OK)
@@ -113,6 +130,7 @@ i8x_note_unlink (struct i8x_object *ob)
   struct i8x_note *note = (struct i8x_note *) ob;
 
   note->chunks = i8x_list_unref (note->chunks);
+  note->owner = i8x_ob_unref (note->owner);
 }
 
 static void
@@ -123,8 +141,10 @@ i8x_note_free (struct i8x_object *ob)
   if (note->srcname != NULL)
     free (note->srcname);
 
-  if (note->encoded != NULL)
-    free (note->encoded);
+  if (note->is_copy)
+    free ((char *) note->encoded);
+
+  i8x_arena_release (&note->arena);
 }
 
 const struct i8x_object_ops i8x_note_ops =
@@ -135,10 +155,17 @@ const struct i8x_object_ops i8x_note_ops =
     i8x_note_free,		/* Free function.  */
   };
 
-I8X_EXPORT i8x_err_e
-i8x_note_new_from_buf (struct i8x_ctx *ctx, const char *buf,
-		       size_t bufsiz, const char *srcname,
-		       ssize_t srcoffset, struct i8x_note **note)
+/* Internal version of i8x_note_new_from_buf that can create notes
+   without copying the encoded data.  If OWNER is not NULL then BUF
+   must remain valid for as long as OWNER exists, and the new note
+   will hold a reference to OWNER.  Functions created from the note
+   will have the origin ORIGIN.  */
+
+i8x_err_e
+i8x_note_new_from_buf_owned (struct i8x_ctx *ctx, const char *buf,
+			     size_t bufsiz, const char *srcname,
+			     ssize_t srcoffset, struct i8x_object *owner,
+			     const void *origin, struct i8x_note **note)
 {
   struct i8x_note *n;
   i8x_err_e err;
@@ -147,7 +174,7 @@ i8x_note_new_from_buf (struct i8x_ctx *ctx, const char *buf,
   if (err != I8X_OK)
     return err;
 
-  err = i8x_note_init (n, buf, bufsiz, srcname, srcoffset);
+  err = i8x_note_init (n, buf, bufsiz, srcname, srcoffset, owner);
   if (err != I8X_OK)
     {
       n = i8x_note_unref (n);
@@ -155,11 +182,22 @@ i8x_note_new_from_buf (struct i8x_ctx *ctx, const char *buf,
       return err;
     }
 
+  n->origin = origin;
+
   *note = n;
 
   return I8X_OK;
 }
 
+I8X_EXPORT i8x_err_e
+i8x_note_new_from_buf (struct i8x_ctx *ctx, const char *buf,
+		       size_t bufsiz, const char *srcname,
+		       ssize_t srcoffset, struct i8x_note **note)
+{
+  return i8x_note_new_from_buf_owned (ctx, buf, bufsiz, srcname,
+				      srcoffset, NULL, NULL, note);
+}
+
 I8X_EXPORT const char *
 i8x_note_get_src_name (struct i8x_note *note)
 {
@@ -184,6 +222,23 @@ i8x_note_get_encoded (struct i8x_note *note)
   return note->encoded;
 }
 
+/* Return the origin of functions created from NOTE.  */
+
+const void *
+i8x_note_get_origin (struct i8x_note *note)
+{
+  return note->origin;
+}
+
+/* Return an arena for objects that cannot outlive NOTE.  The arena
+   is released in one go when NOTE is.  */
+
+struct i8x_arena *
+i8x_note_get_arena (struct i8x_note *note)
+{
+  return &note->arena;
+}
+
 I8X_EXPORT struct i8x_list *
 i8x_note_get_chunks (struct i8x_note *note)
 {
@@ -244,17 +299,17 @@ i8x_note_locate_strings (struct i8x_note *note)
   return I8X_OK;
 }
 
-I8X_EXPORT i8x_err_e
-i8x_rb_read_offset_string (struct i8x_readbuf *rb, const char **result)
+i8x_err_e
+i8x_rbc_read_offset_string (struct i8x_rbcursor *cur, const char **result)
 {
-  struct i8x_note *note = i8x_rb_get_note (rb);
+  struct i8x_note *note = i8x_rbc_get_note (cur);
   const char *offset_ptr;
   size_t offset;
   i8x_err_e err;
 
-  offset_ptr = i8x_rb_get_ptr (rb);
+  offset_ptr = i8x_rbc_get_ptr (cur);
 
-  err = i8x_rb_read_uleb128 (rb, &offset);
+  err = i8x_rbc_read_uleb128 (cur, &offset);
   if (err != I8X_OK)
     return err;
 
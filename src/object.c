@@ -19,57 +19,113 @@
 
 #include "libi8x-private.h"
 
-static struct i8x_object *i8x_ob_unref_parent (struct i8x_object *ob);
+/* Where an object's memory came from.  Objects with parents are
+   allocated from their context's slab unless they are created in
+   an arena.  Contexts are allocated with calloc.  */
 
-enum ref_sense_e
+enum allocator_e
 {
-  RS_FORWARD,
-  RS_BACK
+  AL_MALLOC,
+  AL_SLAB,
+  AL_ARENA
 };
 
-static struct i8x_object *
-i8x_ob_ref_1 (struct i8x_object *ob, enum ref_sense_e sense)
+/* Layout of an object's state word.  The low 32 bits are its
+   reference count.  Above them are two bits saying where its memory
+   came from and a bit that is set once it is being released.  The
+   remaining bits count its back references.  */
+
+#define STATE_REFCOUNT_MASK	UINT64_C (0xffffffff)
+#define STATE_ALLOCATOR_SHIFT	32
+#define STATE_ALLOCATOR_MASK	(UINT64_C (3) << STATE_ALLOCATOR_SHIFT)
+#define STATE_MORIBUND		(UINT64_C (1) << 34)
+#define STATE_BACKREF_SHIFT	35
+#define STATE_ONE_BACKREF	(UINT64_C (1) << STATE_BACKREF_SHIFT)
+
+#define STATE_REFCOUNT(state) ((int32_t) ((state) & STATE_REFCOUNT_MASK))
+#define STATE_ALLOCATOR(state) \
+  ((enum allocator_e) (((state) & STATE_ALLOCATOR_MASK) \
+		       >> STATE_ALLOCATOR_SHIFT))
+#define STATE_BACKREFS(state) ((state) >> STATE_BACKREF_SHIFT)
+
+/* State word updates.  If atomic reference counts are enabled then
+   references to shared objects may be taken and dropped on any
+   thread.  Objects are still only released by the thread that uses
+   their context, which synchronizes with every thread that dropped
+   a reference before it.  Every update must be atomic all the same,
+   as the other fields share a word with the reference count.  */
+
+#ifdef ENABLE_ATOMIC_REFCOUNTS
+#  define STATE_ADD(state, n) \
+  __atomic_add_fetch (&(state), (n), __ATOMIC_RELAXED)
+#  define STATE_SUB(state, n) \
+  __atomic_sub_fetch (&(state), (n), __ATOMIC_ACQ_REL)
+#  define STATE_SET(state, bits) \
+  __atomic_or_fetch (&(state), (bits), __ATOMIC_RELAXED)
+#  define STATE_LOAD(state) \
+  __atomic_load_n (&(state), __ATOMIC_RELAXED)
+#else
+#  define STATE_ADD(state, n) ((state) += (n))
+#  define STATE_SUB(state, n) ((state) -= (n))
+#  define STATE_SET(state, bits) ((state) |= (bits))
+#  define STATE_LOAD(state) (state)
+#endif
+
+/* Children hold back references to their parents.  Back references
+   do not keep their objects alive: they exist only so objects that
+   are released while they still have children can be reported.  */
+
+static void
+i8x_ob_ref_parent (struct i8x_object *ob)
 {
-  if (ob == NULL)
-    return NULL;
-
-  ob->refcount[sense]++;
-
-  return ob;
+  if (ob != NULL)
+    STATE_ADD (ob->state, STATE_ONE_BACKREF);
 }
 
-static struct i8x_object *
-i8x_ob_unref_1 (struct i8x_object *ob, enum ref_sense_e sense)
+static void
+i8x_ob_unref_parent (struct i8x_object *ob)
 {
-  struct i8x_ctx *ctx;
+  if (ob != NULL)
+    STATE_SUB (ob->state, STATE_ONE_BACKREF);
+}
 
-  if (ob == NULL)
-    return NULL;
+/* Release OB, whose last reference has been dropped.  */
 
-  ob->refcount[sense]--;
-  if (ob->refcount[RS_FORWARD] > 0 || ob->is_moribund)
-    return NULL;
+static void
+i8x_ob_release (struct i8x_object *ob)
+{
+  struct i8x_slab *slab = NULL;
+  enum allocator_e allocator;
+  struct i8x_ctx *ctx;
 
-  ob->is_moribund = true;
+  allocator = STATE_ALLOCATOR (STATE_SET (ob->state, STATE_MORIBUND));
 
   if (ob->ops->unlink_fn != NULL)
     ob->ops->unlink_fn (ob);
 
-  ctx = i8x_ctx_ref (i8x_ob_get_ctx (ob));
-  ob->parent = i8x_ob_unref_parent (ob->parent);
+  ctx = i8x_ctx_ref (ob->ctx);
+  i8x_ob_unref_parent (ob->parent);
+  ob->parent = NULL;
 
-  if (ob->refcount[RS_BACK] > 0)
+  if (STATE_BACKREFS (STATE_LOAD (ob->state)) > 0)
     warn (ctx, "%s %p released with references\n", ob->ops->name, ob);
   else
     dbg (ctx, "%s %p released\n", ob->ops->name, ob);
 
+  /* The context outlives everything allocated from its slab, so
+     this remains valid after the reference is dropped.  */
+  if (allocator == AL_SLAB)
+    slab = i8x_ctx_get_slab (ctx);
+
   ctx = i8x_ctx_unref (ctx);
 
   if (ob->ops->free_fn != NULL)
     ob->ops->free_fn (ob);
-  free (ob);
 
-  return NULL;
+  if (allocator == AL_SLAB)
+    i8x_slab_free (slab, ob, ob->ops->size);
+  else if (allocator == AL_MALLOC)
+    free (ob);
 }
 
 /**
@@ -83,7 +139,12 @@ i8x_ob_unref_1 (struct i8x_object *ob, enum ref_sense_e sense)
 I8X_EXPORT struct i8x_object *
 i8x_ob_ref (struct i8x_object *ob)
 {
-  return i8x_ob_ref_1 (ob, RS_FORWARD);
+  if (ob == NULL)
+    return NULL;
+
+  STATE_ADD (ob->state, 1);
+
+  return ob;
 }
 
 /**
@@ -96,29 +157,45 @@ i8x_ob_ref (struct i8x_object *ob)
 I8X_EXPORT struct i8x_object *
 i8x_ob_unref (struct i8x_object *ob)
 {
-  return i8x_ob_unref_1 (ob, RS_FORWARD);
-}
+  uint64_t state;
 
-static struct i8x_object *
-i8x_ob_ref_parent (struct i8x_object *ob)
-{
-  return i8x_ob_ref_1 (ob, RS_BACK);
-}
+  if (ob == NULL)
+    return NULL;
 
-static struct i8x_object *
-i8x_ob_unref_parent (struct i8x_object *ob)
-{
-  return i8x_ob_unref_1 (ob, RS_BACK);
+  state = STATE_SUB (ob->state, 1);
+  if (STATE_REFCOUNT (state) > 0 || (state & STATE_MORIBUND))
+    return NULL;
+
+  i8x_ob_release (ob);
+
+  return NULL;
 }
 
-i8x_err_e
-i8x_ob_new (void *pp, const struct i8x_object_ops *ops, void *ob)
+static i8x_err_e
+i8x_ob_new_1 (void *pp, struct i8x_arena *arena,
+	      const struct i8x_object_ops *ops, void *ob)
 {
   struct i8x_object *parent = (struct i8x_object *) pp;
-  struct i8x_ctx *ctx = parent == NULL ? NULL : i8x_ob_get_ctx (parent);
+  struct i8x_ctx *ctx = parent == NULL ? NULL : parent->ctx;
+  enum allocator_e allocator;
   struct i8x_object *o;
 
-  o = calloc (1, ops->size);
+  if (arena != NULL)
+    {
+      o = i8x_arena_alloc (arena, ops->size);
+      allocator = AL_ARENA;
+    }
+  else if (ctx != NULL)
+    {
+      o = i8x_slab_alloc (i8x_ctx_get_slab (ctx), ops->size);
+      allocator = AL_SLAB;
+    }
+  else
+    {
+      o = calloc (1, ops->size);
+      allocator = AL_MALLOC;
+    }
+
   if (o == NULL)
     return i8x_out_of_memory (ctx);
 
@@ -126,13 +203,36 @@ i8x_ob_new (void *pp, const struct i8x_object_ops *ops, void *ob)
     dbg (ctx, "%s %p created\n", ops->name, o);
 
   o->ops = ops;
-  o->parent = i8x_ob_ref_parent (parent);
+  o->state = (uint64_t) allocator << STATE_ALLOCATOR_SHIFT;
+  o->parent = parent;
+  i8x_ob_ref_parent (parent);
+
+  /* Objects without parents are contexts.  */
+  o->ctx = ctx != NULL ? ctx : (struct i8x_ctx *) o;
 
   *(struct i8x_object **) ob = i8x_ob_ref (o);
 
   return I8X_OK;
 }
 
+i8x_err_e
+i8x_ob_new (void *parent, const struct i8x_object_ops *ops, void *ob)
+{
+  return i8x_ob_new_1 (parent, NULL, ops, ob);
+}
+
+/* Create an object whose memory comes from ARENA.  The memory is
+   not reused when the object is released, but when the arena is.
+   The caller must ensure the arena is not released while the object
+   is alive.  */
+
+i8x_err_e
+i8x_ob_new_in_arena (void *parent, struct i8x_arena *arena,
+		     const struct i8x_object_ops *ops, void *ob)
+{
+  return i8x_ob_new_1 (parent, arena, ops, ob);
+}
+
 struct i8x_object *
 i8x_ob_get_parent (struct i8x_object *ob)
 {
@@ -154,10 +254,7 @@ i8x_ob_get_ctx (struct i8x_object *ob)
   if (ob == NULL)
     return NULL;
 
-  while (ob->parent != NULL)
-    ob = ob->parent;
-
-  return (struct i8x_ctx *) ob;
+  return ob->ctx;
 }
 
 /**
@@ -186,5 +186,22 @@
 
 /* libi8x internal operations.  */
 #define I8X_OP_return			0x140
+#define I8X_OP_check_budget		0x141
+#define I8X_OP_check_budget_cold	0x142
+
+/* libi8x superinstructions, used by optimized code.  */
+#define I8X_OP_plus_lit			0x150
+#define I8X_OP_bra_eq			0x151
+#define I8X_OP_bra_ge			0x152
+#define I8X_OP_bra_gt			0x153
+#define I8X_OP_bra_le			0x154
+#define I8X_OP_bra_lt			0x155
+#define I8X_OP_bra_ne			0x156
+#define I8X_OP_bra_eq_lit		0x157
+#define I8X_OP_bra_ge_lit		0x158
+#define I8X_OP_bra_gt_lit		0x159
+#define I8X_OP_bra_le_lit		0x15a
+#define I8X_OP_bra_lt_lit		0x15b
+#define I8X_OP_bra_ne_lit		0x15c
 
 #endif /* _LIBI8X_OPCODES_H_ */
@@ -182,13 +182,26 @@ static struct i8x_idesc optable[] =
 
   /* 0x140..0x14f */
   {"I8X_OP_return"},
+  {"I8X_OP_check_budget"},
+  {"I8X_OP_check_budget_cold"},
+  {NULL}, {NULL}, {NULL}, {NULL}, {NULL},
+  {NULL}, {NULL}, {NULL}, {NULL}, {NULL}, {NULL}, {NULL}, {NULL},
+
+  /* 0x150..0x15f */
+  {"I8X_OP_plus_lit"},
+  {"I8X_OP_bra_eq"},
+  {"I8X_OP_bra_ge"},
+  {"I8X_OP_bra_gt"},
+  {"I8X_OP_bra_le"},
+  {"I8X_OP_bra_lt"},
+  {"I8X_OP_bra_ne"},
+  {"I8X_OP_bra_eq_lit"},
+  {"I8X_OP_bra_ge_lit"},
+  {"I8X_OP_bra_gt_lit"},
+  {"I8X_OP_bra_le_lit"},
+  {"I8X_OP_bra_lt_lit"},
+  {"I8X_OP_bra_ne_lit"},
 };
 
 #define NUM_OPCODES (sizeof (optable) / sizeof (struct i8x_idesc))
 #define MAX_OPCODE  (NUM_OPCODES - 1)
-
-size_t
-i8x_ctx_get_dispatch_table_size (struct i8x_ctx *ctx)
-{
-  return NUM_OPCODES;
-}
@@ -0,0 +1,313 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include <pthread.h>
+#include <string.h>
+#include "libi8x-private.h"
+#include "xctx-private.h"
+
+/* Each context has a pool of execution contexts that threads can
+   borrow.  Execution contexts are objects, so they can only be
+   created by the thread using the context: the pool is filled by
+   that thread, and other threads only ever borrow and return the
+   execution contexts it holds.  Borrowing and returning touch no
+   reference counts, so pools work without atomic reference
+   counts.  */
+
+struct i8x_pool
+{
+  I8X_OBJECT_FIELDS;
+
+  /* Every execution context in the pool, lent out or not.  */
+  struct i8x_list *xctxs;
+
+  pthread_mutex_t lock;		/* Protects everything below.  */
+
+  /* Execution contexts available to borrow.  The array has room
+     for every execution context in the pool.  */
+  struct i8x_xctx **available;
+  size_t num_available;
+  size_t size;
+
+  /* Key for each thread's default execution context.  */
+  pthread_key_t thread_key;
+  bool thread_key_created;
+};
+
+static void
+i8x_pool_unlink (struct i8x_object *ob)
+{
+  struct i8x_pool *pool = (struct i8x_pool *) ob;
+
+  /* Threads that exit after this keep their execution contexts,
+     which is fine because nothing can use them now.  */
+  if (pool->thread_key_created)
+    {
+      pthread_key_delete (pool->thread_key);
+      pool->thread_key_created = false;
+    }
+
+  pool->xctxs = i8x_list_unref (pool->xctxs);
+}
+
+static void
+i8x_pool_free (struct i8x_object *ob)
+{
+  struct i8x_pool *pool = (struct i8x_pool *) ob;
+
+  if (pool->available != NULL)
+    free (pool->available);
+
+  pthread_mutex_destroy (&pool->lock);
+}
+
+const struct i8x_object_ops i8x_pool_ops =
+  {
+    "pool",			/* Object name.  */
+    sizeof (struct i8x_pool),	/* Object size.  */
+    i8x_pool_unlink,		/* Unlink function.  */
+    i8x_pool_free,		/* Free function.  */
+  };
+
+i8x_err_e
+i8x_pool_new (struct i8x_ctx *ctx, struct i8x_pool **pool)
+{
+  struct i8x_pool *p;
+  i8x_err_e err;
+
+  err = i8x_ob_new (ctx, &i8x_pool_ops, &p);
+  if (err != I8X_OK)
+    return err;
+
+  pthread_mutex_init (&p->lock, NULL);
+
+  err = i8x_list_new (ctx, true, &p->xctxs);
+  if (err != I8X_OK)
+    {
+      p = i8x_pool_unref (p);
+
+      return err;
+    }
+
+  *pool = p;
+
+  return I8X_OK;
+}
+
+/* Return XCTX to POOL.  */
+
+static void
+i8x_pool_put (struct i8x_pool *pool, struct i8x_xctx *xctx)
+{
+  pthread_mutex_lock (&pool->lock);
+  i8x_assert (pool->num_available < pool->size);
+  pool->available[pool->num_available++] = xctx;
+  pthread_mutex_unlock (&pool->lock);
+}
+
+/* Reset XCTX's settings to the defaults and return it to its
+   context's pool, so whoever borrows it next starts afresh.  */
+
+static void
+i8x_pool_reset_and_put (struct i8x_xctx *xctx)
+{
+  struct i8x_ctx *ctx = i8x_xctx_get_ctx (xctx);
+
+  i8x_assert (xctx->call_depth == 0);
+
+  xctx->use_debug_interpreter =
+    i8x_ctx_get_use_debug_interpreter_default (ctx);
+  i8x_xctx_set_fuel (xctx, I8X_FUEL_UNLIMITED);
+  i8x_xctx_set_deadline (xctx, NULL);
+  i8x_xctx_clear_cancel (xctx);
+
+  i8x_pool_put (i8x_ctx_get_pool (ctx), xctx);
+}
+
+/* Called when a thread with a default execution context exits.  */
+
+static void
+i8x_pool_thread_exit (void *arg)
+{
+  i8x_pool_reset_and_put (arg);
+}
+
+/**
+ * i8x_ctx_fill_xctx_pool:
+ * @ctx: i8x library context
+ * @num_xctxs: number of execution contexts to add to the pool
+ * @stack_slots: size of each one's stack, as for i8x_xctx_new
+ *
+ * Add execution contexts to @ctx's pool, for threads to borrow with
+ * i8x_ctx_acquire_xctx or i8x_ctx_get_thread_xctx.  Their stacks are
+ * allocated and touched now, so borrowing one neither allocates
+ * memory nor faults in pages.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_ctx_fill_xctx_pool (struct i8x_ctx *ctx, size_t num_xctxs,
+			size_t stack_slots)
+{
+  struct i8x_pool *pool = i8x_ctx_get_pool (ctx);
+  struct i8x_xctx **available;
+  size_t i;
+
+  if (!pool->thread_key_created)
+    {
+      if (pthread_key_create (&pool->thread_key,
+			      i8x_pool_thread_exit) != 0)
+	return i8x_out_of_memory (ctx);
+
+      pool->thread_key_created = true;
+    }
+
+  pthread_mutex_lock (&pool->lock);
+  available = realloc (pool->available,
+		       (pool->size + num_xctxs) * sizeof (*available));
+  if (available != NULL)
+    pool->available = available;
+  pthread_mutex_unlock (&pool->lock);
+
+  if (available == NULL)
+    return i8x_out_of_memory (ctx);
+
+  for (i = 0; i < num_xctxs; i++)
+    {
+      struct i8x_xctx *xctx;
+      i8x_err_e err;
+
+      err = i8x_xctx_new (ctx, stack_slots, &xctx);
+      if (err != I8X_OK)
+	return err;
+
+      /* Touch every page of the stack now, rather than on the
+	 first deep call made by whichever thread borrows it.  */
+      memset (xctx->stack_base, 0,
+	      (xctx->stack_limit - xctx->stack_base)
+	      * sizeof (union i8x_value));
+
+      /* The pool's list owns the reference from now on.  */
+      err = i8x_list_append_xctx (pool->xctxs, xctx);
+      i8x_xctx_unref (xctx);
+      if (err != I8X_OK)
+	return err;
+
+      pthread_mutex_lock (&pool->lock);
+      pool->size++;
+      pthread_mutex_unlock (&pool->lock);
+
+      i8x_pool_put (pool, xctx);
+    }
+
+  return I8X_OK;
+}
+
+/**
+ * i8x_ctx_acquire_xctx:
+ * @ctx: i8x library context
+ * @xctx: location to store the execution context
+ *
+ * Borrow an execution context from @ctx's pool.  The caller does not
+ * own a reference to it, and must return it with
+ * i8x_ctx_release_xctx when finished.  This function may be called
+ * from any thread.  It does not record errors in @ctx.
+ *
+ * Returns: I8X_OK on success, or I8X_EAGAIN if every execution
+ * context in the pool is lent out.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_ctx_acquire_xctx (struct i8x_ctx *ctx, struct i8x_xctx **xctx)
+{
+  struct i8x_pool *pool = i8x_ctx_get_pool (ctx);
+  i8x_err_e err = I8X_EAGAIN;
+
+  pthread_mutex_lock (&pool->lock);
+  if (pool->num_available > 0)
+    {
+      *xctx = pool->available[--pool->num_available];
+      err = I8X_OK;
+    }
+  pthread_mutex_unlock (&pool->lock);
+
+  return err;
+}
+
+/**
+ * i8x_ctx_release_xctx:
+ * @ctx: i8x library context
+ * @xctx: the execution context
+ *
+ * Return an execution context borrowed with i8x_ctx_acquire_xctx
+ * to @ctx's pool.  Its interpreter selection, execution budget and
+ * deadline are reset to the defaults, and it is uncancelled.  This
+ * function may be called from any thread.
+ **/
+I8X_EXPORT void
+i8x_ctx_release_xctx (struct i8x_ctx *ctx, struct i8x_xctx *xctx)
+{
+  i8x_assert (i8x_xctx_get_ctx (xctx) == ctx);
+
+  i8x_pool_reset_and_put (xctx);
+}
+
+/**
+ * i8x_ctx_get_thread_xctx:
+ * @ctx: i8x library context
+ * @xctx: location to store the execution context
+ *
+ * Get the calling thread's default execution context for @ctx.  The
+ * first call on each thread borrows one from @ctx's pool, which is
+ * returned to the pool when the thread exits, reset as by
+ * i8x_ctx_release_xctx.  The caller does not
+ * own a reference to it.  This function may be called from any
+ * thread.  It does not record errors in @ctx.
+ *
+ * Returns: I8X_OK on success, or I8X_EAGAIN if every execution
+ * context in the pool is lent out.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_ctx_get_thread_xctx (struct i8x_ctx *ctx, struct i8x_xctx **xctx)
+{
+  struct i8x_pool *pool = i8x_ctx_get_pool (ctx);
+  struct i8x_xctx *x;
+  i8x_err_e err;
+
+  if (!pool->thread_key_created)
+    return I8X_EAGAIN;
+
+  x = pthread_getspecific (pool->thread_key);
+  if (x == NULL)
+    {
+      err = i8x_ctx_acquire_xctx (ctx, &x);
+      if (err != I8X_OK)
+	return err;
+
+      if (pthread_setspecific (pool->thread_key, x) != 0)
+	{
+	  i8x_ctx_release_xctx (ctx, x);
+
+	  return I8X_ENOMEM;
+	}
+    }
+
+  *xctx = x;
+
+  return I8X_OK;
+}
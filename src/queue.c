@@ -0,0 +1,403 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "libi8x-private.h"
+
+/* The queue compiles functions on a background thread.  As with
+   i8x_ctx_register_notes, only compilation happens off the calling
+   thread: functions are created when their notes are queued, and
+   registered when the caller processes the queue.  The worker never
+   touches reference counts, so the objects it handles are owned by
+   the jobs that hold them.  */
+
+struct i8x_job
+{
+  struct i8x_job *next;
+
+  struct i8x_func *func;	/* The function to compile.  */
+  struct i8x_error_sink error;	/* The result of compiling it.  */
+};
+
+/* A singly linked list of jobs with O(1) append.  */
+
+struct i8x_jobs
+{
+  struct i8x_job *head;
+  struct i8x_job **tail;
+};
+
+struct i8x_queue
+{
+  I8X_OBJECT_FIELDS;
+
+  pthread_mutex_t lock;		/* Protects everything below.  */
+  pthread_cond_t work_ready;	/* Signalled when jobs are added.  */
+  pthread_cond_t work_done;	/* Signalled when a job completes.  */
+
+  pthread_t worker;		/* The worker thread.  */
+  bool worker_started;		/* True if the above is valid.  */
+  bool shutdown;		/* True if the worker should exit.  */
+
+  struct i8x_jobs pending;	/* Jobs not yet started.  */
+  struct i8x_jobs done;		/* Jobs completed but not processed.  */
+  size_t num_outstanding;	/* Jobs queued but not yet completed.  */
+
+  int eventfd;			/* Readable when done is not empty.  */
+};
+
+static void
+i8x_jobs_init (struct i8x_jobs *jobs)
+{
+  jobs->head = NULL;
+  jobs->tail = &jobs->head;
+}
+
+static void
+i8x_jobs_append (struct i8x_jobs *jobs, struct i8x_job *job)
+{
+  job->next = NULL;
+  *jobs->tail = job;
+  jobs->tail = &job->next;
+}
+
+static struct i8x_job *
+i8x_jobs_pop (struct i8x_jobs *jobs)
+{
+  struct i8x_job *job = jobs->head;
+
+  if (job != NULL)
+    {
+      jobs->head = job->next;
+      if (jobs->head == NULL)
+	jobs->tail = &jobs->head;
+    }
+
+  return job;
+}
+
+static void
+i8x_job_compile (struct i8x_job *job)
+{
+  struct i8x_error_sink *old_sink;
+
+  old_sink = i8x_ctx_set_error_sink (&job->error);
+  job->error.code = i8x_func_compile (job->func);
+  i8x_ctx_set_error_sink (old_sink);
+}
+
+static void
+i8x_job_free (struct i8x_job *job)
+{
+  i8x_func_unref (job->func);
+  free (job);
+}
+
+static void
+i8x_queue_signal_eventfd (struct i8x_queue *queue)
+{
+  uint64_t one = 1;
+  ssize_t n;
+
+  n = write (queue->eventfd, &one, sizeof (one));
+  i8x_assert (n == sizeof (one));
+}
+
+static void
+i8x_queue_clear_eventfd (struct i8x_queue *queue)
+{
+  uint64_t count;
+
+  /* This fails with EAGAIN if nothing was signalled.  */
+  if (read (queue->eventfd, &count, sizeof (count)) < 0)
+    i8x_assert (errno == EAGAIN);
+}
+
+static void *
+i8x_queue_worker (void *arg)
+{
+  struct i8x_queue *queue = arg;
+
+  pthread_mutex_lock (&queue->lock);
+
+  while (!queue->shutdown)
+    {
+      struct i8x_job *job = i8x_jobs_pop (&queue->pending);
+
+      if (job == NULL)
+	{
+	  pthread_cond_wait (&queue->work_ready, &queue->lock);
+	  continue;
+	}
+
+      pthread_mutex_unlock (&queue->lock);
+      i8x_job_compile (job);
+      pthread_mutex_lock (&queue->lock);
+
+      i8x_jobs_append (&queue->done, job);
+      queue->num_outstanding--;
+
+      pthread_cond_broadcast (&queue->work_done);
+      i8x_queue_signal_eventfd (queue);
+    }
+
+  pthread_mutex_unlock (&queue->lock);
+
+  return NULL;
+}
+
+static void
+i8x_queue_unlink (struct i8x_object *ob)
+{
+  struct i8x_queue *queue = (struct i8x_queue *) ob;
+  struct i8x_job *job;
+
+  if (queue->worker_started)
+    {
+      pthread_mutex_lock (&queue->lock);
+      queue->shutdown = true;
+      pthread_cond_signal (&queue->work_ready);
+      pthread_mutex_unlock (&queue->lock);
+
+      pthread_join (queue->worker, NULL);
+      queue->worker_started = false;
+    }
+
+  while ((job = i8x_jobs_pop (&queue->pending)) != NULL)
+    i8x_job_free (job);
+
+  while ((job = i8x_jobs_pop (&queue->done)) != NULL)
+    i8x_job_free (job);
+}
+
+static void
+i8x_queue_free (struct i8x_object *ob)
+{
+  struct i8x_queue *queue = (struct i8x_queue *) ob;
+
+  if (queue->eventfd >= 0)
+    close (queue->eventfd);
+
+  pthread_cond_destroy (&queue->work_done);
+  pthread_cond_destroy (&queue->work_ready);
+  pthread_mutex_destroy (&queue->lock);
+}
+
+const struct i8x_object_ops i8x_queue_ops =
+  {
+    "queue",			/* Object name.  */
+    sizeof (struct i8x_queue),	/* Object size.  */
+    i8x_queue_unlink,		/* Unlink function.  */
+    i8x_queue_free,		/* Free function.  */
+  };
+
+i8x_err_e
+i8x_queue_new (struct i8x_ctx *ctx, struct i8x_queue **queue)
+{
+  struct i8x_queue *q;
+  i8x_err_e err;
+
+  err = i8x_ob_new (ctx, &i8x_queue_ops, &q);
+  if (err != I8X_OK)
+    return err;
+
+  pthread_mutex_init (&q->lock, NULL);
+  pthread_cond_init (&q->work_ready, NULL);
+  pthread_cond_init (&q->work_done, NULL);
+
+  i8x_jobs_init (&q->pending);
+  i8x_jobs_init (&q->done);
+
+  q->eventfd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (q->eventfd < 0)
+    {
+      q = i8x_queue_unref (q);
+
+      return i8x_ctx_set_error (ctx, I8X_EIO, NULL, NULL);
+    }
+
+  *queue = q;
+
+  return I8X_OK;
+}
+
+/**
+ * i8x_ctx_enqueue_note:
+ * @ctx: i8x library context
+ * @note: the note to create a function from
+ *
+ * Create a function from @note and queue it to be compiled by a
+ * background thread.  Compiled functions are registered by
+ * i8x_ctx_process_queue, so the function does not become available
+ * until that is called.  The context's log function may be called
+ * from the background thread.
+ *
+ * Errors in the note's signature and externals are reported by
+ * this function.  Errors in its bytecode are reported by
+ * i8x_ctx_process_queue.
+ *
+ * Returns: I8X_OK on success, or an error code.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_ctx_enqueue_note (struct i8x_ctx *ctx, struct i8x_note *note)
+{
+  struct i8x_queue *queue;
+  struct i8x_job *job;
+  i8x_err_e err;
+
+  err = i8x_ctx_get_queue (ctx, &queue);
+  if (err != I8X_OK)
+    return err;
+
+  /* Start logging now, so the worker doesn't race to do it.  */
+  i8x_ctx_start_logging (ctx);
+
+  job = calloc (1, sizeof (struct i8x_job));
+  if (job == NULL)
+    return i8x_out_of_memory (ctx);
+
+  err = i8x_func_new_uncompiled (note, &job->func);
+  if (err != I8X_OK)
+    {
+      free (job);
+
+      return err;
+    }
+
+  pthread_mutex_lock (&queue->lock);
+
+  if (!queue->worker_started
+      && pthread_create (&queue->worker, NULL,
+			 i8x_queue_worker, queue) == 0)
+    queue->worker_started = true;
+
+  if (queue->worker_started)
+    {
+      i8x_jobs_append (&queue->pending, job);
+      queue->num_outstanding++;
+      pthread_cond_signal (&queue->work_ready);
+    }
+  else
+    {
+      /* We couldn't start the worker, so compile it here.  */
+      i8x_job_compile (job);
+      i8x_jobs_append (&queue->done, job);
+      i8x_queue_signal_eventfd (queue);
+    }
+
+  pthread_mutex_unlock (&queue->lock);
+
+  return I8X_OK;
+}
+
+/**
+ * i8x_ctx_process_queue:
+ * @ctx: i8x library context
+ * @wait: whether to wait for every queued note to be compiled
+ *
+ * Register every function the background thread has finished
+ * compiling, in the order their notes were queued, as a single
+ * update.  Availability observers are called from this function,
+ * on the calling thread.
+ * If @wait is true, this function first waits for every queued note
+ * to be compiled.
+ *
+ * Functions whose bytecode was rejected are discarded.  Every other
+ * compiled function is registered even if some were rejected.
+ *
+ * Returns: I8X_OK on success, or the error of the first function
+ * that was rejected.
+ **/
+I8X_EXPORT i8x_err_e
+i8x_ctx_process_queue (struct i8x_ctx *ctx, bool wait)
+{
+  struct i8x_queue *queue;
+  struct i8x_jobs done;
+  struct i8x_job *job;
+  i8x_err_e result = I8X_OK;
+  i8x_err_e err;
+
+  err = i8x_ctx_get_queue (ctx, &queue);
+  if (err != I8X_OK)
+    return err;
+
+  pthread_mutex_lock (&queue->lock);
+
+  if (wait)
+    while (queue->num_outstanding > 0)
+      pthread_cond_wait (&queue->work_done, &queue->lock);
+
+  done = queue->done;
+  if (done.head == NULL)
+    done.tail = &done.head;
+  i8x_jobs_init (&queue->done);
+  i8x_queue_clear_eventfd (queue);
+
+  pthread_mutex_unlock (&queue->lock);
+
+  i8x_ctx_begin_update (ctx);
+
+  while ((job = i8x_jobs_pop (&done)) != NULL)
+    {
+      struct i8x_error_sink *error = &job->error;
+
+      if (error->code == I8X_OK)
+	err = i8x_ctx_register_func (ctx, job->func);
+      else
+	{
+	  err = error->code;
+
+	  if (result == I8X_OK)
+	    i8x_ctx_set_error (ctx, error->code, error->note, error->ptr);
+	}
+
+      if (err != I8X_OK && result == I8X_OK)
+	result = err;
+
+      i8x_job_free (job);
+    }
+
+  i8x_ctx_commit_update (ctx);
+
+  return result;
+}
+
+/**
+ * i8x_ctx_get_queue_fd:
+ * @ctx: i8x library context
+ *
+ * Get a file descriptor that becomes readable when functions are
+ * waiting to be registered by i8x_ctx_process_queue.  The caller
+ * should not read from or close it.
+ *
+ * Returns: a file descriptor, or -1 on error.
+ **/
+I8X_EXPORT int
+i8x_ctx_get_queue_fd (struct i8x_ctx *ctx)
+{
+  struct i8x_queue *queue;
+
+  if (i8x_ctx_get_queue (ctx, &queue) != I8X_OK)
+    return -1;
+
+  return queue->eventfd;
+}
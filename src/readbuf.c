@@ -18,17 +18,18 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include <byteswap.h>
+#include <endian.h>
+#include <string.h>
 #include "libi8x-private.h"
 
+/* Public read buffers are reference-counted wrappers around the
+   cursors the library uses internally.  */
+
 struct i8x_readbuf
 {
   I8X_OBJECT_FIELDS;
 
-  i8x_byte_order_e byte_order;	/* Byte order for multibyte values.  */
-
-  const char *start;	/* Pointer to first byte of buffer.  */
-  const char *limit;	/* Pointer to byte after last byte of buffer.  */
-  const char *ptr;	/* Pointer to next byte to be read.  */
+  struct i8x_rbcursor cur;	/* The underlying cursor.  */
 };
 
 const struct i8x_object_ops i8x_readbuf_ops =
@@ -39,225 +40,405 @@ const struct i8x_object_ops i8x_readbuf_ops =
     NULL,				/* Free function.  */
   };
 
-static i8x_err_e
-i8x_rb_new (struct i8x_note *note,
-	    const char *buf, size_t bufsiz,
-	    struct i8x_readbuf **rb)
+static void
+i8x_rbc_init (struct i8x_rbcursor *cur, struct i8x_note *note,
+	      const char *buf, size_t bufsiz)
 {
-  struct i8x_readbuf *b;
-  i8x_err_e err;
-
-  err = i8x_ob_new (note, &i8x_readbuf_ops, &b);
-  if (err != I8X_OK)
-    return err;
-
-  b->start = b->ptr = buf;
-  b->limit = buf + bufsiz;
-
-  *rb = b;
-
-  return I8X_OK;
+  cur->note = note;
+  cur->byte_order = I8X_BYTE_ORDER_UNKNOWN;
+  cur->start = cur->ptr = buf;
+  cur->limit = buf + bufsiz;
 }
 
-I8X_EXPORT i8x_err_e
-i8x_rb_new_from_note (struct i8x_note *note, struct i8x_readbuf **rb)
+void
+i8x_rbc_init_from_note (struct i8x_rbcursor *cur, struct i8x_note *note)
 {
-  return i8x_rb_new (note, i8x_note_get_encoded (note),
-		     i8x_note_get_encoded_size (note), rb);
+  i8x_rbc_init (cur, note, i8x_note_get_encoded (note),
+		i8x_note_get_encoded_size (note));
 }
 
-I8X_EXPORT i8x_err_e
-i8x_rb_new_from_chunk (struct i8x_chunk *chunk, struct i8x_readbuf **rb)
+void
+i8x_rbc_init_from_chunk (struct i8x_rbcursor *cur,
+			 struct i8x_chunk *chunk)
 {
-  return i8x_rb_new (i8x_chunk_get_note (chunk),
-		     i8x_chunk_get_encoded (chunk),
-		     i8x_chunk_get_encoded_size (chunk), rb);
+  i8x_rbc_init (cur, i8x_chunk_get_note (chunk),
+		i8x_chunk_get_encoded (chunk),
+		i8x_chunk_get_encoded_size (chunk));
 }
 
-I8X_EXPORT struct i8x_note *
-i8x_rb_get_note (struct i8x_readbuf *rb)
-{
-  return (struct i8x_note *)
-    i8x_ob_get_parent ((struct i8x_object *) rb);
-}
-
-I8X_EXPORT i8x_byte_order_e
-i8x_rb_get_byte_order (struct i8x_readbuf *rb)
-{
-  return rb->byte_order;
-}
-
-I8X_EXPORT void
-i8x_rb_set_byte_order (struct i8x_readbuf *rb, i8x_byte_order_e order)
-{
-  rb->byte_order = order;
-}
-
-const char *
-i8x_rb_get_ptr (struct i8x_readbuf *rb)
-{
-  return rb->ptr;
-}
-
-I8X_EXPORT size_t
-i8x_rb_bytes_left (struct i8x_readbuf *rb)
-{
-  return rb->limit - rb->ptr;
-}
-
-I8X_EXPORT i8x_err_e
-i8x_rb_read_byte_order_mark (struct i8x_readbuf *rb)
+i8x_err_e
+i8x_rbc_read_byte_order_mark (struct i8x_rbcursor *cur)
 {
-  const char *saved_ptr = rb->ptr;
-  i8x_byte_order_e saved_order = rb->byte_order;
-  uint16_t new_order;
+  const char *saved_ptr = cur->ptr;
+  i8x_byte_order_e saved_order = cur->byte_order;
+  uint16_t new_order = I8X_BYTE_ORDER_UNKNOWN;
   i8x_err_e err;
 
-  rb->byte_order = I8X_BYTE_ORDER_STANDARD;
-  err = i8x_rb_read_uint16_t (rb, &new_order);
-  rb->byte_order = saved_order;
+  cur->byte_order = I8X_BYTE_ORDER_STANDARD;
+  err = i8x_rbc_read_uint16_t (cur, &new_order);
+  cur->byte_order = saved_order;
   if (err != I8X_OK)
     return err;
 
   if (new_order != I8X_BYTE_ORDER_STANDARD
       && new_order != I8X_BYTE_ORDER_REVERSED)
-    return i8x_rb_error (rb, I8X_NOTE_INVALID, saved_ptr);
+    return i8x_rbc_error (cur, I8X_NOTE_INVALID, saved_ptr);
 
-  rb->byte_order = new_order;
+  cur->byte_order = new_order;
 
   return I8X_OK;
 }
 
-#define CHECK_HAS_BYTES(rb, n)					\
+#define CHECK_HAS_BYTES(cur, n)					\
   do {								\
-    if (i8x_rb_bytes_left (rb) < (n))				\
-      return i8x_rb_error (rb, I8X_NOTE_CORRUPT, (rb)->ptr);	\
+    if (i8x_rbc_bytes_left (cur) < (n))				\
+      return i8x_rbc_error (cur, I8X_NOTE_CORRUPT, (cur)->ptr);	\
   } while (0)
 
-I8X_EXPORT i8x_err_e
-i8x_rb_read_int8_t (struct i8x_readbuf *rb, int8_t *result)
+i8x_err_e
+i8x_rbc_read_int8_t (struct i8x_rbcursor *cur, int8_t *result)
 {
-  CHECK_HAS_BYTES (rb, sizeof (int8_t));
+  CHECK_HAS_BYTES (cur, sizeof (int8_t));
 
-  *result = *(uint8_t *) rb->ptr;
-  rb->ptr += sizeof (int8_t);
+  *result = *(uint8_t *) cur->ptr;
+  cur->ptr += sizeof (int8_t);
 
   return I8X_OK;
 }
 
-I8X_EXPORT i8x_err_e
-i8x_rb_read_uint8_t (struct i8x_readbuf *rb, uint8_t *result)
+i8x_err_e
+i8x_rbc_read_uint8_t (struct i8x_rbcursor *cur, uint8_t *result)
 {
-  CHECK_HAS_BYTES (rb, sizeof (uint8_t));
+  CHECK_HAS_BYTES (cur, sizeof (uint8_t));
 
-  *result = *(uint8_t *) rb->ptr;
-  rb->ptr += sizeof (uint8_t);
+  *result = *(uint8_t *) cur->ptr;
+  cur->ptr += sizeof (uint8_t);
 
   return I8X_OK;
 }
 
-#define I8X_RB_READ_FIXED_MULTI_1(TYPE, BSWAP)				\
-  I8X_EXPORT i8x_err_e							\
-  i8x_rb_read_ ## TYPE (struct i8x_readbuf *rb, TYPE *result)		\
+#define I8X_RBC_READ_FIXED_MULTI_1(TYPE, BSWAP)				\
+  i8x_err_e								\
+  i8x_rbc_read_ ## TYPE (struct i8x_rbcursor *cur, TYPE *result)	\
   {									\
     TYPE tmp;								\
 									\
-    CHECK_HAS_BYTES (rb, sizeof (TYPE));				\
+    CHECK_HAS_BYTES (cur, sizeof (TYPE));				\
 									\
-    tmp = *(TYPE *) rb->ptr;						\
-    rb->ptr += sizeof (TYPE);						\
+    memcpy (&tmp, cur->ptr, sizeof (TYPE));				\
+    cur->ptr += sizeof (TYPE);						\
 									\
-    if (rb->byte_order == I8X_BYTE_ORDER_REVERSED)			\
+    if (cur->byte_order == I8X_BYTE_ORDER_REVERSED)			\
       tmp = BSWAP (tmp);						\
     else								\
-      i8x_assert (rb->byte_order == I8X_BYTE_ORDER_STANDARD);		\
+      i8x_assert (cur->byte_order == I8X_BYTE_ORDER_STANDARD);		\
 									\
     *result = tmp;							\
 									\
     return I8X_OK;							\
   }
 
-#define I8X_RB_READ_FIXED_MULTI(SIZE)					\
-  I8X_RB_READ_FIXED_MULTI_1 (int ## SIZE ## _t, bswap_ ## SIZE)		\
-  I8X_RB_READ_FIXED_MULTI_1 (uint ## SIZE ## _t, bswap_ ## SIZE)
+#define I8X_RBC_READ_FIXED_MULTI(SIZE)					\
+  I8X_RBC_READ_FIXED_MULTI_1 (int ## SIZE ## _t, bswap_ ## SIZE)	\
+  I8X_RBC_READ_FIXED_MULTI_1 (uint ## SIZE ## _t, bswap_ ## SIZE)
 
-I8X_RB_READ_FIXED_MULTI (16)
-I8X_RB_READ_FIXED_MULTI (32)
-I8X_RB_READ_FIXED_MULTI (64)
+I8X_RBC_READ_FIXED_MULTI (16)
+I8X_RBC_READ_FIXED_MULTI (32)
+I8X_RBC_READ_FIXED_MULTI (64)
 
-I8X_EXPORT i8x_err_e
-i8x_rb_read_sleb128 (struct i8x_readbuf *rb, intmax_t *rp)
+/* The longest LEB128 encoding of a value that fits in uintmax_t.  */
+#define LEB128_MAX_BYTES ((sizeof (uintmax_t) * 8 + 6) / 7)
+
+/* Gather the low seven bits of each of the first NBYTES bytes of
+   WORD (which must be at most eight) into a single value.  WORD is
+   little-endian, so the first byte of the encoding is in its least
+   significant byte.  */
+
+static inline uint64_t __attribute__ ((always_inline))
+leb128_compact (uint64_t word, unsigned int nbytes)
 {
-  i8x_not_implemented ();
+  uint64_t x = word & 0x7f7f7f7f7f7f7f7fULL;
+
+  if (nbytes < 8)
+    x &= (UINT64_C (1) << (nbytes * 8)) - 1;
+
+  x = (x & 0x007f007f007f007fULL) | ((x & 0x7f007f007f007f00ULL) >> 1);
+  x = (x & 0x00003fff00003fffULL) | ((x & 0x3fff00003fff0000ULL) >> 2);
+  x = (x & 0x000000000fffffffULL) | ((x & 0x0fffffff00000000ULL) >> 4);
+
+  return x;
 }
 
-I8X_EXPORT i8x_err_e
-i8x_rb_read_uleb128 (struct i8x_readbuf *rb, uintmax_t *rp)
+/* Decode one LEB128 value starting at *PTRP, reading no further
+   than LIMIT.  On success *PTRP is advanced past the encoding,
+   *RESULT holds the decoded bits and *SHIFT holds the number of
+   bits the encoding contained.  Returns I8X_NOTE_CORRUPT if the
+   encoding is not terminated before LIMIT, and I8X_NOTE_UNHANDLED
+   if it does not fit in uintmax_t.  The caller is responsible for
+   sign extension and for setting the error.  */
+
+static inline i8x_err_e __attribute__ ((always_inline))
+leb128_decode (const char **ptrp, const char *limit, bool is_signed,
+	       uintmax_t *result, unsigned int *shift)
 {
-  uintmax_t result = 0;
-  int shift = 0;
+  const uint8_t *ptr = (const uint8_t *) *ptrp;
+  uintmax_t value = 0;
+  unsigned int nbytes;
+  uint8_t byte;
+
+  /* Fast path: one unaligned load finds the terminating byte of any
+     encoding of up to eight bytes, and the payload is gathered with
+     a fixed sequence of masks and shifts.  */
+  if (__i8x_likely ((size_t) (limit - *ptrp) >= sizeof (uint64_t)))
+    {
+      uint64_t word, stops;
+
+      memcpy (&word, ptr, sizeof (word));
+      word = le64toh (word);
+
+      stops = ~word & 0x8080808080808080ULL;
+      if (__i8x_likely (stops != 0))
+	{
+	  nbytes = (__builtin_ctzll (stops) >> 3) + 1;
 
-  while (1)
+	  *result = leb128_compact (word, nbytes);
+	  *shift = nbytes * 7;
+	  *ptrp += nbytes;
+
+	  return I8X_OK;
+	}
+
+      /* Nine or more bytes.  The first eight are all continuation
+	 bytes, so take them in one go and finish off bytewise.  */
+      value = leb128_compact (word, 8);
+      nbytes = 8;
+    }
+  else
+    nbytes = 0;
+
+  /* Slow path: short buffers, and the tail of long encodings.  */
+  do
     {
-      uint8_t byte;
-      int err;
+      if (__i8x_unlikely ((const char *) ptr + nbytes >= limit))
+	return I8X_NOTE_CORRUPT;
+
+      if (__i8x_unlikely (nbytes == LEB128_MAX_BYTES))
+	return I8X_NOTE_UNHANDLED;
 
-      err = i8x_rb_read_uint8_t (rb, &byte);
-      if (err != I8X_OK)
-	return err;
+      byte = ptr[nbytes];
 
-      result |= ((byte & 127) << shift);
+      if (nbytes == LEB128_MAX_BYTES - 1)
+	{
+	  /* The final byte holds the top bit of the value.  For
+	     signed values the rest of its payload must be a copy
+	     of that bit; for unsigned values it must be zero.  */
+	  uint8_t payload = byte & 0x7f;
 
-      if ((byte & 128) == 0)
-	break;
+	  if (!(payload == 0
+		|| (is_signed ? payload == 0x7f : payload == 1)))
+	    return I8X_NOTE_UNHANDLED;
+	}
 
-      shift += 7;
+      value |= (uintmax_t) (byte & 0x7f) << (nbytes * 7);
+      nbytes++;
     }
+  while (byte & 0x80);
+
+  *result = value;
+  *shift = nbytes * 7;
+  *ptrp = (const char *) ptr + nbytes;
+
+  return I8X_OK;
+}
+
+i8x_err_e
+i8x_rbc_read_sleb128 (struct i8x_rbcursor *cur, intmax_t *rp)
+{
+  const char *start = cur->ptr;
+  unsigned int shift;
+  uintmax_t result;
+  i8x_err_e err;
+
+  err = leb128_decode (&cur->ptr, cur->limit, true, &result, &shift);
+  if (__i8x_unlikely (err != I8X_OK))
+    return i8x_rbc_error (cur, err, start);
+
+  /* Sign extend.  */
+  if (shift < sizeof (uintmax_t) * 8
+      && (result & ((uintmax_t) 1 << (shift - 1))) != 0)
+    result |= UINTMAX_MAX << shift;
+
+  *rp = (intmax_t) result;
+
+  return I8X_OK;
+}
+
+i8x_err_e
+i8x_rbc_read_uleb128 (struct i8x_rbcursor *cur, uintmax_t *rp)
+{
+  const char *start = cur->ptr;
+  unsigned int shift;
+  uintmax_t result;
+  i8x_err_e err;
+
+  err = leb128_decode (&cur->ptr, cur->limit, false, &result, &shift);
+  if (__i8x_unlikely (err != I8X_OK))
+    return i8x_rbc_error (cur, err, start);
 
   *rp = result;
 
   return I8X_OK;
 }
 
-I8X_EXPORT i8x_err_e
-i8x_rb_read_bytes (struct i8x_readbuf *rb, size_t nbytes,
-		   const char **result)
+i8x_err_e
+i8x_rbc_read_bytes (struct i8x_rbcursor *cur, size_t nbytes,
+		    const char **result)
 {
-  CHECK_HAS_BYTES (rb, nbytes);
+  CHECK_HAS_BYTES (cur, nbytes);
 
-  *result = rb->ptr;
-  rb->ptr += nbytes;
+  *result = cur->ptr;
+  cur->ptr += nbytes;
 
   return I8X_OK;
 }
 
 i8x_err_e
-i8x_rb_read_funcref (struct i8x_readbuf *rb, struct i8x_funcref **ref)
+i8x_rbc_read_funcref (struct i8x_rbcursor *cur, struct i8x_funcref **ref)
 {
   const char *provider, *name, *ptypes, *rtypes;
-  struct i8x_note *note;
   i8x_err_e err;
 
-  err = i8x_rb_read_offset_string (rb, &provider);
+  err = i8x_rbc_read_offset_string (cur, &provider);
   if (err != I8X_OK)
     return err;
 
-  err = i8x_rb_read_offset_string (rb, &name);
+  err = i8x_rbc_read_offset_string (cur, &name);
   if (err != I8X_OK)
     return err;
 
-  err = i8x_rb_read_offset_string (rb, &ptypes);
+  err = i8x_rbc_read_offset_string (cur, &ptypes);
   if (err != I8X_OK)
     return err;
 
-  err = i8x_rb_read_offset_string (rb, &rtypes);
+  err = i8x_rbc_read_offset_string (cur, &rtypes);
   if (err != I8X_OK)
     return err;
 
-  note = i8x_rb_get_note (rb);
-  err = i8x_ctx_get_funcref_with_note (i8x_note_get_ctx (note),
+  err = i8x_ctx_get_funcref_with_note (i8x_note_get_ctx (cur->note),
 				       provider, name, ptypes,
-				       rtypes, note, ref);
+				       rtypes, cur->note, ref);
 
   return err;
 }
+
+/* Public API.  */
+
+static i8x_err_e
+i8x_rb_new (struct i8x_note *note, struct i8x_readbuf **rb)
+{
+  struct i8x_readbuf *b;
+  i8x_err_e err;
+
+  err = i8x_ob_new (note, &i8x_readbuf_ops, &b);
+  if (err != I8X_OK)
+    return err;
+
+  *rb = b;
+
+  return I8X_OK;
+}
+
+I8X_EXPORT i8x_err_e
+i8x_rb_new_from_note (struct i8x_note *note, struct i8x_readbuf **rb)
+{
+  i8x_err_e err;
+
+  err = i8x_rb_new (note, rb);
+  if (err == I8X_OK)
+    i8x_rbc_init_from_note (&(*rb)->cur, note);
+
+  return err;
+}
+
+I8X_EXPORT i8x_err_e
+i8x_rb_new_from_chunk (struct i8x_chunk *chunk, struct i8x_readbuf **rb)
+{
+  i8x_err_e err;
+
+  err = i8x_rb_new (i8x_chunk_get_note (chunk), rb);
+  if (err == I8X_OK)
+    i8x_rbc_init_from_chunk (&(*rb)->cur, chunk);
+
+  return err;
+}
+
+I8X_EXPORT struct i8x_note *
+i8x_rb_get_note (struct i8x_readbuf *rb)
+{
+  return rb->cur.note;
+}
+
+I8X_EXPORT i8x_byte_order_e
+i8x_rb_get_byte_order (struct i8x_readbuf *rb)
+{
+  return i8x_rbc_get_byte_order (&rb->cur);
+}
+
+I8X_EXPORT void
+i8x_rb_set_byte_order (struct i8x_readbuf *rb, i8x_byte_order_e order)
+{
+  i8x_rbc_set_byte_order (&rb->cur, order);
+}
+
+I8X_EXPORT size_t
+i8x_rb_bytes_left (struct i8x_readbuf *rb)
+{
+  return i8x_rbc_bytes_left (&rb->cur);
+}
+
+I8X_EXPORT i8x_err_e
+i8x_rb_read_byte_order_mark (struct i8x_readbuf *rb)
+{
+  return i8x_rbc_read_byte_order_mark (&rb->cur);
+}
+
+#define I8X_RB_READ_1(TYPE)						\
+  I8X_EXPORT i8x_err_e							\
+  i8x_rb_read_ ## TYPE (struct i8x_readbuf *rb, TYPE *result)		\
+  {									\
+    return i8x_rbc_read_ ## TYPE (&rb->cur, result);			\
+  }
+
+#define I8X_RB_READ(SIZE)						\
+  I8X_RB_READ_1 (int ## SIZE ## _t)					\
+  I8X_RB_READ_1 (uint ## SIZE ## _t)
+
+I8X_RB_READ (8)
+I8X_RB_READ (16)
+I8X_RB_READ (32)
+I8X_RB_READ (64)
+
+I8X_EXPORT i8x_err_e
+i8x_rb_read_sleb128 (struct i8x_readbuf *rb, intmax_t *result)
+{
+  return i8x_rbc_read_sleb128 (&rb->cur, result);
+}
+
+I8X_EXPORT i8x_err_e
+i8x_rb_read_uleb128 (struct i8x_readbuf *rb, uintmax_t *result)
+{
+  return i8x_rbc_read_uleb128 (&rb->cur, result);
+}
+
+I8X_EXPORT i8x_err_e
+i8x_rb_read_bytes (struct i8x_readbuf *rb, size_t nbytes,
+		   const char **result)
+{
+  return i8x_rbc_read_bytes (&rb->cur, nbytes, result);
+}
+
+I8X_EXPORT i8x_err_e
+i8x_rb_read_offset_string (struct i8x_readbuf *rb, const char **result)
+{
+  return i8x_rbc_read_offset_string (&rb->cur, result);
+}
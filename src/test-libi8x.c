@@ -32,19 +32,14 @@ int
 main (int argc, char *argv[])
 {
   struct i8x_ctx *ctx;
-  struct i8x_thing *thing = NULL;
   int err;
 
-  err = i8x_new (&ctx);
+  err = i8x_ctx_new (&ctx);
   if (err < 0)
     exit (EXIT_FAILURE);
 
   printf ("version %s\n", VERSION);
 
-  err = i8x_thing_new_from_string (ctx, "foo", &thing);
-  if (err >= 0)
-    i8x_thing_unref (thing);
-
-  i8x_unref (ctx);
+  i8x_ctx_unref (ctx);
   return EXIT_SUCCESS;
 }
@@ -45,7 +45,7 @@ i8x_note_error (struct i8x_note *note, i8x_err_e code, const char *ptr)
 }
 
 i8x_err_e
-i8x_rb_error (struct i8x_readbuf *rb, i8x_err_e code, const char *ptr)
+i8x_rbc_error (struct i8x_rbcursor *cur, i8x_err_e code, const char *ptr)
 {
-  return i8x_note_error (i8x_rb_get_note (rb), code, ptr);
+  return i8x_note_error (cur->note, code, ptr);
 }
@@ -283,6 +283,12 @@ i8x_code_validate (struct i8x_code *code)
       STACK(0) = i8x_listitem_get_type (li);
     }
 
+  /* Every operation the validator accepts depends only on the
+     stack, so all valid code is pure.  Operations that read memory
+     or externals, or that call other functions, must clear this
+     when they are added.  */
+  code->is_pure = true;
+
   /* Walk the code.  */
   i8x_code_reset_is_visited (code);
   err = i8x_code_validate_1 (code, op, stack, stack_limit, stack_ptr);
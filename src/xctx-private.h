@@ -22,6 +22,27 @@
 
 #include <i8x/libi8x.h>
 
+/* A segment of an execution context's stack.  Each segment is
+   mapped separately, with an inaccessible guard page at either end.
+   Segments are pushed when a call needs more stack than the current
+   segment has left, and popped when that call returns.  Popped
+   segments stay mapped to be pushed again by the next deep call.  */
+
+struct i8x_stack_segment
+{
+  struct i8x_stack_segment *prev;	/* The caller's segment.  */
+  struct i8x_stack_segment *next;	/* The next segment, if mapped.  */
+
+  union i8x_value *base, *limit;	/* Usable slots.  */
+
+  void *map;				/* The mapping, including guards.  */
+  size_t mapsize;
+
+  /* The caller's stack pointers, restored when this segment is
+     popped.  */
+  union i8x_value *caller_vsp, *caller_csp;
+};
+
 /* Execution context.  */
 
 struct i8x_xctx
@@ -31,15 +52,20 @@ struct i8x_xctx
   /* If true, use the interpreter with assertions etc.  */
   bool use_debug_interpreter;
 
-  /* Magic fields used by i8x_ctx_init_dispatch_table to get the
+  /* Magic fields used by i8x_init_dispatch_table to get the
      interpreters to emit their dispatch tables.  */
   void **dispatch_table_to_init;
   size_t dispatch_table_size;
 
   /* Execution stack.  Actually two stacks in one: the value stack
      grows upwards from stack_base, and the call stack grows down
-     from stack_limit.  */
+     from stack_limit.  These are the limits of the current segment,
+     which is stack.  */
   union i8x_value *stack_base, *stack_limit;
+  struct i8x_stack_segment *stack;
+
+  /* Total size of every segment mapped for this context.  */
+  size_t stack_slots;
 
   /* The slot after the last slot in the value stack.
      Slots in the value stack are stack_base <= SLOT < vsp.
@@ -49,6 +75,73 @@ struct i8x_xctx
   /* The "top" slot in the call stack.
      Slots in the call stack are csp <= SLOT < stack_limit.  */
   union i8x_value *csp;
+
+  /* The context's resolution epoch, so calls can read it without
+     a function call.  */
+  const uint64_t *ctx_epoch;
+
+  /* The context's resolution epoch when the outermost call in
+     progress started, or 0 if no call is in progress.  This is
+     written by the thread making calls and read by the thread
+     updating the context.  */
+  uint64_t call_epoch;
+
+  /* Nesting depth of calls in progress.  */
+  unsigned int call_depth;
+
+  /* Execution budget.  Backward branches spend fuel, and call
+     i8x_xctx_refuel when it runs out.  fuel_reserve is the budget
+     remaining beyond fuel, or I8X_FUEL_UNLIMITED.  */
+  int64_t fuel;
+  uint64_t fuel_reserve;
+
+  /* Deadline, in nanoseconds on CLOCK_MONOTONIC, or 0 if none.  */
+  uint64_t deadline;
+
+  /* Nonzero if calls using this context have been cancelled.  This
+     may be written by any thread, or by a signal handler.  */
+  int cancelled;
 };
 
+/* Return XCTX's context's resolution epoch.  */
+
+static inline uint64_t __attribute__ ((always_inline))
+i8x_xctx_get_ctx_epoch (struct i8x_xctx *xctx)
+{
+  return __atomic_load_n (xctx->ctx_epoch, __ATOMIC_SEQ_CST);
+}
+
+/* Return true if calls using XCTX have been cancelled.  */
+
+static inline bool __attribute__ ((always_inline))
+i8x_xctx_is_cancelled (struct i8x_xctx *xctx)
+{
+  return __atomic_load_n (&xctx->cancelled, __ATOMIC_RELAXED);
+}
+
+/* Record that a call is starting.  Functions retired by updates to
+   the context after this point are not released until the matching
+   i8x_xctx_end_call.  */
+
+static inline void __attribute__ ((always_inline))
+i8x_xctx_begin_call (struct i8x_xctx *xctx)
+{
+  if (xctx->call_depth++ == 0)
+    __atomic_store_n (&xctx->call_epoch, i8x_xctx_get_ctx_epoch (xctx),
+		      __ATOMIC_SEQ_CST);
+}
+
+/* Record that a call has finished.  */
+
+static inline void __attribute__ ((always_inline))
+i8x_xctx_end_call (struct i8x_xctx *xctx)
+{
+  if (--xctx->call_depth == 0)
+    __atomic_store_n (&xctx->call_epoch, 0, __ATOMIC_RELEASE);
+}
+
+bool i8x_xctx_push_stack (struct i8x_xctx *xctx, size_t nslots);
+void i8x_xctx_pop_stack (struct i8x_xctx *xctx);
+i8x_err_e i8x_xctx_refuel (struct i8x_xctx *xctx);
+
 #endif /* _XCTX_PRIVATE_H_ */
@@ -17,27 +17,198 @@
    License along with the Infinity Note Execution Library; if not, see
    <http://www.gnu.org/licenses/>.  */
 
+#include <unistd.h>
+#include <sys/mman.h>
 #include "libi8x-private.h"
 #include "xctx-private.h"
 
+/* The most stack an execution context may map, in slots.  Calls
+   that would need more than this fail with I8X_STACK_OVERFLOW.  */
+#define MAX_STACK_SLOTS (1 << 20)
+
+/* How much fuel may be spent between reads of the clock when a
+   deadline is set.  */
+#define DEADLINE_CHECK_INTERVAL 4096
+
+/* Map a stack segment with room for at least NSLOTS slots.  The
+   segment is rounded up to a whole number of pages, and the pages
+   either side of it are left inaccessible so that overruns fault
+   rather than corrupting memory.  Returns NULL if out of memory.  */
+
+static struct i8x_stack_segment *
+i8x_stack_segment_new (size_t nslots)
+{
+  size_t pagesize = sysconf (_SC_PAGESIZE);
+  size_t size = nslots * sizeof (union i8x_value);
+  struct i8x_stack_segment *seg;
+  char *map;
+
+  size = (size + pagesize - 1) & ~(pagesize - 1);
+  if (size == 0)
+    size = pagesize;
+
+  seg = calloc (1, sizeof (struct i8x_stack_segment));
+  if (seg == NULL)
+    return NULL;
+
+  seg->mapsize = size + 2 * pagesize;
+  map = mmap (NULL, seg->mapsize, PROT_NONE,
+	      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    {
+      free (seg);
+
+      return NULL;
+    }
+  seg->map = map;
+
+  if (mprotect (map + pagesize, size, PROT_READ | PROT_WRITE) != 0)
+    {
+      munmap (map, seg->mapsize);
+      free (seg);
+
+      return NULL;
+    }
+
+  seg->base = (union i8x_value *) (map + pagesize);
+  seg->limit = seg->base + size / sizeof (union i8x_value);
+
+  return seg;
+}
+
+/* Unmap SEG and every segment after it.  */
+
+static void
+i8x_stack_segment_free_chain (struct i8x_stack_segment *seg)
+{
+  while (seg != NULL)
+    {
+      struct i8x_stack_segment *next = seg->next;
+
+      munmap (seg->map, seg->mapsize);
+      free (seg);
+
+      seg = next;
+    }
+}
+
+/* Switch XCTX's current segment to SEG.  */
+
+static void
+i8x_xctx_set_stack (struct i8x_xctx *xctx, struct i8x_stack_segment *seg)
+{
+  xctx->stack = seg;
+
+  xctx->stack_base = seg->base;
+  xctx->stack_limit = seg->limit;
+}
+
+/* Switch XCTX to a stack segment with at least NSLOTS free slots,
+   mapping one if necessary.  Each new segment is at least twice the
+   size of the one before, so deep recursion maps few segments.  The
+   caller must call i8x_xctx_pop_stack when its call returns.  This
+   is called by the interpreter, so may be called on any thread, and
+   does not record errors.  Returns false if the segment could not
+   be mapped.  */
+
+bool
+i8x_xctx_push_stack (struct i8x_xctx *xctx, size_t nslots)
+{
+  struct i8x_stack_segment *seg = xctx->stack;
+  struct i8x_stack_segment *next = seg->next;
+
+  if (next == NULL || (size_t) (next->limit - next->base) < nslots)
+    {
+      size_t size = 2 * (seg->limit - seg->base);
+
+      if (size < nslots)
+	size = nslots;
+
+      /* Segments after this one are too small for this call, so
+	 they'd be too small for calls that can only reach them by
+	 way of this call's segment.  */
+      if (next != NULL)
+	{
+	  for (struct i8x_stack_segment *s = next; s != NULL; s = s->next)
+	    xctx->stack_slots -= s->limit - s->base;
+
+	  i8x_stack_segment_free_chain (next);
+	  seg->next = NULL;
+	}
+
+      if (size > MAX_STACK_SLOTS - xctx->stack_slots)
+	return false;
+
+      next = i8x_stack_segment_new (size);
+      if (next == NULL)
+	return false;
+
+      next->prev = seg;
+      seg->next = next;
+
+      xctx->stack_slots += next->limit - next->base;
+    }
+
+  next->caller_vsp = xctx->vsp;
+  next->caller_csp = xctx->csp;
+
+  i8x_xctx_set_stack (xctx, next);
+
+  xctx->vsp = xctx->stack_base;
+  xctx->csp = xctx->stack_limit;
+
+  return true;
+}
+
+/* Switch XCTX back to the segment it was using before the matching
+   i8x_xctx_push_stack.  */
+
+void
+i8x_xctx_pop_stack (struct i8x_xctx *xctx)
+{
+  struct i8x_stack_segment *seg = xctx->stack;
+
+  i8x_assert (seg->prev != NULL);
+
+  xctx->vsp = seg->caller_vsp;
+  xctx->csp = seg->caller_csp;
+
+  i8x_xctx_set_stack (xctx, seg->prev);
+}
+
 static i8x_err_e
 i8x_xctx_init (struct i8x_xctx *xctx, size_t nslots)
 {
   struct i8x_ctx *ctx = i8x_xctx_get_ctx (xctx);
+  struct i8x_stack_segment *seg;
 
   xctx->use_debug_interpreter =
     i8x_ctx_get_use_debug_interpreter_default (ctx);
+  xctx->ctx_epoch = i8x_ctx_get_epoch_location (ctx);
+  xctx->fuel_reserve = I8X_FUEL_UNLIMITED;
+
+  if (nslots > MAX_STACK_SLOTS)
+    nslots = MAX_STACK_SLOTS;
 
-  xctx->stack_base = calloc (nslots, sizeof (union i8x_value));
-  if (xctx->stack_base == NULL)
+  seg = i8x_stack_segment_new (nslots);
+  if (seg == NULL)
     return i8x_out_of_memory (ctx);
 
-  xctx->stack_limit = xctx->stack_base + nslots;
+  i8x_xctx_set_stack (xctx, seg);
+  xctx->stack_slots = seg->limit - seg->base;
 
   xctx->vsp = xctx->stack_base;
   xctx->csp = xctx->stack_limit;
 
-  return I8X_OK;
+  return i8x_ctx_add_xctx (ctx, xctx);
+}
+
+static void
+i8x_xctx_unlink (struct i8x_object *ob)
+{
+  struct i8x_xctx *xctx = (struct i8x_xctx *) ob;
+
+  i8x_ctx_forget_xctx (xctx);
 }
 
 static void
@@ -45,15 +216,14 @@ i8x_xctx_free (struct i8x_object *ob)
 {
   struct i8x_xctx *xctx = (struct i8x_xctx *) ob;
 
-  if (xctx->stack_base != NULL)
-    free (xctx->stack_base);
+  i8x_stack_segment_free_chain (xctx->stack);
 }
 
 const struct i8x_object_ops i8x_xctx_ops =
   {
     "xctx",			/* Object name.  */
     sizeof (struct i8x_xctx),	/* Object size.  */
-    NULL,			/* Unlink function.  */
+    i8x_xctx_unlink,		/* Unlink function.  */
     i8x_xctx_free,		/* Free function.  */
   };
 
@@ -96,3 +266,171 @@ i8x_xctx_set_use_debug_interpreter (struct i8x_xctx *xctx,
 {
   xctx->use_debug_interpreter = use_debug_interpreter;
 }
+
+/**
+ * i8x_xctx_get_fuel:
+ * @xctx: the execution context
+ *
+ * Get the execution budget @xctx has left.
+ *
+ * Returns: The remaining budget, or I8X_FUEL_UNLIMITED.
+ **/
+I8X_EXPORT uint64_t
+i8x_xctx_get_fuel (struct i8x_xctx *xctx)
+{
+  if (xctx->fuel_reserve == I8X_FUEL_UNLIMITED)
+    return I8X_FUEL_UNLIMITED;
+
+  return xctx->fuel_reserve + (xctx->fuel > 0 ? xctx->fuel : 0);
+}
+
+/**
+ * i8x_xctx_set_fuel:
+ * @xctx: the execution context
+ * @fuel: the budget, or I8X_FUEL_UNLIMITED
+ *
+ * Limit how much bytecode calls using @xctx may execute.  Each time
+ * bytecode branches backwards the instructions from the branch
+ * target to the branch are charged against the budget, so functions
+ * without loops are never stopped.  Calls that exhaust the budget
+ * return I8X_FUEL_EXHAUSTED, as do any further calls that loop,
+ * until the budget is set again.  The budget is shared by every call
+ * using @xctx, including nested calls, and is not reset between
+ * calls.  Budgets are unlimited by default.
+ **/
+I8X_EXPORT void
+i8x_xctx_set_fuel (struct i8x_xctx *xctx, uint64_t fuel)
+{
+  xctx->fuel_reserve = fuel;
+  xctx->fuel = 0;
+}
+
+/**
+ * i8x_xctx_set_deadline:
+ * @xctx: the execution context
+ * @deadline: absolute time on CLOCK_MONOTONIC, or NULL
+ *
+ * Stop calls using @xctx that loop past @deadline.  The clock is
+ * read when bytecode branches backwards, but not every time, so
+ * calls may overrun slightly.  Calls stopped return
+ * I8X_DEADLINE_EXCEEDED.  Passing NULL removes the deadline.
+ **/
+I8X_EXPORT void
+i8x_xctx_set_deadline (struct i8x_xctx *xctx,
+		       const struct timespec *deadline)
+{
+  uint64_t fuel = i8x_xctx_get_fuel (xctx);
+
+  if (deadline == NULL)
+    xctx->deadline = 0;
+  else
+    {
+      xctx->deadline = deadline->tv_sec * UINT64_C (1000000000)
+		       + deadline->tv_nsec;
+
+      /* Zero means no deadline.  */
+      if (xctx->deadline == 0)
+	xctx->deadline = 1;
+    }
+
+  /* Make the next backward branch read the clock.  */
+  i8x_xctx_set_fuel (xctx, fuel);
+}
+
+/**
+ * i8x_xctx_cancel:
+ * @xctx: the execution context
+ *
+ * Cancel calls using @xctx.  Bytecode polls for cancellation when
+ * it branches backwards and when it is called, and cancelled calls
+ * unwind and return I8X_CANCELLED.  Calls made after this also fail,
+ * until i8x_xctx_clear_cancel is called.  This function may be
+ * called from any thread, and is async-signal-safe.
+ **/
+I8X_EXPORT void
+i8x_xctx_cancel (struct i8x_xctx *xctx)
+{
+  __atomic_store_n (&xctx->cancelled, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * i8x_xctx_clear_cancel:
+ * @xctx: the execution context
+ *
+ * Allow calls using @xctx again after i8x_xctx_cancel.  This
+ * function may be called from any thread, and is
+ * async-signal-safe.
+ **/
+I8X_EXPORT void
+i8x_xctx_clear_cancel (struct i8x_xctx *xctx)
+{
+  __atomic_store_n (&xctx->cancelled, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Called by the interpreter when a backward branch leaves XCTX's
+   fuel negative, or finds XCTX has been cancelled.  Charge the
+   overspend to the reserve, check the deadline, and refill.  On
+   failure XCTX's fuel is left at zero, so the next backward branch
+   will fail too unless the budget or deadline have been changed.  */
+
+i8x_err_e
+i8x_xctx_refuel (struct i8x_xctx *xctx)
+{
+  uint64_t overspend = -xctx->fuel;
+  uint64_t refill = INT64_MAX;
+
+  if (i8x_xctx_is_cancelled (xctx))
+    return I8X_CANCELLED;
+
+  /* We were cancelled, but not any more.  */
+  if (xctx->fuel >= 0)
+    return I8X_OK;
+
+  xctx->fuel = 0;
+
+  if (xctx->fuel_reserve != I8X_FUEL_UNLIMITED)
+    {
+      if (overspend > xctx->fuel_reserve)
+	{
+	  xctx->fuel_reserve = 0;
+
+	  return I8X_FUEL_EXHAUSTED;
+	}
+
+      xctx->fuel_reserve -= overspend;
+    }
+
+  if (xctx->deadline != 0)
+    {
+      struct timespec now;
+
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      if (now.tv_sec * UINT64_C (1000000000) + now.tv_nsec
+	  >= xctx->deadline)
+	return I8X_DEADLINE_EXCEEDED;
+
+      refill = DEADLINE_CHECK_INTERVAL;
+    }
+
+  if (xctx->fuel_reserve != I8X_FUEL_UNLIMITED)
+    {
+      if (refill > xctx->fuel_reserve)
+	refill = xctx->fuel_reserve;
+
+      xctx->fuel_reserve -= refill;
+    }
+
+  xctx->fuel = refill;
+
+  return I8X_OK;
+}
+
+/* Return the resolution epoch XCTX's outermost call in progress
+   started in, or 0 if XCTX is not making a call.  This may be
+   called from any thread.  */
+
+uint64_t
+i8x_xctx_get_call_epoch (struct i8x_xctx *xctx)
+{
+  return __atomic_load_n (&xctx->call_epoch, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,179 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* Test execution budgets and deadlines, and that execution contexts
+   returned to the pool, explicitly or by a thread exiting, have
+   them reset.  The factorial loops once for each number it
+   multiplies, so it can be stopped by either.  */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "testutil.h"
+
+#define STACK_SLOTS 512
+
+static struct i8x_ctx *ctx;
+static struct i8x_funcref *factorial;
+
+static void
+check_ifact_fails (struct i8x_xctx *xctx, intptr_t x, i8x_err_e expected)
+{
+  intptr_t result;
+
+  CHECK (test_call_ifact (xctx, factorial, x, &result) == expected);
+}
+
+static void
+set_deadline (struct i8x_xctx *xctx, time_t offset)
+{
+  struct timespec deadline;
+
+  CHECK (clock_gettime (CLOCK_MONOTONIC, &deadline) == 0);
+  deadline.tv_sec += offset;
+  i8x_xctx_set_deadline (xctx, &deadline);
+}
+
+/* Leave XCTX unable to make calls that loop.  */
+
+static void
+exhaust (struct i8x_xctx *xctx)
+{
+  i8x_xctx_set_fuel (xctx, 0);
+  set_deadline (xctx, -1);
+}
+
+static void
+test_fuel (struct i8x_xctx *xctx)
+{
+  uint64_t fuel;
+
+  CHECK (i8x_xctx_get_fuel (xctx) == I8X_FUEL_UNLIMITED);
+
+  i8x_xctx_set_fuel (xctx, 5);
+  check_ifact_fails (xctx, 20, I8X_FUEL_EXHAUSTED);
+  CHECK (i8x_xctx_get_fuel (xctx) == 0);
+
+  /* Further calls that loop fail too.  */
+  check_ifact_fails (xctx, 20, I8X_FUEL_EXHAUSTED);
+
+  /* Setting a budget makes the context usable again.  */
+  i8x_xctx_set_fuel (xctx, 1000000);
+  test_check_ifact (xctx, factorial, 20);
+  fuel = i8x_xctx_get_fuel (xctx);
+  CHECK (fuel < 1000000);
+  test_check_ifact (xctx, factorial, 20);
+  CHECK (i8x_xctx_get_fuel (xctx) < fuel);
+
+  i8x_xctx_set_fuel (xctx, I8X_FUEL_UNLIMITED);
+  test_check_ifact (xctx, factorial, 20);
+  CHECK (i8x_xctx_get_fuel (xctx) == I8X_FUEL_UNLIMITED);
+}
+
+static void
+test_deadline (struct i8x_xctx *xctx)
+{
+  set_deadline (xctx, -1);
+  check_ifact_fails (xctx, 20, I8X_DEADLINE_EXCEEDED);
+  check_ifact_fails (xctx, 20, I8X_DEADLINE_EXCEEDED);
+
+  set_deadline (xctx, 3600);
+  test_check_ifact (xctx, factorial, 20);
+
+  i8x_xctx_set_deadline (xctx, NULL);
+  test_check_ifact (xctx, factorial, 20);
+
+  /* Whichever limit is reached first stops the call.  */
+  i8x_xctx_set_fuel (xctx, 5);
+  set_deadline (xctx, 3600);
+  check_ifact_fails (xctx, 20, I8X_FUEL_EXHAUSTED);
+
+  i8x_xctx_set_fuel (xctx, I8X_FUEL_UNLIMITED);
+  set_deadline (xctx, -1);
+  check_ifact_fails (xctx, 20, I8X_DEADLINE_EXCEEDED);
+
+  i8x_xctx_set_deadline (xctx, NULL);
+  test_check_ifact (xctx, factorial, 20);
+}
+
+/* Exhaust this thread's default execution context and exit.  */
+
+static void *
+exhaust_thread_xctx (void *arg)
+{
+  struct i8x_xctx *xctx;
+
+  CHECK_OK (i8x_ctx_get_thread_xctx (ctx, &xctx));
+  *(struct i8x_xctx **) arg = xctx;
+
+  exhaust (xctx);
+  check_ifact_fails (xctx, 20, I8X_FUEL_EXHAUSTED);
+
+  return NULL;
+}
+
+/* The pool holds a single execution context, so every borrower
+   gets the one the previous borrower returned.  */
+
+static void
+test_pool (void)
+{
+  struct i8x_xctx *xctx, *thread_xctx;
+  pthread_t thread;
+
+  CHECK_OK (i8x_ctx_fill_xctx_pool (ctx, 1, STACK_SLOTS));
+
+  CHECK_OK (i8x_ctx_acquire_xctx (ctx, &xctx));
+  test_fuel (xctx);
+  test_deadline (xctx);
+
+  exhaust (xctx);
+  i8x_ctx_release_xctx (ctx, xctx);
+
+  CHECK_OK (i8x_ctx_acquire_xctx (ctx, &xctx));
+  CHECK (i8x_xctx_get_fuel (xctx) == I8X_FUEL_UNLIMITED);
+  test_check_ifact (xctx, factorial, 20);
+  i8x_ctx_release_xctx (ctx, xctx);
+
+  /* Threads' default execution contexts are reset when the thread
+     exits, too.  */
+  CHECK (pthread_create (&thread, NULL, exhaust_thread_xctx,
+			 &thread_xctx) == 0);
+  CHECK (pthread_join (thread, NULL) == 0);
+
+  CHECK_OK (i8x_ctx_acquire_xctx (ctx, &xctx));
+  CHECK (xctx == thread_xctx);
+  CHECK (i8x_xctx_get_fuel (xctx) == I8X_FUEL_UNLIMITED);
+  test_check_ifact (xctx, factorial, 20);
+  i8x_ctx_release_xctx (ctx, xctx);
+}
+
+int
+main (int argc, char *argv[])
+{
+  ctx = test_ctx_new ();
+  factorial = test_load_ifact (ctx, NULL);
+
+  test_pool ();
+
+  i8x_funcref_unref (factorial);
+  i8x_ctx_unref (ctx);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,202 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* Test cancelling calls from another thread.  This looks inside
+   the execution context to check that cancelled calls leave its
+   stack as they found it, including when the call had to switch to
+   a new stack segment.  The factorial of a huge number loops until
+   it is cancelled.  */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "libi8x-private.h"
+#include "xctx-private.h"
+#include "testutil.h"
+
+#define STACK_SLOTS 512
+
+static struct i8x_ctx *ctx;
+static struct i8x_funcref *factorial;
+
+struct looper
+{
+  struct i8x_xctx *xctx;
+  i8x_err_e result;
+};
+
+static void *
+loop_until_cancelled (void *arg)
+{
+  struct looper *l = arg;
+  intptr_t result;
+
+  l->result = test_call_ifact (l->xctx, factorial, INTPTR_MAX, &result);
+
+  return NULL;
+}
+
+/* Start a call on XCTX on another thread, wait until it is using a
+   stack segment other than SEGMENT, or just until it has started if
+   SEGMENT is NULL, cancel it, and return its result.  */
+
+static i8x_err_e
+cancel_call (struct i8x_xctx *xctx, struct i8x_stack_segment *segment)
+{
+  struct looper l;
+  pthread_t thread;
+
+  l.xctx = xctx;
+  l.result = I8X_OK;
+  CHECK (pthread_create (&thread, NULL, loop_until_cancelled, &l) == 0);
+
+  if (segment != NULL)
+    while (__atomic_load_n (&xctx->stack, __ATOMIC_RELAXED) == segment)
+      sched_yield ();
+  else
+    while (__atomic_load_n (&xctx->call_depth, __ATOMIC_RELAXED) == 0)
+      sched_yield ();
+
+  i8x_xctx_cancel (xctx);
+  CHECK (pthread_join (thread, NULL) == 0);
+
+  return l.result;
+}
+
+/* Cancel a call that had to push a stack segment, and check the
+   segment is popped and the stack pointers restored.  */
+
+static void
+test_pushed_segment (void)
+{
+  struct i8x_stack_segment *first;
+  union i8x_value *vsp, *csp;
+  struct i8x_xctx *xctx;
+  int i;
+
+  CHECK_OK (i8x_xctx_new (ctx, STACK_SLOTS, &xctx));
+  first = xctx->stack;
+
+  /* Pretend a caller has used all but one slot of the first
+     segment, so the factorial needs a new one.  */
+  xctx->vsp = xctx->csp - 1;
+  vsp = xctx->vsp;
+  csp = xctx->csp;
+
+  /* Twice, so the second call reuses the segment the first one
+     mapped.  */
+  for (i = 0; i < 2; i++)
+    {
+      CHECK (cancel_call (xctx, first) == I8X_CANCELLED);
+      CHECK (xctx->stack == first);
+      CHECK (first->next != NULL);
+      CHECK (xctx->stack_base == first->base);
+      CHECK (xctx->stack_limit == first->limit);
+      CHECK (xctx->vsp == vsp);
+      CHECK (xctx->csp == csp);
+      CHECK (xctx->call_depth == 0);
+
+      /* Calls fail until the cancellation is cleared.  */
+      CHECK (test_call_ifact (xctx, factorial, 5, NULL) == I8X_CANCELLED);
+      CHECK (xctx->vsp == vsp);
+      CHECK (xctx->csp == csp);
+
+      i8x_xctx_clear_cancel (xctx);
+      test_check_ifact (xctx, factorial, 20);
+      CHECK (xctx->stack == first);
+      CHECK (xctx->vsp == vsp);
+      CHECK (xctx->csp == csp);
+    }
+
+  xctx->vsp = xctx->stack_base;
+  i8x_xctx_unref (xctx);
+}
+
+/* Cancel a call using an execution context from the pool.  */
+
+static void
+test_pooled (void)
+{
+  struct i8x_xctx *xctx;
+  union i8x_value *vsp, *csp;
+
+  CHECK_OK (i8x_ctx_fill_xctx_pool (ctx, 1, STACK_SLOTS));
+  CHECK_OK (i8x_ctx_acquire_xctx (ctx, &xctx));
+  vsp = xctx->vsp;
+  csp = xctx->csp;
+
+  CHECK (cancel_call (xctx, NULL) == I8X_CANCELLED);
+  CHECK (xctx->vsp == vsp);
+  CHECK (xctx->csp == csp);
+
+  /* Returning it to the pool clears the cancellation.  */
+  i8x_ctx_release_xctx (ctx, xctx);
+  CHECK_OK (i8x_ctx_acquire_xctx (ctx, &xctx));
+  test_check_ifact (xctx, factorial, 20);
+  i8x_ctx_release_xctx (ctx, xctx);
+}
+
+/* Cancel this thread's default execution context and exit.  */
+
+static void *
+cancel_thread_xctx (void *arg)
+{
+  struct i8x_xctx *xctx;
+
+  CHECK_OK (i8x_ctx_get_thread_xctx (ctx, &xctx));
+  *(struct i8x_xctx **) arg = xctx;
+
+  i8x_xctx_cancel (xctx);
+  CHECK (test_call_ifact (xctx, factorial, 5, NULL) == I8X_CANCELLED);
+
+  return NULL;
+}
+
+static void
+test_thread_exit (void)
+{
+  struct i8x_xctx *xctx, *thread_xctx;
+  pthread_t thread;
+
+  CHECK (pthread_create (&thread, NULL, cancel_thread_xctx,
+			 &thread_xctx) == 0);
+  CHECK (pthread_join (thread, NULL) == 0);
+
+  CHECK_OK (i8x_ctx_acquire_xctx (ctx, &xctx));
+  CHECK (xctx == thread_xctx);
+  test_check_ifact (xctx, factorial, 20);
+  i8x_ctx_release_xctx (ctx, xctx);
+}
+
+int
+main (int argc, char *argv[])
+{
+  ctx = test_ctx_new ();
+  factorial = test_load_ifact (ctx, NULL);
+
+  test_pushed_segment ();
+  test_pooled ();
+  test_thread_exit ();
+
+  i8x_funcref_unref (factorial);
+  i8x_ctx_unref (ctx);
+
+  return EXIT_SUCCESS;
+}
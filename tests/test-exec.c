@@ -0,0 +1,309 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* Test the parallel executor: that results come back in the order
+   of the calls whichever worker made them, that the first failing
+   call's error is the one reported, that idle workers steal calls,
+   and that executors may be nested.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "testutil.h"
+
+#define NUM_WORKERS 4
+#define NUM_CALLS 256
+#define STACK_SLOTS 512
+
+static struct i8x_ctx *ctx;
+static struct i8x_funcref *factorial;
+static struct i8x_funcref *work;
+static struct i8x_funcref *slow;
+static struct i8x_funcref *nested;
+static struct i8x_exec *inner_exec;
+
+/* Native test::work(i)i returns twice its argument, or fails with
+   its argument as the error code if it is negative.  */
+
+static i8x_err_e
+do_work (struct i8x_xctx *xctx, struct i8x_inferior *inf,
+	 union i8x_value *args, union i8x_value *rets)
+{
+  if (args[0].i < 0)
+    return (i8x_err_e) args[0].i;
+
+  rets[0].i = args[0].i * 2;
+
+  return I8X_OK;
+}
+
+/* Native test::slow(i)i is test::work(i)i, but takes a while.  */
+
+static i8x_err_e
+do_slow (struct i8x_xctx *xctx, struct i8x_inferior *inf,
+	 union i8x_value *args, union i8x_value *rets)
+{
+  usleep (1000);
+
+  return do_work (xctx, inf, args, rets);
+}
+
+/* Native test::nested(i)i returns the factorial of its argument,
+   computed by a batch on INNER_EXEC, then cancels its caller's
+   execution context so that the caller's next call fails.  */
+
+static i8x_err_e
+do_nested (struct i8x_xctx *xctx, struct i8x_inferior *inf,
+	   union i8x_value *args, union i8x_value *rets)
+{
+  struct i8x_call call;
+  i8x_err_e err;
+
+  memset (&call, 0, sizeof (call));
+  call.ref = factorial;
+  call.args = args;
+  call.rets = rets;
+
+  err = i8x_exec_run (inner_exec, &call, 1);
+  if (err != I8X_OK)
+    return err;
+
+  i8x_xctx_cancel (xctx);
+
+  return I8X_OK;
+}
+
+static void
+register_natives (void)
+{
+  CHECK_OK (i8x_ctx_register_native_func (ctx, "test", "work", "i", "i",
+					  do_work));
+  CHECK_OK (i8x_ctx_register_native_func (ctx, "test", "slow", "i", "i",
+					  do_slow));
+  CHECK_OK (i8x_ctx_register_native_func (ctx, "test", "nested", "i",
+					  "i", do_nested));
+
+  CHECK_OK (i8x_ctx_get_funcref (ctx, "test", "work", "i", "i", &work));
+  CHECK_OK (i8x_ctx_get_funcref (ctx, "test", "slow", "i", "i", &slow));
+  CHECK_OK (i8x_ctx_get_funcref (ctx, "test", "nested", "i", "i",
+				 &nested));
+}
+
+static struct i8x_call calls[NUM_CALLS];
+static union i8x_value args[NUM_CALLS], rets[NUM_CALLS];
+
+static void
+set_call (size_t i, struct i8x_funcref *ref, intptr_t arg)
+{
+  memset (&calls[i], 0, sizeof (calls[i]));
+  calls[i].ref = ref;
+  calls[i].args = &args[i];
+  calls[i].rets = &rets[i];
+  calls[i].result = I8X_OK + 1;
+  args[i].i = arg;
+  rets[i].i = -1;
+}
+
+/* Every call's results are stored with the call, whichever worker
+   made it.  */
+
+static void
+test_ordering (struct i8x_exec *exec)
+{
+  size_t i;
+
+  for (i = 0; i < NUM_CALLS; i++)
+    {
+      if (i % 3 == 0)
+	set_call (i, factorial, i % 13);
+      else
+	set_call (i, work, i);
+    }
+
+  CHECK_OK (i8x_exec_run (exec, calls, NUM_CALLS));
+
+  for (i = 0; i < NUM_CALLS; i++)
+    {
+      CHECK (calls[i].result == I8X_OK);
+      if (i % 3 == 0)
+	CHECK (rets[i].i == test_ifact (i % 13));
+      else
+	CHECK (rets[i].i == (intptr_t) i * 2);
+    }
+
+  /* An empty batch does nothing.  */
+  CHECK_OK (i8x_exec_run (exec, NULL, 0));
+}
+
+/* The error returned is that of the lowest-indexed failing call,
+   however the calls were divided between the workers.  */
+
+static void
+test_first_error (struct i8x_exec *exec)
+{
+  static const struct
+  {
+    size_t index;
+    i8x_err_e code;
+  }
+  failures[] =
+    {
+      {NUM_CALLS - 1, I8X_EINVAL},
+      {NUM_CALLS / 2 + 1, I8X_EIO},
+      {NUM_CALLS / 4 - 1, I8X_EAGAIN},
+      {NUM_CALLS / 16 + 1, I8X_ENOMEM},
+    };
+  size_t num_failures = sizeof (failures) / sizeof (failures[0]);
+  size_t i, j;
+
+  /* Add the failures one at a time, each before the ones already
+     added, so each in turn is the first.  Some of the calls before
+     the newest failure are slow, so the others are likely to happen
+     before it.  */
+  for (j = 0; j < num_failures; j++)
+    {
+      for (i = 0; i < NUM_CALLS; i++)
+	set_call (i, i < failures[j].index && i % 8 == 0 ? slow : work, i);
+
+      for (i = 0; i <= j; i++)
+	args[failures[i].index].i = failures[i].code;
+
+      CHECK (i8x_exec_run (exec, calls, NUM_CALLS) == failures[j].code);
+
+      for (i = 0; i < NUM_CALLS; i++)
+	{
+	  size_t k;
+
+	  for (k = 0; k <= j; k++)
+	    if (failures[k].index == i)
+	      break;
+
+	  if (k <= j)
+	    CHECK (calls[i].result == failures[k].code);
+	  else
+	    {
+	      CHECK (calls[i].result == I8X_OK);
+	      CHECK (rets[i].i == (intptr_t) i * 2);
+	    }
+	}
+    }
+}
+
+/* Workers that run out of calls steal them from the others.  */
+
+static void
+test_stealing (struct i8x_exec *exec)
+{
+  unsigned int num_workers = i8x_exec_get_num_workers (exec);
+  size_t total_calls = 0, total_stolen = 0, total_steals = 0;
+  unsigned int w;
+  size_t i;
+
+  /* Worker zero's share of the calls is slow, and the rest are
+     fast, so the other workers finish early and steal from it.  */
+  for (i = 0; i < NUM_CALLS; i++)
+    set_call (i, i < NUM_CALLS / num_workers ? slow : work, i);
+
+  CHECK_OK (i8x_exec_run (exec, calls, NUM_CALLS));
+
+  for (i = 0; i < NUM_CALLS; i++)
+    CHECK (rets[i].i == (intptr_t) i * 2);
+
+  for (w = 0; w < num_workers; w++)
+    {
+      struct i8x_worker_stats stats;
+
+      CHECK_OK (i8x_exec_get_worker_stats (exec, w, &stats));
+      total_calls += stats.num_calls;
+      total_stolen += stats.num_stolen;
+      total_steals += stats.num_steals;
+    }
+
+  CHECK (total_calls == NUM_CALLS);
+  if (num_workers > 1)
+    {
+      CHECK (total_steals > 0);
+      CHECK (total_stolen >= total_steals);
+    }
+
+  CHECK (i8x_exec_get_worker_stats (exec, num_workers, NULL)
+	 == I8X_EINVAL);
+}
+
+/* A native function may run a batch on another executor.  Errors
+   in the outer batch after the inner one has finished are still
+   reported with their location.  */
+
+static void
+test_nesting (void)
+{
+  struct i8x_exec *exec;
+  char buf[BUFSIZ];
+  const char *msg;
+
+  CHECK_OK (i8x_exec_new (ctx, 1, STACK_SLOTS, &exec));
+  CHECK_OK (i8x_exec_new (ctx, 1, STACK_SLOTS, &inner_exec));
+
+  set_call (0, nested, 5);
+  set_call (1, factorial, 5);
+
+  CHECK (i8x_exec_run (exec, calls, 2) == I8X_CANCELLED);
+  CHECK (calls[0].result == I8X_OK);
+  CHECK (rets[0].i == test_ifact (5));
+  CHECK (calls[1].result == I8X_CANCELLED);
+
+  /* The error is attributed to the factorial's note.  */
+  msg = i8x_ctx_strerror_r (ctx, I8X_CANCELLED, buf, sizeof (buf));
+  CHECK (strncmp (msg, TEST_IFACT_FILE "[",
+		  strlen (TEST_IFACT_FILE "[")) == 0);
+
+  inner_exec = i8x_exec_unref (inner_exec);
+  i8x_exec_unref (exec);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct i8x_exec *exec;
+
+  ctx = test_ctx_new ();
+  factorial = test_load_ifact (ctx, NULL);
+  register_natives ();
+
+  CHECK_OK (i8x_exec_new (ctx, NUM_WORKERS, STACK_SLOTS, &exec));
+  CHECK (i8x_exec_get_num_workers (exec) >= 1);
+  CHECK (i8x_exec_get_num_workers (exec) <= NUM_WORKERS);
+
+  test_ordering (exec);
+  test_first_error (exec);
+  test_stealing (exec);
+  i8x_exec_unref (exec);
+
+  test_nesting ();
+
+  i8x_funcref_unref (nested);
+  i8x_funcref_unref (slow);
+  i8x_funcref_unref (work);
+  i8x_funcref_unref (factorial);
+  i8x_ctx_unref (ctx);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* Test the context's hash tables through the function references
+   and function types they intern.  Each reference is inserted when
+   it is first asked for and removed when its last reference is
+   dropped, so creating and releasing references exercises insertion,
+   lookup, removal, tombstones and resizing.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "testutil.h"
+
+/* Enough references to grow the tables several times over.  */
+#define NUM_REFS 2000
+
+/* Parameter types, so that function types are interned too.  */
+static const char *const ptypes[] = {"", "i", "ii", "p", "ip", "o"};
+#define NUM_PTYPES (sizeof (ptypes) / sizeof (ptypes[0]))
+
+static struct i8x_ctx *ctx;
+static struct i8x_funcref *refs[NUM_REFS];
+
+static struct i8x_funcref *
+get_ref (size_t i)
+{
+  struct i8x_funcref *ref;
+  char name[32], fullname[64];
+
+  snprintf (name, sizeof (name), "f%zu", i);
+  CHECK_OK (i8x_ctx_get_funcref (ctx, "test", name,
+				 ptypes[i % NUM_PTYPES], "i", &ref));
+
+  snprintf (fullname, sizeof (fullname), "test::%s(%s)i",
+	    name, ptypes[i % NUM_PTYPES]);
+  CHECK (strcmp (i8x_funcref_get_fullname (ref), fullname) == 0);
+
+  return ref;
+}
+
+/* Check that asking for reference I again returns the same object.  */
+
+static void
+check_interned (size_t i)
+{
+  struct i8x_funcref *ref = get_ref (i);
+
+  CHECK (ref == refs[i]);
+  i8x_funcref_unref (ref);
+}
+
+int
+main (int argc, char *argv[])
+{
+  size_t i;
+
+  ctx = test_ctx_new ();
+
+  /* Insert.  */
+  for (i = 0; i < NUM_REFS; i++)
+    refs[i] = get_ref (i);
+
+  for (i = 0; i < NUM_REFS; i++)
+    check_interned (i);
+
+  /* Forget every other reference, leaving tombstones in every
+     probe sequence, and check the rest can still be found.  */
+  for (i = 0; i < NUM_REFS; i += 2)
+    refs[i] = i8x_funcref_unref (refs[i]);
+
+  for (i = 1; i < NUM_REFS; i += 2)
+    check_interned (i);
+
+  /* Reinsert them.  */
+  for (i = 0; i < NUM_REFS; i += 2)
+    refs[i] = get_ref (i);
+
+  for (i = 0; i < NUM_REFS; i++)
+    check_interned (i);
+
+  /* Churn one reference at a time, so the table fills up with
+     tombstones without growing and must be rehashed in place.  */
+  for (int round = 0; round < 50; round++)
+    {
+      for (i = round % 7; i < NUM_REFS; i += 7)
+	{
+	  refs[i] = i8x_funcref_unref (refs[i]);
+	  refs[i] = get_ref (i);
+	}
+
+      for (i = 0; i < NUM_REFS; i += 13)
+	check_interned (i);
+    }
+
+  for (i = 0; i < NUM_REFS; i++)
+    check_interned (i);
+
+  /* Forget everything, then insert again into the emptied table.  */
+  for (i = 0; i < NUM_REFS; i++)
+    refs[i] = i8x_funcref_unref (refs[i]);
+
+  for (i = 0; i < NUM_REFS; i++)
+    refs[i] = get_ref (i);
+
+  for (i = 0; i < NUM_REFS; i++)
+    check_interned (i);
+
+  for (i = 0; i < NUM_REFS; i++)
+    i8x_funcref_unref (refs[i]);
+
+  i8x_ctx_unref (ctx);
+
+  return EXIT_SUCCESS;
+}
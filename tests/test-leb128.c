@@ -0,0 +1,332 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* Test LEB128 decoding.  Every encoding is decoded both at the end
+   of a chunk, where encodings shorter than a word are decoded a byte
+   at a time, and with padding after it, where the decoder reads the
+   first eight bytes of every encoding as a single word.  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "testutil.h"
+
+/* Chunk type for the encodings.  Unknown chunks are ignored by
+   everything but this test.  */
+#define TEST_CHUNK 0x7f
+
+/* Bytes of padding that put the encodings on the word-at-a-time
+   path.  The padding is all terminating bytes, so encodings that
+   run into it would decode without error.  */
+#define PADDING 16
+
+static struct i8x_ctx *ctx;
+
+/* Create a note with a chunk holding ENCODED followed by PADDING
+   bytes of padding, if PADDED, and a second chunk after that.  */
+
+static struct i8x_note *
+make_note (const char *encoded, size_t size, bool padded)
+{
+  size_t payload_size = size + (padded ? PADDING : 0);
+  char buf[64], *ptr = buf;
+  struct i8x_note *note;
+
+  CHECK (payload_size < 0x80);
+
+  *(ptr++) = TEST_CHUNK;	/* type_id */
+  *(ptr++) = 1;			/* version */
+  *(ptr++) = payload_size;	/* size */
+  memcpy (ptr, encoded, size);
+  ptr += size;
+  if (padded)
+    {
+      memset (ptr, 0x01, PADDING);
+      ptr += PADDING;
+    }
+
+  /* A chunk of non-terminating bytes, so encodings that run past
+     the end of the first chunk would not be terminated here.  */
+  *(ptr++) = TEST_CHUNK - 1;	/* type_id */
+  *(ptr++) = 1;			/* version */
+  *(ptr++) = 8;			/* size */
+  memset (ptr, 0xff, 8);
+  ptr += 8;
+
+  CHECK_OK (i8x_note_new_from_buf (ctx, buf, ptr - buf, "test", -1,
+				   &note));
+
+  return note;
+}
+
+/* Create a read buffer for the first chunk of NOTE.  */
+
+static struct i8x_readbuf *
+make_readbuf (struct i8x_note *note)
+{
+  struct i8x_readbuf *rb;
+  struct i8x_chunk *chunk;
+
+  CHECK_OK (i8x_note_get_unique_chunk (note, TEST_CHUNK, true, &chunk));
+  CHECK_OK (i8x_rb_new_from_chunk (chunk, &rb));
+
+  return rb;
+}
+
+/* Check that ENCODED decodes to EXPECTED with or without padding,
+   and that exactly SIZE bytes are consumed.  */
+
+static void
+check_uleb128 (const char *encoded, size_t size, uintmax_t expected)
+{
+  for (int padded = 0; padded <= 1; padded++)
+    {
+      struct i8x_note *note = make_note (encoded, size, padded);
+      struct i8x_readbuf *rb = make_readbuf (note);
+      size_t before = i8x_rb_bytes_left (rb);
+      uintmax_t result;
+
+      CHECK_OK (i8x_rb_read_uleb128 (rb, &result));
+      CHECK (result == expected);
+      CHECK (before - i8x_rb_bytes_left (rb) == size);
+
+      i8x_rb_unref (rb);
+      i8x_note_unref (note);
+    }
+}
+
+static void
+check_sleb128 (const char *encoded, size_t size, intmax_t expected)
+{
+  for (int padded = 0; padded <= 1; padded++)
+    {
+      struct i8x_note *note = make_note (encoded, size, padded);
+      struct i8x_readbuf *rb = make_readbuf (note);
+      size_t before = i8x_rb_bytes_left (rb);
+      intmax_t result;
+
+      CHECK_OK (i8x_rb_read_sleb128 (rb, &result));
+      CHECK (result == expected);
+      CHECK (before - i8x_rb_bytes_left (rb) == size);
+
+      i8x_rb_unref (rb);
+      i8x_note_unref (note);
+    }
+}
+
+/* Check that decoding ENCODED fails with EXPECTED, with padding if
+   PADDED, and that nothing is consumed.  */
+
+static void
+check_error (const char *encoded, size_t size, bool padded,
+	     bool is_signed, i8x_err_e expected)
+{
+  struct i8x_note *note = make_note (encoded, size, padded);
+  struct i8x_readbuf *rb = make_readbuf (note);
+  size_t before = i8x_rb_bytes_left (rb);
+
+  if (is_signed)
+    {
+      intmax_t result;
+
+      CHECK (i8x_rb_read_sleb128 (rb, &result) == expected);
+    }
+  else
+    {
+      uintmax_t result;
+
+      CHECK (i8x_rb_read_uleb128 (rb, &result) == expected);
+    }
+  CHECK (i8x_rb_bytes_left (rb) == before);
+
+  i8x_rb_unref (rb);
+  i8x_note_unref (note);
+}
+
+/* Encode VALUE as unsigned LEB128 padded to at least MINSIZE bytes
+   with redundant continuation bytes.  Returns the size.  */
+
+static size_t
+encode_uleb128 (char *buf, uintmax_t value, size_t minsize)
+{
+  size_t size = 0;
+
+  do
+    {
+      uint8_t byte = value & 0x7f;
+
+      value >>= 7;
+      if (value != 0 || size + 1 < minsize)
+	byte |= 0x80;
+      buf[size++] = byte;
+    }
+  while (value != 0 || size < minsize);
+
+  return size;
+}
+
+static size_t
+encode_sleb128 (char *buf, intmax_t value)
+{
+  size_t size = 0;
+  bool more;
+
+  do
+    {
+      uint8_t byte = value & 0x7f;
+
+      value >>= 7;
+      more = !((value == 0 && !(byte & 0x40))
+	       || (value == -1 && (byte & 0x40)));
+      if (more)
+	byte |= 0x80;
+      buf[size++] = byte;
+    }
+  while (more);
+
+  return size;
+}
+
+static void
+test_uleb128 (void)
+{
+  char buf[32];
+  size_t size;
+
+  /* One byte.  */
+  check_uleb128 ("\x00", 1, 0);
+  check_uleb128 ("\x7f", 1, 0x7f);
+
+  /* Two bytes, from the DWARF specification.  */
+  check_uleb128 ("\x80\x01", 2, 128);
+  check_uleb128 ("\xb9\x64", 2, 12857);
+
+  /* Every length from one to ten bytes, with every payload bit
+     set, so any bit the word-at-a-time decoder drops or shifts
+     wrongly shows.  */
+  for (unsigned int nbytes = 1; nbytes <= 9; nbytes++)
+    {
+      uintmax_t value = ((uintmax_t) 1 << (nbytes * 7)) - 1;
+
+      size = encode_uleb128 (buf, value, 0);
+      CHECK (size == nbytes);
+      check_uleb128 (buf, size, value);
+    }
+  size = encode_uleb128 (buf, UINTMAX_MAX, 0);
+  CHECK (size == 10);
+  check_uleb128 (buf, size, UINTMAX_MAX);
+
+  /* Alternating bits, at the eight and nine byte boundaries.  */
+  size = encode_uleb128 (buf, UINT64_C (0x00aaaaaaaaaaaaaa), 0);
+  CHECK (size == 8);
+  check_uleb128 (buf, size, UINT64_C (0x00aaaaaaaaaaaaaa));
+
+  size = encode_uleb128 (buf, UINT64_C (0x5555555555555555), 0);
+  CHECK (size == 9);
+  check_uleb128 (buf, size, UINT64_C (0x5555555555555555));
+
+  /* Redundant continuation bytes are allowed up to ten bytes.  */
+  size = encode_uleb128 (buf, 5, 8);
+  check_uleb128 (buf, size, 5);
+  size = encode_uleb128 (buf, 5, 10);
+  check_uleb128 (buf, size, 5);
+}
+
+static void
+test_sleb128 (void)
+{
+  static const intmax_t values[] =
+    {
+      0, 1, -1, 63, -64, 64, -65, 127, -128, 8191, -8192,
+      INT64_C (0x7fffffffffffff), -INT64_C (0x80000000000000),
+      INT64_C (0x80000000000000), -INT64_C (0x80000000000001),
+      INT64_C (0x3fffffffffffffff), -INT64_C (0x4000000000000000),
+      INTMAX_MAX, INTMAX_MIN,
+    };
+  char buf[32];
+  size_t size;
+
+  /* From the DWARF specification.  */
+  check_sleb128 ("\x02", 1, 2);
+  check_sleb128 ("\x7e", 1, -2);
+  check_sleb128 ("\xff\x00", 2, 127);
+  check_sleb128 ("\x81\x7f", 2, -127);
+  check_sleb128 ("\x80\x7f", 2, -128);
+
+  for (size_t i = 0; i < sizeof (values) / sizeof (values[0]); i++)
+    {
+      size = encode_sleb128 (buf, values[i]);
+      check_sleb128 (buf, size, values[i]);
+    }
+
+  /* The largest and smallest values need all ten bytes.  */
+  CHECK (encode_sleb128 (buf, INTMAX_MAX) == 10);
+  CHECK (encode_sleb128 (buf, INTMAX_MIN) == 10);
+}
+
+static void
+test_errors (void)
+{
+  char buf[32];
+
+  /* Encodings that run past the end of the chunk.  Those of eight
+     or more bytes are long enough for the first word to be read
+     in one go before the decoder reaches the limit.  */
+  for (unsigned int nbytes = 1; nbytes <= 10; nbytes++)
+    {
+      memset (buf, 0x80, nbytes);
+      check_error (buf, nbytes, false, false, I8X_NOTE_CORRUPT);
+      check_error (buf, nbytes, false, true, I8X_NOTE_CORRUPT);
+    }
+
+  /* Eleven bytes is too long for uintmax_t even if the value
+     would fit.  */
+  memset (buf, 0x80, 10);
+  buf[10] = 0;
+  check_error (buf, 11, true, false, I8X_NOTE_UNHANDLED);
+  check_error (buf, 11, false, false, I8X_NOTE_UNHANDLED);
+  check_error (buf, 11, true, true, I8X_NOTE_UNHANDLED);
+
+  /* Ten bytes whose last byte has payload bits that would be
+     shifted out of uintmax_t.  */
+  memset (buf, 0xff, 9);
+  buf[9] = 0x02;
+  check_error (buf, 10, true, false, I8X_NOTE_UNHANDLED);
+  check_error (buf, 10, false, false, I8X_NOTE_UNHANDLED);
+
+  /* For signed values those bits must be copies of the sign.  */
+  buf[9] = 0x7e;
+  check_error (buf, 10, true, true, I8X_NOTE_UNHANDLED);
+  buf[9] = 0x01;
+  check_error (buf, 10, true, true, I8X_NOTE_UNHANDLED);
+}
+
+int
+main (int argc, char *argv[])
+{
+  ctx = test_ctx_new ();
+
+  test_uleb128 ();
+  test_sleb128 ();
+  test_errors ();
+
+  i8x_ctx_unref (ctx);
+
+  return EXIT_SUCCESS;
+}
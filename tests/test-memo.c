@@ -0,0 +1,176 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* Test remembering the results of calls to pure functions.  The
+   factorial is pure, and loops at least once however it is called,
+   so with no fuel left a call succeeds only if its results were
+   remembered.  */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "testutil.h"
+
+#define STACK_SLOTS 512
+#define MEMO_SIZE 64
+#define MAX_ARG 20
+
+static struct i8x_ctx *ctx;
+static struct i8x_funcref *factorial;
+static struct i8x_xctx *xctx;
+
+/* Check whether calling the factorial of X returns remembered
+   results, by calling it with no fuel.  */
+
+static void
+check_remembered (intptr_t x, bool expected)
+{
+  intptr_t result;
+  i8x_err_e err;
+
+  i8x_xctx_set_fuel (xctx, 0);
+  err = test_call_ifact (xctx, factorial, x, &result);
+  i8x_xctx_set_fuel (xctx, I8X_FUEL_UNLIMITED);
+
+  if (expected)
+    {
+      CHECK (err == I8X_OK);
+      CHECK (result == test_ifact (x));
+    }
+  else
+    CHECK (err == I8X_FUEL_EXHAUSTED);
+}
+
+/* Calls with the same arguments return the remembered results.  */
+
+static void
+test_hits (void)
+{
+  intptr_t x;
+
+  /* Nothing is remembered without a cache.  */
+  test_check_ifact (xctx, factorial, 5);
+  check_remembered (5, false);
+
+  CHECK_OK (i8x_funcref_set_memo_size (factorial, MEMO_SIZE));
+  check_remembered (5, false);
+
+  for (x = 0; x <= MAX_ARG; x++)
+    {
+      test_check_ifact (xctx, factorial, x);
+      check_remembered (x, true);
+      check_remembered (x, true);
+
+      /* Other arguments are not matched.  */
+      check_remembered (x + 1, false);
+    }
+
+  /* Failed calls are not remembered.  */
+  check_remembered (MAX_ARG + 2, false);
+  check_remembered (MAX_ARG + 2, false);
+}
+
+/* Updating the context forgets everything.  */
+
+static void
+test_epochs (void)
+{
+  struct i8x_funcref *ref;
+  struct i8x_func *func;
+
+  test_check_ifact (xctx, factorial, 7);
+  check_remembered (7, true);
+
+  CHECK_OK (i8x_ctx_get_funcref (ctx, "test", "zero", "", "i", &ref));
+  CHECK_OK (i8x_func_new_native (ctx, ref, test_return_zero, &func));
+  CHECK_OK (i8x_ctx_register_func (ctx, func));
+  check_remembered (7, false);
+
+  test_check_ifact (xctx, factorial, 7);
+  check_remembered (7, true);
+
+  CHECK_OK (i8x_ctx_unregister_func (ctx, func));
+  check_remembered (7, false);
+
+  test_check_ifact (xctx, factorial, 7);
+  check_remembered (7, true);
+
+  i8x_func_unref (func);
+  i8x_funcref_unref (ref);
+}
+
+/* Callers may pass the same array for the arguments and returns,
+   whether or not the results are remembered.  */
+
+static void
+test_aliasing (void)
+{
+  union i8x_value values[1];
+  intptr_t x;
+
+  for (x = 0; x <= MAX_ARG; x++)
+    {
+      values[0].i = x;
+      CHECK_OK (i8x_xctx_call (xctx, factorial, NULL, values, values));
+      CHECK (values[0].i == test_ifact (x));
+
+      i8x_xctx_set_fuel (xctx, 0);
+      values[0].i = x;
+      CHECK_OK (i8x_xctx_call (xctx, factorial, NULL, values, values));
+      CHECK (values[0].i == test_ifact (x));
+      i8x_xctx_set_fuel (xctx, I8X_FUEL_UNLIMITED);
+    }
+}
+
+/* Caches that are too big are refused, and the existing one kept.
+   Setting the size to zero forgets everything.  */
+
+static void
+test_sizes (void)
+{
+  test_check_ifact (xctx, factorial, 9);
+  check_remembered (9, true);
+
+  CHECK (i8x_funcref_set_memo_size (factorial, SIZE_MAX) == I8X_EINVAL);
+  check_remembered (9, true);
+
+  CHECK_OK (i8x_funcref_set_memo_size (factorial, 0));
+  check_remembered (9, false);
+  test_check_ifact (xctx, factorial, 9);
+  check_remembered (9, false);
+}
+
+int
+main (int argc, char *argv[])
+{
+  ctx = test_ctx_new ();
+  factorial = test_load_ifact (ctx, NULL);
+  CHECK_OK (i8x_xctx_new (ctx, STACK_SLOTS, &xctx));
+
+  test_hits ();
+  test_epochs ();
+  test_aliasing ();
+  test_sizes ();
+
+  i8x_xctx_unref (xctx);
+  i8x_funcref_unref (factorial);
+  i8x_ctx_unref (ctx);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,226 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* Test unregistering functions by origin, with the origins of
+   loaded ELF files and with origins set by the user, and that files
+   with nothing to load are ignored.  */
+
+#include <elf.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "testutil.h"
+
+/* Native functions registered with each user origin.  */
+#define NUM_FUNCS 50
+
+static int num_unavailable;
+
+static void
+func_unavailable (struct i8x_func *func)
+{
+  num_unavailable++;
+}
+
+/* Register NUM_FUNCS native functions with ORIGIN, storing their
+   references in REFS.  The function with index KEEP is stored in
+   KEPT, if KEPT is not NULL.  */
+
+static void
+register_funcs (struct i8x_ctx *ctx, const char *provider,
+		const void *origin, struct i8x_funcref **refs,
+		int keep, struct i8x_func **kept)
+{
+  for (int i = 0; i < NUM_FUNCS; i++)
+    {
+      struct i8x_func *func;
+      char name[32];
+
+      snprintf (name, sizeof (name), "f%d", i);
+      CHECK_OK (i8x_ctx_get_funcref (ctx, provider, name, "", "i",
+				     &refs[i]));
+      CHECK_OK (i8x_func_new_native (ctx, refs[i], test_return_zero,
+				     &func));
+      i8x_func_set_origin (func, origin);
+      CHECK_OK (i8x_ctx_register_func (ctx, func));
+      if (kept != NULL && i == keep)
+	*kept = func;
+      else
+	i8x_func_unref (func);
+    }
+}
+
+static void
+check_resolved (struct i8x_funcref **refs, bool expected)
+{
+  for (int i = 0; i < NUM_FUNCS; i++)
+    CHECK (i8x_funcref_is_resolved (refs[i]) == expected);
+}
+
+static void
+unref_all (struct i8x_funcref **refs)
+{
+  for (int i = 0; i < NUM_FUNCS; i++)
+    i8x_funcref_unref (refs[i]);
+}
+
+static void
+test_elf_origins (struct i8x_ctx *ctx)
+{
+  struct i8x_load_stats stats;
+  struct i8x_funcref *ref;
+  const void *old_origin;
+
+  ref = test_load_ifact (ctx, &stats);
+  CHECK (!stats.was_loaded);
+  CHECK (stats.origin != NULL);
+  CHECK (i8x_funcref_is_resolved (ref));
+  old_origin = stats.origin;
+
+  /* Loading the file again registers nothing new.  */
+  CHECK_OK (i8x_ctx_load_elf (ctx, TEST_IFACT_FILE, &stats));
+  CHECK (stats.was_loaded);
+  CHECK (stats.origin == old_origin);
+
+  /* Unloading it unregisters its functions and calls observers.  */
+  CHECK_OK (i8x_ctx_unregister_origin (ctx, old_origin));
+  CHECK (!i8x_funcref_is_resolved (ref));
+  CHECK (num_unavailable == 1);
+
+  /* The file may be loaded again, with a new handle.  */
+  i8x_funcref_unref (ref);
+  ref = test_load_ifact (ctx, &stats);
+  CHECK (!stats.was_loaded);
+  CHECK (stats.origin != NULL);
+  CHECK (stats.origin != old_origin);
+  CHECK (i8x_funcref_is_resolved (ref));
+
+  /* The old handle is stale and must not unload the new copy.  */
+  CHECK_OK (i8x_ctx_unregister_origin (ctx, old_origin));
+  CHECK (i8x_funcref_is_resolved (ref));
+  CHECK (num_unavailable == 1);
+
+  CHECK_OK (i8x_ctx_load_elf (ctx, TEST_IFACT_FILE, &stats));
+  CHECK (stats.was_loaded);
+
+  CHECK_OK (i8x_ctx_unregister_origin (ctx, stats.origin));
+  CHECK (!i8x_funcref_is_resolved (ref));
+  CHECK (num_unavailable == 2);
+
+  i8x_funcref_unref (ref);
+}
+
+/* Files which are not regular files, and ELF files with a byte
+   order other than this host's, load nothing without failing.  */
+
+static void
+test_ignored_files (struct i8x_ctx *ctx)
+{
+  struct i8x_load_stats stats;
+  unsigned char ident[EI_NIDENT] = {0};
+  FILE *fp;
+
+  CHECK_OK (i8x_ctx_load_elf (ctx, "/dev/null", &stats));
+  CHECK (!stats.was_loaded);
+  CHECK (stats.num_notes == 0);
+  CHECK (stats.num_funcs == 0);
+  CHECK (stats.origin == NULL);
+
+  memcpy (ident, ELFMAG, SELFMAG);
+  ident[EI_CLASS] = ELFCLASS64;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+  ident[EI_DATA] = ELFDATA2MSB;
+#else
+  ident[EI_DATA] = ELFDATA2LSB;
+#endif
+  ident[EI_VERSION] = EV_CURRENT;
+
+  fp = tmpfile ();
+  CHECK (fp != NULL);
+  CHECK (fwrite (ident, sizeof (ident), 1, fp) == 1);
+  CHECK (fflush (fp) == 0);
+
+  CHECK_OK (i8x_ctx_load_elf_fd (ctx, fileno (fp), NULL, &stats));
+  CHECK (!stats.was_loaded);
+  CHECK (stats.num_notes == 0);
+  CHECK (stats.num_funcs == 0);
+
+  CHECK_OK (i8x_ctx_unregister_origin (ctx, stats.origin));
+  fclose (fp);
+}
+
+static void
+test_user_origins (struct i8x_ctx *ctx)
+{
+  static int origin_a, origin_b;
+  struct i8x_funcref *refs_a[NUM_FUNCS], *refs_b[NUM_FUNCS];
+  struct i8x_func *func;
+
+  register_funcs (ctx, "a", &origin_a, refs_a, 7, &func);
+  register_funcs (ctx, "b", &origin_b, refs_b, 0, NULL);
+  check_resolved (refs_a, true);
+  check_resolved (refs_b, true);
+
+  /* Unregister one function from the middle of A's list, so the
+     rest must still be found and unregistered with the origin.  */
+  CHECK_OK (i8x_ctx_unregister_func (ctx, func));
+  CHECK (!i8x_funcref_is_resolved (refs_a[7]));
+
+  /* It is no longer registered.  */
+  CHECK (i8x_ctx_unregister_func (ctx, func) == I8X_EINVAL);
+  i8x_func_unref (func);
+
+  CHECK_OK (i8x_ctx_unregister_origin (ctx, &origin_a));
+  check_resolved (refs_a, false);
+  check_resolved (refs_b, true);
+
+  /* Nothing is left with origin A.  */
+  CHECK_OK (i8x_ctx_unregister_origin (ctx, &origin_a));
+  check_resolved (refs_b, true);
+
+  CHECK_OK (i8x_ctx_unregister_origin (ctx, &origin_b));
+  check_resolved (refs_b, false);
+
+  /* Origins may be reused by the user once unregistered.  */
+  unref_all (refs_a);
+  register_funcs (ctx, "a", &origin_a, refs_a, 0, NULL);
+  check_resolved (refs_a, true);
+
+  unref_all (refs_a);
+  unref_all (refs_b);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct i8x_ctx *ctx = test_ctx_new ();
+
+  i8x_ctx_set_func_unavailable_cb (ctx, func_unavailable);
+
+  test_elf_origins (ctx);
+  test_ignored_files (ctx);
+  test_user_origins (ctx);
+
+  /* Functions still registered are released with the context.  */
+  i8x_ctx_unref (ctx);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,161 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* Test that promoting hot functions does not change their results.
+   The thresholds are lowered so the factorial is promoted after a
+   few calls, or part way through a call by its loop, and calls are
+   made alternately with the standard and debug interpreters before
+   and after promotion.  Errors must be reported at the same place
+   in the note whether or not the code raising them was promoted.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "testutil.h"
+
+#define STACK_SLOTS 512
+
+/* Arguments to call the factorial with, in order.  */
+#define MAX_ARG 20
+
+/* Times to call it with each argument.  */
+#define NUM_ROUNDS 5
+
+static void
+test_thresholds (unsigned int calls, unsigned int backedges)
+{
+  struct i8x_ctx *ctx = test_ctx_new ();
+  struct i8x_xctx *std, *dbg;
+  struct i8x_funcref *ref;
+  int round;
+  intptr_t x;
+
+  i8x_ctx_set_tiering_thresholds (ctx, calls, backedges);
+  ref = test_load_ifact (ctx, NULL);
+
+  CHECK_OK (i8x_xctx_new (ctx, STACK_SLOTS, &std));
+  CHECK_OK (i8x_xctx_new (ctx, STACK_SLOTS, &dbg));
+  i8x_xctx_set_use_debug_interpreter (std, false);
+  i8x_xctx_set_use_debug_interpreter (dbg, true);
+  CHECK (!i8x_xctx_get_use_debug_interpreter (std));
+  CHECK (i8x_xctx_get_use_debug_interpreter (dbg));
+
+  for (round = 0; round < NUM_ROUNDS; round++)
+    {
+      for (x = 0; x <= MAX_ARG; x++)
+	{
+	  intptr_t std_result, dbg_result;
+
+	  /* Alternate which goes first, so each interpreter makes
+	     the call that crosses the threshold in some rounds.  */
+	  if ((round + x) % 2 == 0)
+	    {
+	      std_result = test_check_ifact (std, ref, x);
+	      dbg_result = test_check_ifact (dbg, ref, x);
+	    }
+	  else
+	    {
+	      dbg_result = test_check_ifact (dbg, ref, x);
+	      std_result = test_check_ifact (std, ref, x);
+	    }
+
+	  CHECK (std_result == dbg_result);
+	}
+    }
+
+  i8x_xctx_unref (dbg);
+  i8x_xctx_unref (std);
+  i8x_funcref_unref (ref);
+  i8x_ctx_unref (ctx);
+}
+
+/* Call the factorial with no fuel, after calling it NUM_CALLS times
+   with unlimited fuel in a context that promotes it after PROMOTE_AT
+   calls, and store the resulting error message in BUF.  Budgets are
+   charged when the loop branches back, so the error is raised by a
+   budget check.  */
+
+static void
+get_fuel_error (unsigned int promote_at, int num_calls, bool use_dbg,
+		char *buf, size_t bufsiz)
+{
+  struct i8x_ctx *ctx = test_ctx_new ();
+  struct i8x_funcref *ref;
+  struct i8x_xctx *xctx;
+  intptr_t result;
+
+  i8x_ctx_set_tiering_thresholds (ctx, promote_at, 0);
+  ref = test_load_ifact (ctx, NULL);
+
+  CHECK_OK (i8x_xctx_new (ctx, STACK_SLOTS, &xctx));
+  i8x_xctx_set_use_debug_interpreter (xctx, use_dbg);
+
+  for (int i = 0; i < num_calls; i++)
+    test_check_ifact (xctx, ref, 5);
+
+  i8x_xctx_set_fuel (xctx, 0);
+  CHECK (test_call_ifact (xctx, ref, 5, &result) == I8X_FUEL_EXHAUSTED);
+  i8x_ctx_strerror_r (ctx, I8X_FUEL_EXHAUSTED, buf, bufsiz);
+
+  i8x_xctx_unref (xctx);
+  i8x_funcref_unref (ref);
+  i8x_ctx_unref (ctx);
+}
+
+static void
+test_error_location (void)
+{
+  char cold[BUFSIZ], buf[BUFSIZ];
+
+  get_fuel_error (0, 0, false, cold, sizeof (cold));
+  CHECK (strncmp (cold, TEST_IFACT_FILE "[",
+		  strlen (TEST_IFACT_FILE "[")) == 0);
+
+  get_fuel_error (0, 0, true, buf, sizeof (buf));
+  CHECK (strcmp (buf, cold) == 0);
+
+  get_fuel_error (1, 3, false, buf, sizeof (buf));
+  CHECK (strcmp (buf, cold) == 0);
+
+  get_fuel_error (1, 3, true, buf, sizeof (buf));
+  CHECK (strcmp (buf, cold) == 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  /* Never promoted, for comparison.  */
+  test_thresholds (0, 0);
+
+  /* Promoted by calls alone, on the first call or after a few.  */
+  test_thresholds (1, 0);
+  test_thresholds (3, 0);
+
+  /* Promoted by the loop alone, part way through a call.  */
+  test_thresholds (0, 1);
+  test_thresholds (0, 7);
+
+  /* Whichever comes first.  */
+  test_thresholds (4, 30);
+
+  test_error_location ();
+
+  return EXIT_SUCCESS;
+}
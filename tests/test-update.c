@@ -0,0 +1,177 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* Test that availability observers are called once for every
+   change, whether functions are registered and unregistered inside
+   an update or outside one, or by an observer.  */
+
+#include <stdlib.h>
+
+#include "testutil.h"
+
+/* Native functions the available observer registers with the
+   same signature as the factorial, making it ambiguous.  Enough to
+   grow its reference's list of registered functions past its
+   inline storage.  */
+#define NUM_CLASHES 8
+
+static struct i8x_ctx *ctx;
+static struct i8x_funcref *ref;
+static struct i8x_func *factorial;
+static struct i8x_func *clashes[NUM_CLASHES];
+static bool register_clashes;
+static int num_available;
+static int num_unavailable;
+
+static void
+func_available (struct i8x_func *func)
+{
+  if (factorial == NULL)
+    factorial = i8x_func_ref (func);
+
+  CHECK (func == factorial);
+  num_available++;
+
+  /* Registering functions from an observer makes the factorial
+     unavailable again straight away.  */
+  if (register_clashes)
+    {
+      register_clashes = false;
+
+      for (int i = 0; i < NUM_CLASHES; i++)
+	{
+	  CHECK_OK (i8x_func_new_native (ctx, ref, test_return_zero,
+					 &clashes[i]));
+	  CHECK_OK (i8x_ctx_register_func (ctx, clashes[i]));
+	}
+
+      CHECK (!i8x_funcref_is_resolved (ref));
+    }
+}
+
+static void
+func_unavailable (struct i8x_func *func)
+{
+  CHECK (func == factorial);
+  num_unavailable++;
+}
+
+static void
+check_counts (int available, int unavailable)
+{
+  CHECK (num_available == available);
+  CHECK (num_unavailable == unavailable);
+}
+
+int
+main (int argc, char *argv[])
+{
+  ctx = test_ctx_new ();
+
+  i8x_ctx_set_func_available_cb (ctx, func_available);
+  i8x_ctx_set_func_unavailable_cb (ctx, func_unavailable);
+
+  ref = test_load_ifact (ctx, NULL);
+  CHECK (factorial != NULL);
+  CHECK (i8x_funcref_is_resolved (ref));
+  check_counts (1, 0);
+
+  /* Outside an update.  */
+  CHECK_OK (i8x_ctx_unregister_func (ctx, factorial));
+  CHECK (!i8x_funcref_is_resolved (ref));
+  check_counts (1, 1);
+
+  CHECK_OK (i8x_ctx_register_func (ctx, factorial));
+  CHECK (i8x_funcref_is_resolved (ref));
+  check_counts (2, 1);
+
+  /* Inside an update, observers are called at commit, after calls
+     stop using the function.  */
+  i8x_ctx_begin_update (ctx);
+  CHECK_OK (i8x_ctx_unregister_func (ctx, factorial));
+  CHECK (i8x_funcref_is_resolved (ref));
+  check_counts (2, 1);
+  i8x_ctx_commit_update (ctx);
+  CHECK (!i8x_funcref_is_resolved (ref));
+  check_counts (2, 2);
+
+  i8x_ctx_begin_update (ctx);
+  CHECK_OK (i8x_ctx_register_func (ctx, factorial));
+  check_counts (2, 2);
+  i8x_ctx_commit_update (ctx);
+  CHECK (i8x_funcref_is_resolved (ref));
+  check_counts (3, 2);
+
+  /* Nested updates notify once the outermost is committed.  */
+  i8x_ctx_begin_update (ctx);
+  i8x_ctx_begin_update (ctx);
+  CHECK_OK (i8x_ctx_unregister_func (ctx, factorial));
+  i8x_ctx_commit_update (ctx);
+  check_counts (3, 2);
+  i8x_ctx_commit_update (ctx);
+  check_counts (3, 3);
+
+  /* A function unregistered and registered again within one update
+     never stopped being available, so nothing is called.  */
+  CHECK_OK (i8x_ctx_register_func (ctx, factorial));
+  check_counts (4, 3);
+
+  i8x_ctx_begin_update (ctx);
+  CHECK_OK (i8x_ctx_unregister_func (ctx, factorial));
+  CHECK_OK (i8x_ctx_register_func (ctx, factorial));
+  i8x_ctx_commit_update (ctx);
+  CHECK (i8x_funcref_is_resolved (ref));
+  check_counts (4, 3);
+
+  /* Observers may register functions, which changes the list of
+     registered functions of the reference being notified.  The
+     factorial is notified of both changes, in order.  */
+  CHECK_OK (i8x_ctx_unregister_func (ctx, factorial));
+  check_counts (4, 4);
+
+  register_clashes = true;
+  CHECK_OK (i8x_ctx_register_func (ctx, factorial));
+  CHECK (!register_clashes);
+  CHECK (!i8x_funcref_is_resolved (ref));
+  check_counts (5, 5);
+
+  i8x_ctx_begin_update (ctx);
+  for (int i = 0; i < NUM_CLASHES; i++)
+    {
+      CHECK_OK (i8x_ctx_unregister_func (ctx, clashes[i]));
+      i8x_func_unref (clashes[i]);
+    }
+  i8x_ctx_commit_update (ctx);
+  CHECK (i8x_funcref_is_resolved (ref));
+  check_counts (6, 5);
+
+  /* Observers are still called if the caller drops its reference
+     to the function before the update is committed.  FACTORIAL is
+     only compared with after this.  */
+  i8x_ctx_begin_update (ctx);
+  CHECK_OK (i8x_ctx_unregister_func (ctx, factorial));
+  i8x_func_unref (factorial);
+  i8x_ctx_commit_update (ctx);
+  check_counts (6, 6);
+
+  i8x_funcref_unref (ref);
+  i8x_ctx_unref (ctx);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "testutil.h"
+
+void
+test_fail (const char *file, int line, const char *expr)
+{
+  fprintf (stderr, "%s:%d: check failed: %s\n", file, line, expr);
+  exit (EXIT_FAILURE);
+}
+
+struct i8x_ctx *
+test_ctx_new (void)
+{
+  struct i8x_ctx *ctx;
+
+  CHECK_OK (i8x_ctx_new (&ctx));
+
+  return ctx;
+}
+
+struct i8x_funcref *
+test_load_ifact (struct i8x_ctx *ctx, struct i8x_load_stats *stats)
+{
+  struct i8x_funcref *ref;
+
+  CHECK_OK (i8x_ctx_load_elf (ctx, TEST_IFACT_FILE, stats));
+  CHECK_OK (i8x_ctx_get_funcref (ctx, "test", "factorial",
+				 "i", "i", &ref));
+
+  return ref;
+}
+
+i8x_err_e
+test_call_ifact (struct i8x_xctx *xctx, struct i8x_funcref *ref,
+		 intptr_t x, intptr_t *result)
+{
+  union i8x_value args[1], rets[1];
+  i8x_err_e err;
+
+  args[0].i = x;
+  err = i8x_xctx_call (xctx, ref, NULL, args, rets);
+  if (err == I8X_OK)
+    *result = rets[0].i;
+
+  return err;
+}
+
+intptr_t
+test_ifact (intptr_t x)
+{
+  intptr_t result = 1;
+
+  for (; x > 1; x--)
+    result *= x;
+
+  return result;
+}
+
+intptr_t
+test_check_ifact (struct i8x_xctx *xctx, struct i8x_funcref *ref,
+		  intptr_t x)
+{
+  intptr_t result;
+
+  CHECK_OK (test_call_ifact (xctx, ref, x, &result));
+  CHECK (result == test_ifact (x));
+
+  return result;
+}
+
+i8x_err_e
+test_return_zero (struct i8x_xctx *xctx, struct i8x_inferior *inf,
+		  union i8x_value *args, union i8x_value *rets)
+{
+  rets[0].i = 0;
+
+  return I8X_OK;
+}
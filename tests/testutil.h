@@ -0,0 +1,79 @@
+/* Copyright (C) 2016 Red Hat, Inc.
+   This file is part of the Infinity Note Execution Library.
+
+   The Infinity Note Execution Library is free software; you can
+   redistribute it and/or modify it under the terms of the GNU Lesser
+   General Public License as published by the Free Software
+   Foundation; either version 2.1 of the License, or (at your option)
+   any later version.
+
+   The Infinity Note Execution Library is distributed in the hope that
+   it will be useful, but WITHOUT ANY WARRANTY; without even the
+   implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Infinity Note Execution Library; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef _TESTUTIL_H_
+#define _TESTUTIL_H_
+
+#include <i8x/libi8x.h>
+
+/* Fail the test if EXPR is false.  */
+
+#define CHECK(expr)						\
+  do {								\
+    if (!(expr))						\
+      test_fail (__FILE__, __LINE__, #expr);			\
+  } while (0)
+
+/* Fail the test if EXPR does not return I8X_OK.  */
+
+#define CHECK_OK(expr) CHECK ((expr) == I8X_OK)
+
+void test_fail (const char *file, int line, const char *expr)
+  __attribute__ ((noreturn));
+
+/* Create a context.  */
+
+struct i8x_ctx *test_ctx_new (void);
+
+/* The object file assembled from tests/ifact.S.  Tests are run
+   from the top build directory.  */
+
+#define TEST_IFACT_FILE "tests/ifact.o"
+
+/* Load test::factorial(i)i from TEST_IFACT_FILE and return a
+   reference to it.  STATS may be NULL.  */
+
+struct i8x_funcref *test_load_ifact (struct i8x_ctx *ctx,
+				     struct i8x_load_stats *stats);
+
+/* Call test::factorial through REF with argument X.  */
+
+i8x_err_e test_call_ifact (struct i8x_xctx *xctx,
+			   struct i8x_funcref *ref,
+			   intptr_t x, intptr_t *result);
+
+/* The value test::factorial should return for X.  */
+
+intptr_t test_ifact (intptr_t x);
+
+/* Call test::factorial through REF with argument X, check that it
+   succeeds and returns the right value, and return that value.  */
+
+intptr_t test_check_ifact (struct i8x_xctx *xctx,
+			   struct i8x_funcref *ref, intptr_t x);
+
+/* A native function that returns zero, for functions of type
+   ()i to be implemented by.  */
+
+i8x_err_e test_return_zero (struct i8x_xctx *xctx,
+			    struct i8x_inferior *inf,
+			    union i8x_value *args,
+			    union i8x_value *rets);
+
+#endif /* _TESTUTIL_H_ */